@@ -1,5 +1,5 @@
 // LibraNet_extended.cpp
-// Compile: g++ -std=c++17 LibraNet_extended.cpp -o LibraNet.exe -Wall -Wextra
+// Compile: g++ -std=c++17 LibraNet_extended.cpp -o LibraNet.exe -Wall -Wextra -pthread
 
 #include <iostream>
 #include <string>
@@ -9,13 +9,55 @@
 #include <memory>
 #include <chrono>
 #include <mutex>
-#include <regex>
+#include <string_view>
+#include <limits>
 #include <sstream>
 #include <iomanip>
 #include <optional>
 #include <cmath>
 #include <ctime>
 #include <algorithm>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <filesystem>
+#include <cstdio>
+#include <cstring>
+#include <unordered_set>
+#include <deque>
+#include <set>
+#include <shared_mutex>
+#include <array>
+#include <type_traits>
+#include <iterator>
+#include <charconv>
+#include <fstream>
+#include <regex>        // only for the durations benchmark's reference parser
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <csignal>
+#include <cerrno>
+#include <malloc.h>
+#endif
 
 using std::string;
 using std::vector;
@@ -60,19 +102,345 @@ public:
 };
 
 
+/* ---------- Metrics ---------- */
+
+// Which LibraryException subtype was thrown; counted by the exception itself.
+enum class ErrorKind : uint8_t { Library, NotFound, InvalidInput, Borrow, Return, Archive, ItemNotAvailable,
+                                 Persistence, kCount };
+
+// Hot-path instrumentation: latency histograms for service calls, wait/hold
+// times for the repo locks and a count per exception type. Each thread writes
+// only its own block (plain relaxed load+store, no read-modify-write), and a
+// report sums all blocks under the registry lock. Building with
+// -DLIBRANET_NO_METRICS turns all of it into empty inline functions.
+namespace metrics {
+enum class Op : uint8_t { Borrow, Return, Renew, Reserve, Cancel, Search, kCount };
+enum class Lock : uint8_t { Items, Users, Records, Fines, Search, Other, kCount };
+
+inline const char* name(Op op) {
+    static const char* names[] = {"borrow", "return", "renew", "reserve", "cancel", "search"};
+    return names[static_cast<size_t>(op)];
+}
+inline const char* name(Lock lock) {
+    static const char* names[] = {"items", "users", "records", "fines", "search", "other"};
+    return names[static_cast<size_t>(lock)];
+}
+inline const char* name(ErrorKind kind) {
+    static const char* names[] = {"LibraryException", "NotFoundException", "InvalidInputException", "BorrowException",
+                                  "ReturnException", "ArchiveException", "ItemNotAvailableException", "PersistenceException"};
+    return names[static_cast<size_t>(kind)];
+}
+
+#ifndef LIBRANET_NO_METRICS
+using clock = std::chrono::steady_clock;
+
+// bucket k counts samples <= 128ns << k; the last one is +Inf
+constexpr size_t kBuckets = 24;
+
+inline size_t bucketOf(uint64_t ns) {
+    size_t k = 0;
+    for (uint64_t bound = 128; k + 1 < kBuckets && ns > bound; bound <<= 1) ++k;
+    return k;
+}
+
+// single-writer counter: the owning thread bumps it, readers only load
+inline void bump(std::atomic<uint64_t>& c, uint64_t n = 1) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct Histogram {
+    std::atomic<uint64_t> buckets[kBuckets] = {};
+    std::atomic<uint64_t> sumNs{0};
+    void record(uint64_t ns) {
+        bump(buckets[bucketOf(ns)]);
+        bump(sumNs, ns);
+    }
+};
+
+struct Block {
+    Histogram ops[static_cast<size_t>(Op::kCount)];
+    Histogram lockWait[static_cast<size_t>(Lock::kCount)];
+    Histogram lockHold[static_cast<size_t>(Lock::kCount)];
+    std::atomic<uint64_t> errors[static_cast<size_t>(ErrorKind::kCount)] = {};
+};
+
+// plain sums of Blocks, for reports and for threads that have exited
+struct Totals {
+    struct H { uint64_t buckets[kBuckets] = {}; uint64_t sumNs = 0; };
+    H ops[static_cast<size_t>(Op::kCount)];
+    H lockWait[static_cast<size_t>(Lock::kCount)];
+    H lockHold[static_cast<size_t>(Lock::kCount)];
+    uint64_t errors[static_cast<size_t>(ErrorKind::kCount)] = {};
+
+    static void add(H& to, const Histogram& from) {
+        for (size_t k = 0; k < kBuckets; ++k) to.buckets[k] += from.buckets[k].load(std::memory_order_relaxed);
+        to.sumNs += from.sumNs.load(std::memory_order_relaxed);
+    }
+    void add(const Block& b) {
+        for (size_t i = 0; i < std::size(ops); ++i) add(ops[i], b.ops[i]);
+        for (size_t i = 0; i < std::size(lockWait); ++i) { add(lockWait[i], b.lockWait[i]); add(lockHold[i], b.lockHold[i]); }
+        for (size_t i = 0; i < std::size(errors); ++i) errors[i] += b.errors[i].load(std::memory_order_relaxed);
+    }
+};
+
+class Registry {
+    std::mutex mtx_;
+    vector<Block*> live_;
+    Totals retired_;
+public:
+    static Registry& instance() {
+        static Registry r;
+        return r;
+    }
+    void enroll(Block* b) {
+        std::lock_guard<std::mutex> l(mtx_);
+        live_.push_back(b);
+    }
+    void retire(Block* b) {
+        std::lock_guard<std::mutex> l(mtx_);
+        retired_.add(*b);
+        live_.erase(std::remove(live_.begin(), live_.end(), b), live_.end());
+    }
+    Totals collect() {
+        std::lock_guard<std::mutex> l(mtx_);
+        Totals t = retired_;
+        for (auto b : live_) t.add(*b);
+        return t;
+    }
+};
+
+// this thread's block; enrolled on first use, folded into the totals at thread exit
+inline Block& local() {
+    struct Holder {
+        Block block;
+        Holder() { Registry::instance().enroll(&block); }
+        ~Holder() { Registry::instance().retire(&block); }
+    };
+    static thread_local Holder h;
+    return h.block;
+}
+
+inline uint64_t since(clock::time_point t0) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t0).count());
+}
+
+inline void countError(ErrorKind kind) { bump(local().errors[static_cast<size_t>(kind)]); }
+
+// times one service call from construction to scope exit, thrown or not
+class OpTimer {
+    Op op_;
+    clock::time_point t0_ = clock::now();
+public:
+    explicit OpTimer(Op op) : op_(op) {}
+    ~OpTimer() { local().ops[static_cast<size_t>(op_)].record(since(t0_)); }
+    OpTimer(const OpTimer&) = delete;
+    OpTimer& operator=(const OpTimer&) = delete;
+};
+
+// Drop-in for a repo mutex that records how long lockers waited and, for
+// exclusive locks, how long they held it.
+template<typename M>
+class InstrumentedMutex {
+    M m_;
+    Lock site_ = Lock::Other;
+    clock::time_point acquiredAt_;   // written by the exclusive owner only
+    Histogram& wait() { return local().lockWait[static_cast<size_t>(site_)]; }
+public:
+    InstrumentedMutex() = default;
+    explicit InstrumentedMutex(Lock site) : site_(site) {}
+    void setSite(Lock site) { site_ = site; }
+
+    void lock() {
+        auto t0 = clock::now();
+        m_.lock();
+        acquiredAt_ = clock::now();
+        wait().record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(acquiredAt_ - t0).count()));
+    }
+    bool try_lock() {
+        if (!m_.try_lock()) return false;
+        acquiredAt_ = clock::now();
+        return true;
+    }
+    void unlock() {
+        local().lockHold[static_cast<size_t>(site_)].record(since(acquiredAt_));
+        m_.unlock();
+    }
+    void lock_shared() {
+        auto t0 = clock::now();
+        m_.lock_shared();
+        wait().record(since(t0));
+    }
+    bool try_lock_shared() { return m_.try_lock_shared(); }
+    void unlock_shared() { m_.unlock_shared(); }
+};
+
+inline void histogram(std::ostream& out, const char* metric, const char* label, const char* value, const Totals::H& h) {
+    uint64_t cumulative = 0;
+    for (size_t k = 0; k < kBuckets; ++k) {
+        cumulative += h.buckets[k];
+        out << metric << "_bucket{" << label << "=\"" << value << "\",le=\"";
+        if (k + 1 == kBuckets) out << "+Inf";
+        else out << (128e-9 * static_cast<double>(1ull << k));
+        out << "\"} " << cumulative << "\n";
+    }
+    out << metric << "_sum{" << label << "=\"" << value << "\"} " << h.sumNs * 1e-9 << "\n";
+    out << metric << "_count{" << label << "=\"" << value << "\"} " << cumulative << "\n";
+}
+
+// everything recorded so far, in the Prometheus text exposition format
+inline string prometheus() {
+    Totals t = Registry::instance().collect();
+    std::ostringstream out;
+    out << "# HELP libranet_op_duration_seconds LibraryService call latency.\n"
+        << "# TYPE libranet_op_duration_seconds histogram\n";
+    for (size_t i = 0; i < std::size(t.ops); ++i)
+        histogram(out, "libranet_op_duration_seconds", "op", name(static_cast<Op>(i)), t.ops[i]);
+    out << "# HELP libranet_lock_wait_seconds Time spent waiting for a repo lock.\n"
+        << "# TYPE libranet_lock_wait_seconds histogram\n";
+    for (size_t i = 0; i < std::size(t.lockWait); ++i)
+        histogram(out, "libranet_lock_wait_seconds", "lock", name(static_cast<Lock>(i)), t.lockWait[i]);
+    out << "# HELP libranet_lock_hold_seconds Time a repo lock was held exclusively.\n"
+        << "# TYPE libranet_lock_hold_seconds histogram\n";
+    for (size_t i = 0; i < std::size(t.lockHold); ++i)
+        histogram(out, "libranet_lock_hold_seconds", "lock", name(static_cast<Lock>(i)), t.lockHold[i]);
+    out << "# HELP libranet_exceptions_total LibraryExceptions thrown, by type.\n"
+        << "# TYPE libranet_exceptions_total counter\n";
+    for (size_t i = 0; i < std::size(t.errors); ++i)
+        out << "libranet_exceptions_total{type=\"" << name(static_cast<ErrorKind>(i)) << "\"} " << t.errors[i] << "\n";
+    return out.str();
+}
+#else
+inline void countError(ErrorKind) {}
+
+struct OpTimer {
+    explicit OpTimer(Op) {}
+};
+
+template<typename M>
+struct InstrumentedMutex : M {
+    InstrumentedMutex() = default;
+    explicit InstrumentedMutex(Lock) {}
+    void setSite(Lock) {}
+};
+
+inline string prometheus() { return "# metrics disabled at build time (LIBRANET_NO_METRICS)\n"; }
+#endif
+}
+
+
 struct LibraryException : public std::runtime_error {
-    explicit LibraryException(const string& msg) : std::runtime_error(msg) {}
+    explicit LibraryException(const string& msg, ErrorKind kind = ErrorKind::Library)
+      : std::runtime_error(msg), kind_(kind) { metrics::countError(kind); }
+    ErrorKind kind() const { return kind_; }
+private:
+    ErrorKind kind_;
+};
+struct NotFoundException : public LibraryException {
+    explicit NotFoundException(const string& msg) : LibraryException(msg, ErrorKind::NotFound) {}
+};
+struct InvalidInputException : public LibraryException {
+    explicit InvalidInputException(const string& msg) : LibraryException(msg, ErrorKind::InvalidInput) {}
+};
+struct BorrowException : public LibraryException {
+    explicit BorrowException(const string& msg, ErrorKind kind = ErrorKind::Borrow) : LibraryException(msg, kind) {}
+};
+struct ReturnException : public LibraryException {
+    explicit ReturnException(const string& msg) : LibraryException(msg, ErrorKind::Return) {}
+};
+struct ArchiveException : public LibraryException {
+    explicit ArchiveException(const string& msg) : LibraryException(msg, ErrorKind::Archive) {}
+};
+struct ItemNotAvailableException : public BorrowException {
+    explicit ItemNotAvailableException(const string& msg) : BorrowException(msg, ErrorKind::ItemNotAvailable) {}
+};
+struct PersistenceException : public LibraryException {
+    explicit PersistenceException(const string& msg) : LibraryException(msg, ErrorKind::Persistence) {}
+};
+
+
+/* ---------- Clocks ---------- */
+
+// Where the service gets "now" from. Records never read a clock themselves;
+// the service passes them the time.
+class Clock {
+public:
+    virtual ~Clock() = default;
+    virtual system_clock::time_point now() const = 0;
+};
+
+class SystemClock : public Clock {
+public:
+    system_clock::time_point now() const override { return system_clock::now(); }
+};
+
+inline const Clock& systemClock() {
+    static const SystemClock clock;
+    return clock;
+}
+
+// Wall time cached by a ticker thread every `resolution`; now() is a single
+// relaxed load, at the price of being up to one tick behind.
+class CoarseClock : public Clock {
+    std::atomic<int64_t> ns_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread ticker_;
+
+    static int64_t wall() {
+        return duration_cast<std::chrono::nanoseconds>(system_clock::now().time_since_epoch()).count();
+    }
+public:
+    explicit CoarseClock(std::chrono::milliseconds resolution = std::chrono::milliseconds(1)) : ns_(wall()) {
+        ticker_ = std::thread([this, resolution] {
+            std::unique_lock<std::mutex> l(mtx_);
+            while (!cv_.wait_for(l, resolution, [this] { return stop_; }))
+                ns_.store(wall(), std::memory_order_relaxed);
+        });
+    }
+    ~CoarseClock() override {
+        {
+            std::lock_guard<std::mutex> l(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        ticker_.join();
+    }
+    system_clock::time_point now() const override {
+        return system_clock::time_point(duration_cast<system_clock::duration>(
+            std::chrono::nanoseconds(ns_.load(std::memory_order_relaxed))));
+    }
+};
+
+// Time that only moves when told to, so weeks of borrowing and fines can be
+// run in seconds. Safe to read and advance from several threads.
+class SimulatedClock : public Clock {
+    const int64_t start_;
+    std::atomic<int64_t> ns_;
+public:
+    explicit SimulatedClock(system_clock::time_point start = system_clock::now())
+      : start_(duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count()), ns_(start_) {}
+    system_clock::time_point now() const override {
+        return system_clock::time_point(duration_cast<system_clock::duration>(
+            std::chrono::nanoseconds(ns_.load(std::memory_order_acquire))));
+    }
+    void advance(system_clock::duration d) {
+        ns_.fetch_add(duration_cast<std::chrono::nanoseconds>(d).count(), std::memory_order_acq_rel);
+    }
+    // how far it has been advanced past its start
+    system_clock::duration offset() const {
+        return duration_cast<system_clock::duration>(std::chrono::nanoseconds(ns_.load(std::memory_order_acquire) - start_));
+    }
+    // moves it to start + d (a restart resuming an earlier run's offset)
+    void setOffset(system_clock::duration d) {
+        ns_.store(start_ + duration_cast<std::chrono::nanoseconds>(d).count(), std::memory_order_release);
+    }
 };
-struct NotFoundException : public LibraryException { using LibraryException::LibraryException; };
-struct InvalidInputException : public LibraryException { using LibraryException::LibraryException; };
-struct BorrowException : public LibraryException { using LibraryException::LibraryException; };
-struct ReturnException : public LibraryException { using LibraryException::LibraryException; };
-struct ArchiveException : public LibraryException { using LibraryException::LibraryException; };
-struct ItemNotAvailableException : public BorrowException { using BorrowException::BorrowException; };
 
 
 enum class AvailabilityStatus { AVAILABLE, BORROWED, RESERVED, MAINTENANCE };
-enum class BorrowStatus { ACTIVE, RETURNED, OVERDUE };
+enum class BorrowStatus : uint8_t { ACTIVE, RETURNED, OVERDUE };
+enum class ItemKind : uint8_t { Book = 1, Audiobook, EMagazine };
 
 
 class BorrowDuration {
@@ -82,67 +450,242 @@ class BorrowDuration {
 public:
     BorrowDuration() = default;
 
-    static BorrowDuration parse(const string& input) {
-        string s = input;
+    // Hand-rolled matcher for the duration grammar; works in place on the
+    // view and only allocates when it has to throw.
+    static BorrowDuration parse(std::string_view s) {
         // trim
-        auto trim = [](string& t) {
-            size_t a = t.find_first_not_of(" \t\n\r");
-            size_t b = t.find_last_not_of(" \t\n\r");
-            if (a == string::npos) { t.clear(); return; }
-            t = t.substr(a, b - a + 1);
-        };
-        trim(s);
-        if (s.empty()) throw InvalidInputException("Empty duration string");
+        size_t a = s.find_first_not_of(" \t\n\r");
+        if (a == std::string_view::npos) throw InvalidInputException("Empty duration string");
+        s = s.substr(a, s.find_last_not_of(" \t\n\r") - a + 1);
 
-        // Date range: YYYY-MM-DD to YYYY-MM-DD
-        std::regex rangeRx(R"((\d{4}-\d{2}-\d{2})\s+to\s+(\d{4}-\d{2}-\d{2}))", std::regex::icase);
-        std::smatch m;
-        if (std::regex_search(s, m, rangeRx)) {
-            std::tm t1 = {}, t2 = {};
-            std::istringstream ss1(m[1].str()), ss2(m[2].str());
-            ss1 >> std::get_time(&t1, "%Y-%m-%d");
-            ss2 >> std::get_time(&t2, "%Y-%m-%d");
-            if (ss1.fail() || ss2.fail()) throw InvalidInputException("Invalid date format in range");
-            std::time_t tt1 = std::mktime(&t1);
-            std::time_t tt2 = std::mktime(&t2);
-            if (tt1 == -1 || tt2 == -1) throw InvalidInputException("Failed to convert dates");
-            system_clock::time_point p1 = system_clock::from_time_t(tt1);
-            system_clock::time_point p2 = system_clock::from_time_t(tt2);
+        // Date range: YYYY-MM-DD to YYYY-MM-DD (may appear anywhere in the input)
+        for (size_t i = 0; i + 10 <= s.size(); ++i) {
+            size_t p = i;
+            if (!matchDate(s, p)) continue;
+            size_t ws = p;
+            while (p < s.size() && isSpace(s[p])) ++p;
+            if (p == ws || p + 2 > s.size() || lower(s[p]) != 't' || lower(s[p + 1]) != 'o') continue;
+            p += 2; ws = p;
+            while (p < s.size() && isSpace(s[p])) ++p;
+            size_t second = p;
+            if (p == ws || !matchDate(s, p)) continue;
+            system_clock::time_point p1 = toTimePoint(s.substr(i, 10));
+            system_clock::time_point p2 = toTimePoint(s.substr(second, 10));
             if (p2 <= p1) throw InvalidInputException("End date must be after start date");
             BorrowDuration bd; bd.explicitRange_ = true; bd.end_ = p2; return bd;
         }
 
-        std::regex isoRx(R"(^(P(?:(\d+)D)|PT?(?:(\d+)H))$)", std::regex::icase);
-        if (std::regex_search(s, m, isoRx)) {
-            if (m[1].matched) {
-                int days = std::stoi(m[1].str());
-                BorrowDuration bd; bd.dur_ = hours(24 * days); return bd;
-            }
-            if (m[2].matched) {
-                int hrs = std::stoi(m[2].str());
-                BorrowDuration bd; bd.dur_ = hours(hrs); return bd;
+        // ISO-8601 subset: P<n>D, P<n>H, PT<n>H
+        if (lower(s[0]) == 'p' && s.size() >= 3) {
+            size_t p = 1;
+            bool t = lower(s[p]) == 't';
+            if (t) ++p;
+            int64_t num = 0;
+            if (parseNumber(s, p, num) && p + 1 == s.size()) {
+                char unit = lower(s[p]);
+                if (unit == 'd' && !t) { BorrowDuration bd; bd.dur_ = hours(24 * checked(num)); return bd; }
+                if (unit == 'h') { BorrowDuration bd; bd.dur_ = hours(checked(num)); return bd; }
             }
         }
 
-        std::regex nlRx(R"(^\s*(\d+)\s*(days?|d|weeks?|w|hours?|h)\s*$)", std::regex::icase);
-        if (std::regex_search(s, m, nlRx)) {
-            int num = std::stoi(m[1].str());
-            string unit = m[2].str();
-            BorrowDuration bd;
-            if (std::regex_search(unit, std::regex(R"(week|w)", std::regex::icase))) bd.dur_ = hours(24 * 7 * num);
-            else if (std::regex_search(unit, std::regex(R"(day|d)", std::regex::icase))) bd.dur_ = hours(24 * num);
-            else if (std::regex_search(unit, std::regex(R"(hour|h)", std::regex::icase))) bd.dur_ = hours(num);
-            else throw InvalidInputException("Unsupported duration unit");
-            return bd;
+        // Natural language: "10 days", "2 weeks", "48h"
+        {
+            size_t p = 0;
+            while (p < s.size() && isSpace(s[p])) ++p;
+            int64_t num = 0;
+            if (parseNumber(s, p, num)) {
+                while (p < s.size() && isSpace(s[p])) ++p;
+                size_t u = p;
+                while (p < s.size() && !isSpace(s[p])) ++p;
+                std::string_view unit = s.substr(u, p - u);
+                while (p < s.size() && isSpace(s[p])) ++p;
+                if (p == s.size()) {
+                    BorrowDuration bd;
+                    if (unitIs(unit, "w", "week", "weeks")) { bd.dur_ = hours(24 * 7 * checked(num)); return bd; }
+                    if (unitIs(unit, "d", "day", "days")) { bd.dur_ = hours(24 * checked(num)); return bd; }
+                    if (unitIs(unit, "h", "hour", "hours")) { bd.dur_ = hours(checked(num)); return bd; }
+                }
+            }
         }
 
         throw InvalidInputException("Unsupported duration format. Supported: '10 days', '2 weeks', 'P14D', 'PT48H', 'YYYY-MM-DD to YYYY-MM-DD'");
     }
 
-    system_clock::time_point computeDueAt(system_clock::time_point borrowStart = system_clock::now()) const {
+    system_clock::time_point computeDueAt(system_clock::time_point borrowStart) const {
         if (explicitRange_) return end_;
         return borrowStart + dur_;
     }
+
+private:
+    static bool isSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+    static char lower(char c) { return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c; }
+
+    static bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+        if (a.size() != b.size()) return false;
+        for (size_t i = 0; i < a.size(); ++i) if (lower(a[i]) != b[i]) return false;
+        return true;
+    }
+    static bool unitIs(std::string_view u, std::string_view a, std::string_view b, std::string_view c) {
+        return equalsIgnoreCase(u, a) || equalsIgnoreCase(u, b) || equalsIgnoreCase(u, c);
+    }
+
+    // one or more digits; advances p. Values past INT_MAX saturate and are
+    // rejected by checked() once the rest of the grammar has matched.
+    static bool parseNumber(std::string_view s, size_t& p, int64_t& out) {
+        size_t start = p;
+        int64_t v = 0;
+        for (; p < s.size() && isDigit(s[p]); ++p) {
+            if (v <= std::numeric_limits<int>::max()) v = v * 10 + (s[p] - '0');
+        }
+        out = v;
+        return p > start;
+    }
+    static int64_t checked(int64_t v) {
+        if (v > std::numeric_limits<int>::max()) throw InvalidInputException("Duration value out of range");
+        return v;
+    }
+
+    // \d{4}-\d{2}-\d{2} at p; advances p past it on success
+    static bool matchDate(std::string_view s, size_t& p) {
+        static const char shape[] = "dddd-dd-dd";
+        if (p + 10 > s.size()) return false;
+        for (size_t k = 0; k < 10; ++k) {
+            char c = s[p + k];
+            if (shape[k] == 'd' ? !isDigit(c) : c != '-') return false;
+        }
+        p += 10;
+        return true;
+    }
+
+    static int digitsAt(std::string_view s, size_t pos, size_t n) {
+        int v = 0;
+        for (size_t k = 0; k < n; ++k) v = v * 10 + (s[pos + k] - '0');
+        return v;
+    }
+
+    // date already matched the YYYY-MM-DD shape; same field limits as get_time("%Y-%m-%d")
+    static system_clock::time_point toTimePoint(std::string_view d) {
+        int month = digitsAt(d, 5, 2), day = digitsAt(d, 8, 2);
+        if (month < 1 || month > 12 || day < 1 || day > 31) throw InvalidInputException("Invalid date format in range");
+        std::tm t = {};
+        t.tm_year = digitsAt(d, 0, 4) - 1900;
+        t.tm_mon = month - 1;
+        t.tm_mday = day;
+        std::time_t tt = std::mktime(&t);
+        if (tt == -1) throw InvalidInputException("Failed to convert dates");
+        return system_clock::from_time_t(tt);
+    }
+};
+
+
+/* ---------- String pool ---------- */
+
+// Process-wide interning for strings repeated across many objects (authors,
+// narrators, metadata keys and values). Each distinct string is stored once,
+// in append-only blocks, and never freed, so its view and its 32-bit id stay
+// valid for the life of the process. Id 0 is the empty string. Interning
+// takes one of 16 shard locks; turning an id back into a view takes none.
+class StringPool {
+    static constexpr size_t kShards = 16;
+    static constexpr size_t kBlock = 64 * 1024;      // arena block; longer strings get their own
+    static constexpr size_t kChunk = 4096;           // ids per table chunk
+    static constexpr size_t kChunks = 1 << 14;       // so at most 64M distinct strings
+
+    struct alignas(64) Shard {
+        std::mutex mtx;
+        unordered_map<std::string_view, uint32_t> ids;
+        vector<std::unique_ptr<char[]>> blocks;      // kBlock each, the last one being filled
+        vector<std::unique_ptr<char[]>> large;       // one per string over kBlock / 4
+        size_t used = kBlock;                        // bytes taken in blocks.back()
+    };
+    std::array<Shard, kShards> shards_;
+
+    // id -> view; a chunk is published before any id in it is handed out
+    std::unique_ptr<std::atomic<std::string_view*>[]> chunks_{new std::atomic<std::string_view*>[kChunks]()};
+    std::mutex growMtx_;
+    std::atomic<uint32_t> next_{1};
+    std::atomic<size_t> bytes_{0};
+
+    StringPool() { slot(0) = std::string_view(); }
+    ~StringPool() {
+        for (size_t c = 0; c < kChunks; ++c) delete[] chunks_[c].load(std::memory_order_relaxed);
+    }
+
+    std::string_view& slot(uint32_t id) {
+        auto& chunk = chunks_[id / kChunk];
+        auto p = chunk.load(std::memory_order_acquire);
+        if (!p) {
+            std::lock_guard<std::mutex> l(growMtx_);
+            p = chunk.load(std::memory_order_relaxed);
+            if (!p) {
+                p = new std::string_view[kChunk];
+                chunk.store(p, std::memory_order_release);
+            }
+        }
+        return p[id % kChunk];
+    }
+
+    // caller holds sh.mtx
+    std::string_view copy(Shard& sh, std::string_view s) {
+        bytes_.fetch_add(s.size(), std::memory_order_relaxed);
+        char* at;
+        if (s.size() > kBlock / 4) {
+            sh.large.emplace_back(new char[s.size()]);
+            at = sh.large.back().get();
+        } else {
+            if (sh.used + s.size() > kBlock) {
+                sh.blocks.emplace_back(new char[kBlock]);
+                sh.used = 0;
+            }
+            at = sh.blocks.back().get() + sh.used;
+            sh.used += s.size();
+        }
+        std::memcpy(at, s.data(), s.size());
+        return {at, s.size()};
+    }
+
+public:
+    static StringPool& instance() {
+        static StringPool pool;
+        return pool;
+    }
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    uint32_t intern(std::string_view s) {
+        if (s.empty()) return 0;
+        Shard& sh = shards_[std::hash<std::string_view>()(s) % kShards];
+        std::lock_guard<std::mutex> l(sh.mtx);
+        auto it = sh.ids.find(s);
+        if (it != sh.ids.end()) return it->second;
+        uint32_t id = next_.fetch_add(1, std::memory_order_relaxed);
+        if (id / kChunk >= kChunks) throw LibraryException("String pool is full");
+        auto stored = copy(sh, s);
+        slot(id) = stored;
+        sh.ids.emplace(stored, id);
+        return id;
+    }
+
+    // the id of s if it was ever interned; never adds it
+    optional<uint32_t> find(std::string_view s) {
+        if (s.empty()) return 0u;
+        Shard& sh = shards_[std::hash<std::string_view>()(s) % kShards];
+        std::lock_guard<std::mutex> l(sh.mtx);
+        auto it = sh.ids.find(s);
+        if (it == sh.ids.end()) return nullopt;
+        return it->second;
+    }
+
+    // id must come from intern()
+    std::string_view view(uint32_t id) const {
+        return chunks_[id / kChunk].load(std::memory_order_acquire)[id % kChunk];
+    }
+
+    std::string_view store(std::string_view s) { return view(intern(s)); }
+
+    size_t size() const { return next_.load(std::memory_order_relaxed); }
+    size_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
 };
 
 
@@ -150,27 +693,56 @@ class User {
     int id_;
     string name_;
     int borrowLimit_;
+    std::atomic<int> activeBorrows_{0};   // maintained by LibraryService borrow/return
 public:
     explicit User(int id = 0, string name = "", int borrowLimit = 5) : id_(id), name_(move(name)), borrowLimit_(borrowLimit) {}
     int id() const { return id_; }
-    string name() const { return name_; }
+    std::string_view name() const { return name_; }
     int borrowLimit() const { return borrowLimit_; }
+    int activeBorrows() const { return activeBorrows_.load(std::memory_order_relaxed); }
+
+    // Takes one borrow slot unless the user is at their limit. Concurrent
+    // callers cannot overshoot: the count only moves by CAS from below the limit.
+    bool tryAcquireBorrow() {
+        int n = activeBorrows_.load(std::memory_order_relaxed);
+        do {
+            if (n >= borrowLimit_) return false;
+        } while (!activeBorrows_.compare_exchange_weak(n, n + 1, std::memory_order_relaxed));
+        return true;
+    }
+    void releaseBorrow() { activeBorrows_.fetch_sub(1, std::memory_order_relaxed); }
+    // recovery, and carrying the count over when a user is re-saved
+    void restoreActiveBorrows(int n) { activeBorrows_.store(n, std::memory_order_relaxed); }
 };
 
+// Why a fine was charged; the text is rebuilt from the code and its parameter.
+enum class FineReason : uint8_t { Other, Overdue };
+
+// Fixed-size fine record, stored by value in FineRepo's slabs.
 class Fine {
-    int id_;
-    int itemId_;
-    int userId_;
+    int id_ = 0;
+    int itemId_ = 0;
+    int userId_ = 0;
+    int32_t reasonParam_ = 0;     // Overdue: days late
+    FineReason reasonCode_ = FineReason::Other;
     Money amount_;
-    string reason_;
     system_clock::time_point appliedAt_;
 public:
-    Fine(int id, int itemId, int userId, Money amount, string reason)
-      : id_(id), itemId_(itemId), userId_(userId), amount_(amount), reason_(move(reason)), appliedAt_(system_clock::now()) {}
+    Fine() = default;
+    Fine(int id, int itemId, int userId, Money amount, FineReason code, int32_t param,
+         system_clock::time_point appliedAt)
+      : id_(id), itemId_(itemId), userId_(userId), reasonParam_(param), reasonCode_(code), amount_(amount),
+        appliedAt_(appliedAt) {}
     int id() const { return id_; }
+    int itemId() const { return itemId_; }
     int userId() const { return userId_; }
     Money amount() const { return amount_; }
-    string reason() const { return reason_; }
+    FineReason reasonCode() const { return reasonCode_; }
+    int32_t reasonParam() const { return reasonParam_; }
+    string reason() const {
+        if (reasonCode_ == FineReason::Overdue) return "Overdue by " + to_string(reasonParam_) + " days";
+        return "Fine";
+    }
     system_clock::time_point appliedAt() const { return appliedAt_; }
 };
 
@@ -184,23 +756,119 @@ public:
     virtual void seek(std::chrono::duration<long long> pos) = 0;
 };
 
+// Availability plus the reserving user, which only means something while RESERVED.
+struct ItemState {
+    AvailabilityStatus status = AvailabilityStatus::AVAILABLE;
+    int reservedBy = 0;
+    bool operator==(const ItemState& o) const { return status == o.status && reservedBy == o.reservedBy; }
+};
+
+// The 4-bit cell an item's state is mirrored to (see ItemColumns), reached
+// without the repo's stripe lock. The repo binds and unbinds it under that
+// lock; unbind waits out any set() that already saw the old binding.
+class ColumnCell {
+    std::atomic<std::atomic<uint64_t>*> word_{nullptr};
+    std::atomic<uint32_t> shift_{0};
+    std::atomic<int> setting_{0};
+public:
+    // caller holds the repo's lock exclusively
+    void bind(std::atomic<uint64_t>* word, uint32_t shift) {
+        shift_.store(shift, std::memory_order_relaxed);
+        word_.store(word, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);   // pairs with set()
+    }
+    void unbind() {
+        word_.store(nullptr);
+        while (setting_.load()) std::this_thread::yield();
+    }
+    bool bound() const { return word_.load(std::memory_order_relaxed) != nullptr; }
+    // writes cell into the bound word; false if unbound
+    bool set(uint64_t cell) {
+        setting_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);   // a bind() we miss sees the caller's change
+        auto* w = word_.load(std::memory_order_acquire);
+        if (w) {
+            uint32_t shift = shift_.load(std::memory_order_relaxed);
+            uint64_t cur = w->load(std::memory_order_relaxed);
+            while (!w->compare_exchange_weak(cur, (cur & ~(uint64_t(0xf) << shift)) | cell << shift,
+                                             std::memory_order_acq_rel, std::memory_order_relaxed)) {}
+        }
+        setting_.fetch_sub(1, std::memory_order_release);
+        return w != nullptr;
+    }
+};
+
 /* Item base class */
 class Item {
+    // ItemState packed into one word (status in the low byte, reserving user in
+    // the high half) so every state change is a single compare-and-swap
+    std::atomic<uint64_t> state_;
+    mutable ColumnCell cell_;   // bound while ItemRepo stores this object
+
+    static uint64_t pack(ItemState s) {
+        uint32_t by = s.status == AvailabilityStatus::RESERVED ? static_cast<uint32_t>(s.reservedBy) : 0;
+        return static_cast<uint64_t>(s.status) | (static_cast<uint64_t>(by) << 32);
+    }
+    static ItemState unpack(uint64_t v) {
+        return {static_cast<AvailabilityStatus>(v & 0xff), static_cast<int>(static_cast<uint32_t>(v >> 32))};
+    }
 protected:
     int id_;
     string title_;
-    vector<string> authors_;
-    AvailabilityStatus status_;
-    map<string, string> metadata_;
+    vector<std::string_view> authors_;                 // interned: StringPool views
+    vector<std::pair<uint32_t, uint32_t>> metadata_;   // StringPool (key, value) ids, sorted by key id
+
+    static vector<std::string_view> intern(const vector<string>& v) {
+        vector<std::string_view> res;
+        res.reserve(v.size());
+        for (auto& s : v) res.push_back(StringPool::instance().store(s));
+        return res;
+    }
 public:
-    Item(int id, string title, vector<string> authors)
-      : id_(id), title_(move(title)), authors_(move(authors)), status_(AvailabilityStatus::AVAILABLE) {}
+    Item(int id, string title, const vector<string>& authors)
+      : state_(pack({})), id_(id), title_(move(title)), authors_(intern(authors)) {}
     virtual ~Item() = default;
     int id() const { return id_; }
-    string title() const { return title_; }
-    AvailabilityStatus status() const { return status_; }
-    void setStatus(AvailabilityStatus s) { status_ = s; }
+    std::string_view title() const { return title_; }
+    const vector<std::string_view>& authors() const { return authors_; }
+
+    // Free-form attributes, e.g. "language". Not synchronised: set them
+    // before the item is saved, like the rest of its description.
+    optional<std::string_view> metadata(std::string_view key) const {
+        auto k = StringPool::instance().find(key);
+        if (!k) return nullopt;
+        auto it = std::lower_bound(metadata_.begin(), metadata_.end(), std::make_pair(*k, 0u));
+        if (it == metadata_.end() || it->first != *k) return nullopt;
+        return StringPool::instance().view(it->second);
+    }
+    void setMetadata(std::string_view key, std::string_view value) {
+        auto& pool = StringPool::instance();
+        std::pair<uint32_t, uint32_t> kv{pool.intern(key), pool.intern(value)};
+        auto it = std::lower_bound(metadata_.begin(), metadata_.end(), std::make_pair(kv.first, 0u));
+        if (it != metadata_.end() && it->first == kv.first) it->second = kv.second;
+        else metadata_.insert(it, kv);
+    }
+    // f(key, value) in no particular order
+    template<typename F>
+    void forEachMetadata(F&& f) const {
+        for (auto& [k, v] : metadata_) f(StringPool::instance().view(k), StringPool::instance().view(v));
+    }
+    AvailabilityStatus status() const { return state().status; }
+    ItemState state() const { return unpack(state_.load(std::memory_order_acquire)); }
+    // unconditional; for recovery and administrative changes
+    void setStatus(AvailabilityStatus s, int reservedBy = 0) { state_.store(pack({s, reservedBy}), std::memory_order_release); }
+    // moves expected -> desired if the item is still in expected; on failure
+    // expected is refreshed with the current state
+    bool transition(ItemState& expected, ItemState desired) {
+        uint64_t cur = pack(expected);
+        if (state_.compare_exchange_strong(cur, pack(desired), std::memory_order_acq_rel, std::memory_order_acquire))
+            return true;
+        expected = unpack(cur);
+        return false;
+    }
+    ColumnCell& columnCell() const { return cell_; }
     virtual string typeName() const = 0;
+    virtual ItemKind kind() const = 0;
     virtual void validate() const {}
 };
 
@@ -208,12 +876,13 @@ public:
 class Book : public Item {
     int pageCount_;
 public:
-    Book(int id, string title, vector<string> authors, int pageCount)
-      : Item(id, move(title), move(authors)), pageCount_(pageCount) {
+    Book(int id, string title, const vector<string>& authors, int pageCount)
+      : Item(id, move(title), authors), pageCount_(pageCount) {
         validate();
     }
     int getPageCount() const { return pageCount_; }
     string typeName() const override { return "Book"; }
+    ItemKind kind() const override { return ItemKind::Book; }
     void validate() const override {
         if (pageCount_ <= 0) throw InvalidInputException("Book pageCount must be > 0");
     }
@@ -222,15 +891,17 @@ public:
 /* Audiobook (implements Playable) */
 class Audiobook : public Item, public Playable {
     hours playbackDuration_;
-    string narrator_;
+    std::string_view narrator_;   // interned
     bool playing_ = false;
 public:
-    Audiobook(int id, string title, vector<string> authors, hours playback, string narrator = "")
-      : Item(id, move(title), move(authors)), playbackDuration_(playback), narrator_(move(narrator)) {
+    Audiobook(int id, string title, const vector<string>& authors, hours playback, std::string_view narrator = "")
+      : Item(id, move(title), authors), playbackDuration_(playback), narrator_(StringPool::instance().store(narrator)) {
         validate();
     }
     hours getPlaybackDuration() const { return playbackDuration_; }
+    std::string_view narrator() const { return narrator_; }
     string typeName() const override { return "Audiobook"; }
+    ItemKind kind() const override { return ItemKind::Audiobook; }
     void validate() const override {
         if (playbackDuration_ <= hours(0)) throw InvalidInputException("Audiobook duration must be positive");
     }
@@ -247,18 +918,20 @@ public:
 class EMagazine : public Item {
     int issueNumber_;
     system_clock::time_point issueDate_;
-    bool archived_ = false;
+    std::atomic<bool> archived_{false};
 public:
-    EMagazine(int id, string title, vector<string> authors, int issueNumber, system_clock::time_point issueDate)
-      : Item(id, move(title), move(authors)), issueNumber_(issueNumber), issueDate_(issueDate) {
+    EMagazine(int id, string title, const vector<string>& authors, int issueNumber, system_clock::time_point issueDate)
+      : Item(id, move(title), authors), issueNumber_(issueNumber), issueDate_(issueDate) {
         validate();
     }
     string typeName() const override { return "EMagazine"; }
+    ItemKind kind() const override { return ItemKind::EMagazine; }
     int issueNumber() const { return issueNumber_; }
+    system_clock::time_point issueDate() const { return issueDate_; }
     bool isArchived() const { return archived_; }
+    void restoreArchived(bool archived) { archived_ = archived; }
     void archiveIssue() {
-        if (archived_) throw ArchiveException("Issue already archived");
-        archived_ = true;
+        if (archived_.exchange(true)) throw ArchiveException("Issue already archived");
         setStatus(AvailabilityStatus::MAINTENANCE);
     }
     void validate() const override {
@@ -267,318 +940,7384 @@ public:
 };
 
 /* BorrowRecord */
+// 40-byte record living in BorrowRecordRepo's slabs; only the repo changes it,
+// everyone else holds a const pointer into the repo or a copy from a snapshot.
+// What changes after add (status, fined days, due and return times) is held
+// in atomics, so a const pointer reads it safely while the repo writes.
 class BorrowRecord {
-    int id_;
-    int itemId_;
-    int userId_;
+    int id_ = 0;
+    int itemId_ = 0;
+    int userId_ = 0;
+    std::atomic<BorrowStatus> status_{BorrowStatus::ACTIVE};   // flipped under the repo lock, read lock-free
+    std::atomic<uint16_t> finedDays_{0};   // overdue days already charged by the nightly sweep
     system_clock::time_point borrowAt_;
-    system_clock::time_point dueAt_;
-    BorrowStatus status_;
+    std::atomic<system_clock::rep> dueAt_{0};        // ticks; renewals move it under the repo lock
+    std::atomic<system_clock::rep> returnedAt_{0};   // ticks, set with RETURNED; 0 if unknown (older journals)
+
+    static system_clock::rep ticks(system_clock::time_point t) { return t.time_since_epoch().count(); }
+    static system_clock::time_point at(system_clock::rep t) { return system_clock::time_point(system_clock::duration(t)); }
+
+    friend class BorrowRecordRepo;
+    void assign(int id, int itemId, int userId, system_clock::time_point borrowAt, system_clock::time_point dueAt,
+                BorrowStatus status, system_clock::time_point returnedAt) {
+        id_ = id;
+        itemId_ = itemId;
+        userId_ = userId;
+        borrowAt_ = borrowAt;
+        dueAt_.store(ticks(dueAt), std::memory_order_relaxed);
+        returnedAt_.store(ticks(returnedAt), std::memory_order_relaxed);
+        finedDays_.store(0, std::memory_order_relaxed);
+        status_.store(status, std::memory_order_release);
+    }
+    void markReturned(system_clock::time_point when) {
+        returnedAt_.store(ticks(when), std::memory_order_relaxed);
+        status_.store(BorrowStatus::RETURNED, std::memory_order_release);
+    }
+    void markOverdue(int finedDays) {
+        finedDays_.store(static_cast<uint16_t>(std::min(finedDays, 0xffff)), std::memory_order_relaxed);
+        status_.store(BorrowStatus::OVERDUE, std::memory_order_release);
+    }
+    void setDueAt(system_clock::time_point d) { dueAt_.store(ticks(d), std::memory_order_relaxed); }
 public:
-    BorrowRecord(int id, int itemId, int userId, system_clock::time_point borrowAt, system_clock::time_point dueAt)
-      : id_(id), itemId_(itemId), userId_(userId), borrowAt_(borrowAt), dueAt_(dueAt), status_(BorrowStatus::ACTIVE) {}
+    BorrowRecord() = default;
+    BorrowRecord(const BorrowRecord& o)
+      : id_(o.id_), itemId_(o.itemId_), userId_(o.userId_), status_(o.status()), finedDays_(o.finedDays_.load()),
+        borrowAt_(o.borrowAt_), dueAt_(o.dueAt_.load(std::memory_order_relaxed)),
+        returnedAt_(o.returnedAt_.load(std::memory_order_relaxed)) {}
+    BorrowRecord& operator=(const BorrowRecord& o) {
+        assign(o.id_, o.itemId_, o.userId_, o.borrowAt_, o.dueAt(), o.status(), o.returnedAt());
+        finedDays_.store(o.finedDays_.load(), std::memory_order_relaxed);
+        return *this;
+    }
     int id() const { return id_; }
-    void setId(int id) { id_ = id; }
     int itemId() const { return itemId_; }
     int userId() const { return userId_; }
     system_clock::time_point borrowAt() const { return borrowAt_; }
-    system_clock::time_point dueAt() const { return dueAt_; }
-    BorrowStatus status() const { return status_; }
-    void markReturned() { status_ = BorrowStatus::RETURNED; }
-    void setDueAt(system_clock::time_point d) { dueAt_ = d; }
-    bool isOverdue() const { return system_clock::now() > dueAt_; }
-    int overdueDays() const {
-        if (!isOverdue()) return 0;
-        auto diff = std::chrono::duration_cast<hours>(system_clock::now() - dueAt_);
+    system_clock::time_point dueAt() const { return at(dueAt_.load(std::memory_order_relaxed)); }
+    // when it was returned; the epoch while open, or if the journal predates it
+    system_clock::time_point returnedAt() const { return at(returnedAt_.load(std::memory_order_relaxed)); }
+    BorrowStatus status() const { return status_.load(std::memory_order_acquire); }
+    // ACTIVE or OVERDUE: the item is still out
+    bool isOpen() const { return status() != BorrowStatus::RETURNED; }
+    int finedDays() const { return finedDays_.load(std::memory_order_relaxed); }
+    bool isOverdue(system_clock::time_point now) const { return now > dueAt(); }
+    int overdueDays(system_clock::time_point now) const {
+        auto due = dueAt();
+        if (now <= due) return 0;
+        auto diff = std::chrono::duration_cast<hours>(now - due);
         int days = static_cast<int>(diff.count() / 24);
         return std::max(1, days);
     }
 };
 
 
-template<typename T>
-class InMemoryRepo {
-protected:
-    unordered_map<int, shared_ptr<T>> storage_;
-    mutable std::mutex mtx_;
+/* ---------- Read-only catalog image (memory-mapped) ---------- */
+
+// Read-only view of a whole file, mapped into memory.
+class MappedFile {
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#endif
 public:
-    virtual ~InMemoryRepo() = default;
+    explicit MappedFile(const string& path) {
+#ifdef _WIN32
+        file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) throw PersistenceException("Cannot open " + path);
+        LARGE_INTEGER sz;
+        GetFileSizeEx(file_, &sz);
+        size_ = static_cast<size_t>(sz.QuadPart);
+        if (size_ == 0) return;
+        mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_) data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        if (!data_) { this->~MappedFile(); throw PersistenceException("Cannot map " + path); }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw PersistenceException("Cannot open " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0) { ::close(fd); throw PersistenceException("Cannot stat " + path); }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) { ::close(fd); throw PersistenceException("Cannot map " + path); }
+            data_ = static_cast<const char*>(p);
+        }
+        ::close(fd);
+#endif
+    }
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+        if (data_) munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+};
 
-    optional<shared_ptr<T>> findById(int id) const {
-        std::lock_guard<std::mutex> l(mtx_);
-        auto it = storage_.find(id);
-        if (it == storage_.end()) return nullopt;
-        return it->second;
+// Fixed-size catalog entry. Strings are byte offsets into the string table.
+struct CatalogRecord {
+    int32_t id;
+    uint8_t kind;            // ItemKind
+    uint8_t status;          // AvailabilityStatus at export time
+    uint8_t archived;
+    uint8_t reserved_;
+    uint32_t title;
+    uint32_t narrator;
+    uint32_t authorsBegin;   // index into the author table
+    uint32_t authorsCount;
+    int32_t number;          // Book page count / EMagazine issue number
+    int64_t value;           // Audiobook playback hours / EMagazine issue date (us since epoch)
+};
+static_assert(sizeof(CatalogRecord) == 40, "catalog record layout is part of the file format");
+
+// On-disk catalog, little-endian:
+//   header   magic "LNCAT\0\0\0", u32 version, u32 count, then u64 offsets/sizes below
+//   records  CatalogRecord[count], sorted by id
+//   authors  u32[] string offsets, referenced by authorsBegin/authorsCount
+//   strings  [u32 length][bytes] entries, deduplicated
+// Opening only maps the file and checks the header, so it costs the same for
+// any catalog size; items are materialized one at a time on request, and a
+// record's kind and status are checked when it is first used.
+class CatalogImage {
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint64_t recordsOff;
+        uint64_t authorsOff;
+        uint64_t authorsCount;
+        uint64_t stringsOff;
+        uint64_t stringsSize;
+    };
+    static constexpr char kMagic[8] = {'L','N','C','A','T',0,0,0};
+    static constexpr uint32_t kVersion = 1;
+
+    MappedFile file_;
+    const CatalogRecord* records_ = nullptr;
+    const uint32_t* authors_ = nullptr;
+    uint64_t authorsCount_ = 0;
+    const char* strings_ = nullptr;
+    uint64_t stringsSize_ = 0;
+    uint32_t count_ = 0;
+
+    static void pad(string& out, size_t align) { while (out.size() % align) out.push_back('\0'); }
+public:
+    explicit CatalogImage(const string& path) : file_(path) {
+        Header h;
+        if (file_.size() < sizeof(h)) throw PersistenceException("Catalog too small: " + path);
+        std::memcpy(&h, file_.data(), sizeof(h));
+        if (!std::equal(h.magic, h.magic + 8, kMagic)) throw PersistenceException("Not a catalog file: " + path);
+        if (h.version != kVersion) throw PersistenceException("Unsupported catalog version " + to_string(h.version));
+        auto fits = [&](uint64_t off, uint64_t bytes) { return off <= file_.size() && bytes <= file_.size() - off; };
+        if (!fits(h.recordsOff, uint64_t(h.count) * sizeof(CatalogRecord)) || !fits(h.authorsOff, h.authorsCount * 4) ||
+            !fits(h.stringsOff, h.stringsSize) || h.recordsOff % alignof(CatalogRecord) || h.authorsOff % 4)
+            throw PersistenceException("Corrupt catalog header: " + path);
+        count_ = h.count;
+        records_ = reinterpret_cast<const CatalogRecord*>(file_.data() + h.recordsOff);
+        authors_ = reinterpret_cast<const uint32_t*>(file_.data() + h.authorsOff);
+        authorsCount_ = h.authorsCount;
+        strings_ = file_.data() + h.stringsOff;
+        stringsSize_ = h.stringsSize;
     }
 
-    void save(shared_ptr<T> obj, int id) {
+    size_t size() const { return count_; }
+    const CatalogRecord& record(size_t i) const { return records_[i]; }
+
+    const CatalogRecord* find(int id) const {
+        auto end = records_ + count_;
+        auto it = std::lower_bound(records_, end, id, [](const CatalogRecord& r, int v) { return r.id < v; });
+        return (it != end && it->id == id) ? it : nullptr;
+    }
+
+    // r, once its kind and status are known values; records are checked
+    // where they are used, not when the image is opened
+    const CatalogRecord& checked(const CatalogRecord& r) const {
+        if (r.kind < static_cast<uint8_t>(ItemKind::Book) || r.kind > static_cast<uint8_t>(ItemKind::EMagazine))
+            throw PersistenceException("Unknown item kind in catalog record for id " + to_string(r.id));
+        if (r.status > static_cast<uint8_t>(AvailabilityStatus::MAINTENANCE))
+            throw PersistenceException("Unknown status in catalog record for id " + to_string(r.id));
+        return r;
+    }
+
+    std::string_view str(uint32_t off) const {
+        uint32_t len;
+        if (uint64_t(off) + 4 > stringsSize_) throw PersistenceException("Corrupt catalog string offset");
+        std::memcpy(&len, strings_ + off, 4);
+        if (len > stringsSize_ - off - 4) throw PersistenceException("Corrupt catalog string length");
+        return std::string_view(strings_ + off + 4, len);
+    }
+
+    std::string_view author(const CatalogRecord& r, uint32_t k) const {
+        if (uint64_t(r.authorsBegin) + k >= authorsCount_) throw PersistenceException("Corrupt catalog author index");
+        return str(authors_[r.authorsBegin + k]);
+    }
+
+    // Builds a standalone Item from one record.
+    shared_ptr<Item> materialize(const CatalogRecord& r) const {
+        checked(r);
+        vector<string> authors;
+        authors.reserve(r.authorsCount);
+        for (uint32_t k = 0; k < r.authorsCount; ++k) authors.emplace_back(author(r, k));
+        string title(str(r.title));
+        shared_ptr<Item> item;
+        switch (static_cast<ItemKind>(r.kind)) {
+        case ItemKind::Book:
+            item = make_shared<Book>(r.id, move(title), authors, r.number);
+            break;
+        case ItemKind::Audiobook:
+            item = make_shared<Audiobook>(r.id, move(title), authors, hours(r.value), string(str(r.narrator)));
+            break;
+        case ItemKind::EMagazine: {
+            auto issueDate = system_clock::time_point(duration_cast<system_clock::duration>(std::chrono::microseconds(r.value)));
+            auto mag = make_shared<EMagazine>(r.id, move(title), authors, r.number, issueDate);
+            mag->restoreArchived(r.archived != 0);
+            item = mag;
+            break;
+        }
+        default:
+            throw PersistenceException("Unknown item kind in catalog");
+        }
+        item->setStatus(static_cast<AvailabilityStatus>(r.status));
+        return item;
+    }
+
+    static void write(const string& path, vector<shared_ptr<const Item>> items) {
+        std::sort(items.begin(), items.end(), [](auto& a, auto& b) { return a->id() < b->id(); });
+        string strings, records;
+        vector<uint32_t> authorTable;
+        unordered_map<std::string_view, uint32_t> interned;   // views into items, which outlive the call
+        auto intern = [&](std::string_view s) {
+            auto it = interned.find(s);
+            if (it != interned.end()) return it->second;
+            uint32_t off = static_cast<uint32_t>(strings.size());
+            uint32_t len = static_cast<uint32_t>(s.size());
+            strings.append(reinterpret_cast<const char*>(&len), 4);
+            strings += s;
+            interned.emplace(s, off);
+            return off;
+        };
+        for (auto& item : items) {
+            CatalogRecord r{};
+            r.id = item->id();
+            r.kind = static_cast<uint8_t>(item->kind());
+            r.status = static_cast<uint8_t>(item->status());
+            r.title = intern(item->title());
+            r.narrator = intern("");
+            r.authorsBegin = static_cast<uint32_t>(authorTable.size());
+            r.authorsCount = static_cast<uint32_t>(item->authors().size());
+            for (auto& a : item->authors()) authorTable.push_back(intern(a));
+            if (auto b = dynamic_cast<const Book*>(item.get())) {
+                r.number = b->getPageCount();
+            } else if (auto a = dynamic_cast<const Audiobook*>(item.get())) {
+                r.value = a->getPlaybackDuration().count();
+                r.narrator = intern(a->narrator());
+            } else if (auto m = dynamic_cast<const EMagazine*>(item.get())) {
+                r.number = m->issueNumber();
+                r.value = duration_cast<std::chrono::microseconds>(m->issueDate().time_since_epoch()).count();
+                r.archived = m->isArchived();
+            }
+            records.append(reinterpret_cast<const char*>(&r), sizeof(r));
+        }
+
+        Header h{};
+        std::copy(kMagic, kMagic + 8, h.magic);
+        h.version = kVersion;
+        h.count = static_cast<uint32_t>(items.size());
+        string out(sizeof(h), '\0');
+        pad(out, alignof(CatalogRecord));
+        h.recordsOff = out.size();
+        out += records;
+        pad(out, 4);
+        h.authorsOff = out.size();
+        h.authorsCount = authorTable.size();
+        out.append(reinterpret_cast<const char*>(authorTable.data()), authorTable.size() * 4);
+        h.stringsOff = out.size();
+        h.stringsSize = strings.size();
+        out += strings;
+        std::memcpy(&out[0], &h, sizeof(h));
+
+        string tmp = path + ".tmp";
+        FILE* f = std::fopen(tmp.c_str(), "wb");
+        if (!f) throw PersistenceException("Cannot create " + tmp);
+        bool ok = std::fwrite(out.data(), 1, out.size(), f) == out.size();
+        ok = (std::fclose(f) == 0) && ok;
+        if (!ok) throw PersistenceException("Failed writing " + tmp);
+        std::filesystem::rename(tmp, path);
+    }
+};
+
+
+/* ---------- Snapshot reads ---------- */
+
+// Epochs for snapshot reads. Every change made under a Writer belongs to the
+// epoch current at the time. open() waits for the writers in flight, takes
+// the current epoch as the snapshot's and starts the next, so a snapshot
+// sees exactly the changes of its own epoch and earlier ones. While any
+// snapshot is open, the first change to a value in an epoch saves the value
+// it replaces in a History, where readers look up what they should see;
+// entries go once no open snapshot is older than them. With no snapshot
+// open, a writer pays one counter increment on its own cache line.
+class Versions {
+    static constexpr size_t kSlots = 16;
+    struct alignas(64) Slot { std::atomic<int> writers{0}; };
+    std::array<Slot, kSlots> slots_;
+    std::atomic<bool> opening_{false};
+    std::atomic<uint64_t> epoch_{1};
+    std::atomic<size_t> open_{0};
+    std::mutex mtx_;                       // opening and closing
+    std::multiset<uint64_t> opened_;       // epochs of the open snapshots
+    std::mutex pruneMtx_;                  // taken after mtx_ is released
+    vector<std::function<void(uint64_t)>> pruners_;
+    static inline thread_local const Versions* held_ = nullptr;
+
+    static size_t mySlot() {
+        static std::atomic<size_t> next{0};
+        static thread_local size_t slot = next++ % kSlots;
+        return slot;
+    }
+public:
+    // Makes the calling thread a writer until it goes out of scope. Nested
+    // Writers on the same Versions (and Writers on none) do nothing. Take it
+    // before any lock a writer may wait on.
+    class Writer {
+        Versions* v_ = nullptr;
+        const Versions* prev_ = nullptr;
+    public:
+        explicit Writer(Versions* v) {
+            if (!v || held_ == v) return;
+            Slot& s = v->slots_[mySlot()];
+            for (;;) {
+                s.writers.fetch_add(1);
+                if (!v->opening_.load()) break;
+                s.writers.fetch_sub(1);
+                while (v->opening_.load(std::memory_order_acquire)) std::this_thread::yield();
+            }
+            v_ = v;
+            prev_ = held_;
+            held_ = v;
+        }
+        ~Writer() {
+            if (!v_) return;
+            held_ = prev_;
+            v_->slots_[mySlot()].writers.fetch_sub(1, std::memory_order_release);
+        }
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+    };
+
+    Versions() = default;
+    Versions(const Versions&) = delete;
+    Versions& operator=(const Versions&) = delete;
+
+    // the epoch a Writer's changes belong to
+    uint64_t epoch() const { return epoch_.load(std::memory_order_relaxed); }
+    // whether a Writer must save what it replaces
+    bool retaining() const { return open_.load(std::memory_order_relaxed) > 0; }
+
+    // Registers a snapshot and returns its epoch. atOpen() runs while no
+    // writer is active, to note where append-only stores end. Not from a Writer.
+    template<typename F>
+    uint64_t open(F&& atOpen) {
+        if (held_ == this) throw LibraryException("Snapshot opened inside a write");
         std::lock_guard<std::mutex> l(mtx_);
-        storage_[id] = move(obj);
+        opening_.store(true);
+        for (auto& s : slots_)
+            while (s.writers.load()) std::this_thread::yield();
+        uint64_t e = epoch_.load(std::memory_order_relaxed);
+        atOpen();
+        opened_.insert(e);
+        open_.store(opened_.size(), std::memory_order_relaxed);
+        epoch_.store(e + 1, std::memory_order_relaxed);
+        opening_.store(false, std::memory_order_release);
+        return e;
+    }
+
+    // Unregisters a snapshot; histories drop what no open snapshot needs.
+    // Snapshots opened later get later epochs, so the bound handed to the
+    // pruners stays safe even if they run after another open.
+    void close(uint64_t e) {
+        uint64_t oldest;
+        {
+            std::lock_guard<std::mutex> l(mtx_);
+            auto it = opened_.find(e);
+            if (it == opened_.end()) return;
+            opened_.erase(it);
+            open_.store(opened_.size(), std::memory_order_relaxed);
+            oldest = opened_.empty() ? epoch() : *opened_.begin();
+        }
+        std::lock_guard<std::mutex> l(pruneMtx_);
+        for (auto& prune : pruners_) prune(oldest);
+    }
+
+    // prune(oldest) is called after every close; no open or future snapshot
+    // has an epoch below oldest
+    void onPrune(std::function<void(uint64_t)> prune) {
+        std::lock_guard<std::mutex> l(pruneMtx_);
+        pruners_.push_back(move(prune));
+    }
+};
+
+// Values replaced while snapshots were open, oldest first per key. An entry
+// (e, v) says the key held v until its first change in epoch e, so a
+// snapshot at epoch s reads the first entry with e > s, or the current value
+// when there is none. Readers must load the current value before looking
+// here. Not synchronised: the owner locks around it.
+template<typename K, typename V>
+class History {
+    struct Change {
+        uint64_t epoch;
+        V before;
+    };
+    unordered_map<K, vector<Change>> changes_;
+public:
+    // keeps before unless key already changed in this epoch
+    void save(const K& key, uint64_t epoch, const V& before) {
+        auto& list = changes_[key];
+        if (list.empty() || list.back().epoch != epoch) list.push_back({epoch, before});
+    }
+    // what key held at the end of epoch, or nullptr if it has not changed since
+    const V* asOf(const K& key, uint64_t epoch) const {
+        auto it = changes_.find(key);
+        if (it == changes_.end()) return nullptr;
+        for (auto& c : it->second)
+            if (c.epoch > epoch) return &c.before;
+        return nullptr;
+    }
+    // drops entries only snapshots older than oldest could need
+    void prune(uint64_t oldest) {
+        for (auto it = changes_.begin(); it != changes_.end();) {
+            auto& list = it->second;
+            list.erase(list.begin(), std::find_if(list.begin(), list.end(), [&](const Change& c) { return c.epoch > oldest; }));
+            it = list.empty() ? changes_.erase(it) : std::next(it);
+        }
+    }
+    template<typename F>
+    void forEachKey(F&& f) const { for (auto& p : changes_) f(p.first); }
+    bool empty() const { return changes_.empty(); }
+};
+
+// Where a snapshot reads: its epoch, plus the ends of the append-only id
+// sequences at the time (records and fines with smaller ids existed).
+struct ReadPoint {
+    uint64_t epoch = 0;
+    int recordsEnd = 0;
+    int finesEnd = 0;
+};
+
+/* ---------- Id-keyed tables ---------- */
+
+// Three layouts for maps keyed by int ids, with one interface: find() gives
+// a pointer to the value or nullptr, operator[] inserts a default value,
+// forEach(f) calls f(id, value). Pointers from find()/operator[] are only good
+// until the next insert or erase.
+
+// std::unordered_map: one heap node per entry
+template<typename V>
+class NodeIdMap {
+    unordered_map<int, V> map_;
+public:
+    V* find(int key) {
+        auto it = map_.find(key);
+        return it == map_.end() ? nullptr : &it->second;
+    }
+    const V* find(int key) const {
+        auto it = map_.find(key);
+        return it == map_.end() ? nullptr : &it->second;
+    }
+    V& operator[](int key) { return map_[key]; }
+    bool erase(int key) { return map_.erase(key) > 0; }
+    size_t count(int key) const { return map_.count(key); }
+    size_t size() const { return map_.size(); }
+    bool empty() const { return map_.empty(); }
+    void clear() { map_.clear(); }
+    void reserve(size_t n) { map_.reserve(n); }
+    template<typename F>
+    void forEach(F&& f) { for (auto& p : map_) f(p.first, p.second); }
+    template<typename F>
+    void forEach(F&& f) const { for (auto& p : map_) f(p.first, p.second); }
+};
+
+// Open addressing with linear probing over one array of (key, value) slots,
+// at most 3/4 full. Erase shifts the rest of the probe run back, so there are
+// no tombstones and lookups stop at the first empty slot.
+template<typename V>
+class FlatIdMap {
+    struct Slot {
+        int key = 0;
+        bool used = false;
+        V value = V();
+    };
+    vector<Slot> slots_;
+    size_t size_ = 0;
+    int shift_ = 64;   // 64 - log2(slots_.size())
+
+    size_t home(int key) const {
+        return static_cast<size_t>((static_cast<uint64_t>(static_cast<uint32_t>(key)) * 0x9E3779B97F4A7C15ull) >> shift_);
+    }
+    size_t mask() const { return slots_.size() - 1; }
+    size_t locate(int key) const {
+        if (slots_.empty()) return npos;
+        for (size_t i = home(key);; i = (i + 1) & mask()) {
+            if (!slots_[i].used) return npos;
+            if (slots_[i].key == key) return i;
+        }
+    }
+    void rehash(size_t capacity) {
+        vector<Slot> old(capacity);
+        old.swap(slots_);
+        shift_ = 64;
+        for (size_t c = capacity; c > 1; c >>= 1) --shift_;
+        for (auto& s : old) {
+            if (!s.used) continue;
+            size_t i = home(s.key);
+            while (slots_[i].used) i = (i + 1) & mask();
+            slots_[i] = move(s);
+        }
+    }
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    V* find(int key) {
+        size_t i = locate(key);
+        return i == npos ? nullptr : &slots_[i].value;
+    }
+    const V* find(int key) const {
+        size_t i = locate(key);
+        return i == npos ? nullptr : &slots_[i].value;
+    }
+    V& operator[](int key) {
+        if (V* v = find(key)) return *v;
+        if ((size_ + 1) * 4 > slots_.size() * 3) rehash(std::max<size_t>(16, slots_.size() * 2));
+        size_t i = home(key);
+        while (slots_[i].used) i = (i + 1) & mask();
+        slots_[i].key = key;
+        slots_[i].used = true;
+        ++size_;
+        return slots_[i].value;
+    }
+    bool erase(int key) {
+        size_t i = locate(key);
+        if (i == npos) return false;
+        // pull later entries of the run into the hole unless their home slot
+        // lies (cyclically) after the hole
+        for (size_t j = (i + 1) & mask(); slots_[j].used; j = (j + 1) & mask()) {
+            size_t h = home(slots_[j].key);
+            bool stays = i <= j ? (i < h && h <= j) : (i < h || h <= j);
+            if (stays) continue;
+            slots_[i] = move(slots_[j]);
+            i = j;
+        }
+        slots_[i] = Slot();
+        --size_;
+        return true;
+    }
+    size_t count(int key) const { return locate(key) != npos; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    void clear() {
+        slots_.clear();
+        size_ = 0;
+        shift_ = 64;
+    }
+    void reserve(size_t n) {
+        size_t capacity = 16;
+        while (capacity * 3 < n * 4) capacity *= 2;
+        if (capacity > slots_.size()) rehash(capacity);
+    }
+    template<typename F>
+    void forEach(F&& f) { for (auto& s : slots_) if (s.used) f(s.key, s.value); }
+    template<typename F>
+    void forEach(F&& f) const { for (auto& s : slots_) if (s.used) f(s.key, s.value); }
+};
+
+// Vector indexed by id, for ids that are mostly consecutive (101, 102, ...).
+// Key k lives in slot k / kStride - base_; a repo that stripes ids by
+// k % kStride thus gives each stripe a gap-free run. Negative keys, and keys
+// that would stretch the vector past three slots per entry, go to a FlatIdMap.
+template<typename V, size_t kStride = 1>
+class DenseIdMap {
+    struct Slot {
+        int key = -1;   // -1: unused
+        V value = V();
+    };
+    static constexpr size_t kMinSlots = 1024;
+    static constexpr size_t npos = static_cast<size_t>(-1);
+    vector<Slot> slots_;
+    size_t base_ = 0;     // k / kStride of slots_[0]
+    size_t dense_ = 0;    // used slots
+    FlatIdMap<V> sparse_;
+
+    size_t indexOf(int key) const {
+        if (key < 0) return npos;
+        size_t s = static_cast<size_t>(key) / kStride;
+        return s >= base_ && s - base_ < slots_.size() ? s - base_ : npos;
+    }
+    // grows slots_ to take key if that keeps it dense enough; entries of
+    // sparse_ that fall inside the new range move in
+    size_t cover(int key) {
+        if (key < 0) return npos;
+        size_t s = static_cast<size_t>(key) / kStride;
+        if (slots_.empty()) base_ = s - s % kMinSlots;
+        if (s < base_) return npos;
+        size_t need = s - base_ + 1;
+        if (need > std::max(kMinSlots, 3 * (dense_ + 1))) return npos;
+        slots_.resize(std::max({need, kMinSlots, slots_.size() + slots_.size() / 2}));
+        if (!sparse_.empty()) {
+            vector<int> moved;
+            sparse_.forEach([&](int k, V&) { if (indexOf(k) != npos) moved.push_back(k); });
+            for (int k : moved) {
+                Slot& slot = slots_[indexOf(k)];
+                slot.key = k;
+                slot.value = move(*sparse_.find(k));
+                sparse_.erase(k);
+                ++dense_;
+            }
+        }
+        return s - base_;
+    }
+public:
+    V* find(int key) {
+        size_t i = indexOf(key);
+        if (i != npos) return slots_[i].key >= 0 ? &slots_[i].value : nullptr;
+        return sparse_.empty() ? nullptr : sparse_.find(key);
+    }
+    const V* find(int key) const {
+        size_t i = indexOf(key);
+        if (i != npos) return slots_[i].key >= 0 ? &slots_[i].value : nullptr;
+        return sparse_.empty() ? nullptr : sparse_.find(key);
+    }
+    V& operator[](int key) {
+        size_t i = indexOf(key);
+        if (i == npos && !sparse_.count(key)) i = cover(key);
+        if (i == npos) return sparse_[key];
+        Slot& slot = slots_[i];
+        if (slot.key < 0) {
+            slot.key = key;
+            ++dense_;
+        }
+        return slot.value;
+    }
+    bool erase(int key) {
+        size_t i = indexOf(key);
+        if (i == npos) return sparse_.erase(key);
+        if (slots_[i].key < 0) return false;
+        slots_[i] = Slot();
+        --dense_;
+        return true;
+    }
+    size_t count(int key) const { return find(key) != nullptr; }
+    size_t size() const { return dense_ + sparse_.size(); }
+    bool empty() const { return size() == 0; }
+    void clear() {
+        slots_.clear();
+        sparse_.clear();
+        base_ = dense_ = 0;
+    }
+    void reserve(size_t) {}
+    template<typename F>
+    void forEach(F&& f) {
+        for (auto& s : slots_) if (s.key >= 0) f(s.key, s.value);
+        sparse_.forEach(f);
+    }
+    template<typename F>
+    void forEach(F&& f) const {
+        for (auto& s : slots_) if (s.key >= 0) f(s.key, s.value);
+        sparse_.forEach(f);
+    }
+};
+
+// Storage layouts for InMemoryRepo and the repos' id indexes. Table<V, N> is
+// the map type for a repo that spreads ids over N stripes with stripeOf.
+struct NodeStorage {
+    template<typename V, size_t kStride = 1> using Table = NodeIdMap<V>;
+    static size_t stripeOf(int id, size_t n) { return ((static_cast<uint32_t>(id) * 2654435761u) >> 8) % n; }
+};
+struct FlatStorage {
+    template<typename V, size_t kStride = 1> using Table = FlatIdMap<V>;
+    static size_t stripeOf(int id, size_t n) { return NodeStorage::stripeOf(id, n); }
+};
+// consecutive ids go to consecutive stripes, so each stripe's share stays dense
+struct DenseStorage {
+    template<typename V, size_t kStride = 1> using Table = DenseIdMap<V, kStride>;
+    static size_t stripeOf(int id, size_t n) { return static_cast<uint32_t>(id) % n; }
+};
+
+// used by ItemRepo, UserRepo, BorrowRecordRepo and FineRepo
+using RepoStorage = DenseStorage;
+template<typename V> using IdTable = RepoStorage::Table<V>;
+
+// Lock layouts for InMemoryRepo. Ids are spread over kStripes independently
+// locked tables; lookups take their stripe's lock shared, writes exclusive.
+struct SingleLock { static constexpr size_t kStripes = 1; };
+template<size_t N>
+struct StripedLocks {
+    static_assert(N > 0, "need at least one stripe");
+    static constexpr size_t kStripes = N;
+};
+
+template<typename T, typename LockPolicy = SingleLock, typename Storage = NodeStorage>
+class InMemoryRepo {
+protected:
+    using Mutex = metrics::InstrumentedMutex<std::shared_mutex>;
+    static constexpr size_t kStripes = LockPolicy::kStripes;
+    struct alignas(64) Stripe {
+        mutable Mutex mtx;
+        typename Storage::template Table<shared_ptr<T>, kStripes> storage;
+    };
+    std::array<Stripe, kStripes> stripes_;
+
+    static size_t stripeOf(int id) {
+        if (kStripes == 1) return 0;
+        return Storage::stripeOf(id, kStripes);
+    }
+
+    // exclusive locks on every stripe, taken in index order
+    vector<std::unique_lock<Mutex>> lockAll() const {
+        vector<std::unique_lock<Mutex>> locks;
+        locks.reserve(kStripes);
+        for (auto& s : stripes_) locks.emplace_back(s.mtx);
+        return locks;
+    }
+
+    // objs grouped by stripe, so batch writers lock each stripe once
+    template<typename Obj>
+    static std::array<vector<const Obj*>, kStripes> byStripe(const vector<Obj>& objs) {
+        std::array<vector<const Obj*>, kStripes> parts;
+        for (auto& o : objs) parts[stripeOf(o->id())].push_back(&o);
+        return parts;
+    }
+public:
+    explicit InMemoryRepo(metrics::Lock site = metrics::Lock::Other) {
+        for (auto& s : stripes_) s.mtx.setSite(site);
+    }
+    virtual ~InMemoryRepo() = default;
+
+    optional<shared_ptr<T>> findById(int id) const {
+        auto& s = stripes_[stripeOf(id)];
+        std::shared_lock<Mutex> l(s.mtx);
+        auto found = s.storage.find(id);
+        if (!found) return nullopt;
+        return *found;
+    }
+
+    void save(shared_ptr<T> obj, int id) {
+        auto& s = stripes_[stripeOf(id)];
+        std::unique_lock<Mutex> l(s.mtx);
+        s.storage[id] = move(obj);
+    }
+
+    // stores a batch keyed by obj->id(), taking each stripe's lock once
+    void saveAll(const vector<shared_ptr<T>>& objs) {
+        auto parts = byStripe(objs);
+        for (size_t k = 0; k < kStripes; ++k) {
+            if (parts[k].empty()) continue;
+            std::unique_lock<Mutex> l(stripes_[k].mtx);
+            for (auto o : parts[k]) stripes_[k].storage[(*o)->id()] = *o;
+        }
+    }
+
+    // copies stripe by stripe; writers wait for at most one stripe's copy
+    vector<shared_ptr<T>> all() const {
+        vector<shared_ptr<T>> res;
+        res.reserve(size());
+        for (auto& s : stripes_) {
+            std::shared_lock<Mutex> l(s.mtx);
+            s.storage.forEach([&](int, const shared_ptr<T>& obj) { res.push_back(obj); });
+        }
+        return res;
+    }
+
+    // visits every (id, object) stripe by stripe under the stripe's shared
+    // lock; f must not call back into the repo
+    template<typename F>
+    void forEach(F&& f) const {
+        for (auto& s : stripes_) {
+            std::shared_lock<Mutex> l(s.mtx);
+            s.storage.forEach(f);
+        }
+    }
+
+    void remove(int id) {
+        auto& s = stripes_[stripeOf(id)];
+        std::unique_lock<Mutex> l(s.mtx);
+        s.storage.erase(id);
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (auto& s : stripes_) {
+            std::shared_lock<Mutex> l(s.mtx);
+            n += s.storage.size();
+        }
+        return n;
+    }
+};
+
+
+/* ---------- Full-text search over titles and authors ---------- */
+
+// Sorted item ids in one of two encodings, whichever is smaller:
+//  - sparse: blocks of up to 2 * kBlock ids, each encoded on its own as the
+//    first id in full, then varint deltas. Cursors jump whole blocks, and an
+//    insert or erase re-encodes only the block it lands in.
+//  - dense: a bitmap over [base_, base_ + 64 * words_.size()), base_ a multiple of 64
+class PostingList {
+    static constexpr uint32_t kBlock = 128;
+    struct Block {
+        int first = 0, last = 0;
+        uint32_t count = 0;
+        string bytes;
+    };
+    vector<Block> blocks_;
+    vector<uint64_t> words_;
+    bool dense_ = false;
+    int base_ = 0;
+    uint32_t count_ = 0;
+    int first_ = 0, last_ = 0;
+
+    static void putVarint(string& b, uint32_t v) {
+        while (v >= 0x80) { b.push_back(static_cast<char>(v | 0x80)); v >>= 7; }
+        b.push_back(static_cast<char>(v));
+    }
+    static uint32_t getVarint(const string& b, size_t& pos) {
+        uint32_t v = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t c = static_cast<uint8_t>(b[pos++]);
+            v |= static_cast<uint32_t>(c & 0x7f) << shift;
+            if (!(c & 0x80)) return v;
+        }
+    }
+    uint64_t span() const { return static_cast<uint64_t>(static_cast<int64_t>(last_) - first_) + 1; }
+    // bitmap once at least 1 in 32 ids of the span is present; back below 1 in 64
+    bool wantDense() const { return count_ >= 256 && span() / 8 < uint64_t(count_) * 4; }
+    bool wantSparse() const { return span() / 8 > uint64_t(count_) * 8; }
+
+    void appendSparse(int id) {
+        if (blocks_.empty() || blocks_.back().count >= kBlock) {
+            blocks_.emplace_back();
+            auto& b = blocks_.back();
+            b.first = b.last = id;
+            b.count = 1;
+            putVarint(b.bytes, static_cast<uint32_t>(id));
+            return;
+        }
+        auto& b = blocks_.back();
+        putVarint(b.bytes, static_cast<uint32_t>(id) - static_cast<uint32_t>(b.last));
+        b.last = id;
+        ++b.count;
+    }
+
+    static void decodeBlock(const Block& b, vector<int>& out) {
+        size_t pos = 0;
+        uint32_t cur = 0;
+        for (uint32_t i = 0; i < b.count; ++i) {
+            uint32_t v = getVarint(b.bytes, pos);
+            cur = i ? cur + v : v;
+            out.push_back(static_cast<int>(cur));
+        }
+    }
+    static void encodeBlock(Block& b, vector<int>::const_iterator from, vector<int>::const_iterator to) {
+        b.bytes.clear();
+        b.first = *from;
+        b.count = static_cast<uint32_t>(to - from);
+        for (auto it = from; it != to; ++it)
+            putVarint(b.bytes, it == from ? static_cast<uint32_t>(*it)
+                                          : static_cast<uint32_t>(*it) - static_cast<uint32_t>(it[-1]));
+        b.last = to[-1];
+    }
+    // the block id falls in or would be added to
+    size_t blockOf(int id) const {
+        auto it = std::upper_bound(blocks_.begin(), blocks_.end(), id,
+                                   [](int v, const Block& b) { return v < b.first; });
+        return it == blocks_.begin() ? 0 : static_cast<size_t>(it - blocks_.begin() - 1);
+    }
+
+    bool insertSparse(int id) {
+        size_t k = blockOf(id);
+        vector<int> ids;
+        decodeBlock(blocks_[k], ids);
+        auto it = std::lower_bound(ids.begin(), ids.end(), id);
+        if (it != ids.end() && *it == id) return false;
+        ids.insert(it, id);
+        if (ids.size() < 2 * kBlock) {
+            encodeBlock(blocks_[k], ids.begin(), ids.end());
+        } else {
+            auto mid = ids.begin() + kBlock;
+            blocks_.insert(blocks_.begin() + static_cast<std::ptrdiff_t>(k) + 1, Block());
+            encodeBlock(blocks_[k], ids.begin(), mid);
+            encodeBlock(blocks_[k + 1], mid, ids.end());
+        }
+        return true;
+    }
+
+    bool eraseSparse(int id) {
+        size_t k = blockOf(id);
+        vector<int> ids;
+        decodeBlock(blocks_[k], ids);
+        auto it = std::lower_bound(ids.begin(), ids.end(), id);
+        if (it == ids.end() || *it != id) return false;
+        ids.erase(it);
+        // a block that shrank small enough takes in its successor
+        if (k + 1 < blocks_.size() && ids.size() + blocks_[k + 1].count <= kBlock) {
+            decodeBlock(blocks_[k + 1], ids);
+            blocks_.erase(blocks_.begin() + static_cast<std::ptrdiff_t>(k) + 1);
+        }
+        if (ids.empty()) blocks_.erase(blocks_.begin() + static_cast<std::ptrdiff_t>(k));
+        else encodeBlock(blocks_[k], ids.begin(), ids.end());
+        return true;
+    }
+
+    void setBit(int id) {
+        uint64_t off = static_cast<uint64_t>(static_cast<int64_t>(id) - base_);
+        if (off / 64 >= words_.size()) words_.resize(off / 64 + 1, 0);
+        words_[off / 64] |= uint64_t(1) << (off % 64);
+    }
+
+    // dense: the first set bit at or after id / the last at or before it;
+    // the caller knows there is one
+    int nextSet(int id) const {
+        uint64_t off = static_cast<uint64_t>(static_cast<int64_t>(id) - base_);
+        size_t i = off / 64;
+        uint64_t bits = words_[i] & (~uint64_t(0) << (off % 64));
+        while (!bits) bits = words_[++i];
+        return static_cast<int>(base_ + static_cast<int64_t>(i * 64) + __builtin_ctzll(bits));
+    }
+    int prevSet(int id) const {
+        uint64_t off = static_cast<uint64_t>(static_cast<int64_t>(id) - base_);
+        size_t i = off / 64;
+        uint64_t bits = words_[i] & (~uint64_t(0) >> (63 - off % 64));
+        while (!bits) bits = words_[--i];
+        return static_cast<int>(base_ + static_cast<int64_t>(i * 64) + 63 - __builtin_clzll(bits));
+    }
+
+    void rebuild(const vector<int>& ids, bool dense) {
+        *this = PostingList();
+        if (ids.empty()) return;
+        dense_ = dense;
+        base_ = static_cast<int>(floorDiv64(ids.front()) * 64);
+        for (int id : ids) {
+            if (dense_) setBit(id); else appendSparse(id);
+            last_ = id;
+            ++count_;
+        }
+        first_ = ids.front();
+    }
+public:
+    // ids must arrive in increasing order
+    void append(int id) {
+        if (count_ == 0) { first_ = base_ = id; }
+        if (dense_) setBit(id); else appendSparse(id);
+        last_ = id;
+        ++count_;
+        if (!dense_ && wantDense()) rebuild(decode(), true);
+    }
+
+    void insert(int id) {
+        if (count_ == 0 || id > last_) { append(id); return; }
+        if (dense_) {
+            if (contains(id)) return;
+            if (id < base_) {
+                // room in front for id's word
+                auto grow = static_cast<size_t>((base_ - floorDiv64(id) * 64) / 64);
+                words_.insert(words_.begin(), grow, 0);
+                base_ -= static_cast<int>(grow * 64);
+            }
+            setBit(id);
+            ++count_;
+            first_ = std::min(first_, id);
+            if (wantSparse()) rebuild(decode(), false);
+            return;
+        }
+        if (!insertSparse(id)) return;
+        ++count_;
+        first_ = blocks_.front().first;
+        if (wantDense()) rebuild(decode(), true);
+    }
+
+    void erase(int id) {
+        if (count_ == 0) return;
+        if (dense_) {
+            if (!contains(id)) return;
+            uint64_t off = static_cast<uint64_t>(static_cast<int64_t>(id) - base_);
+            words_[off / 64] &= ~(uint64_t(1) << (off % 64));
+            if (--count_ == 0) { *this = PostingList(); return; }
+            // the ends move to the nearest ids left, scanning from where they were
+            if (id == first_) first_ = nextSet(id);
+            if (id == last_) {
+                last_ = prevSet(id);
+                words_.resize(static_cast<size_t>(static_cast<int64_t>(last_) - base_) / 64 + 1);
+            }
+            if (wantSparse()) { rebuild(decode(), false); return; }
+            // words before first_ go once they are half the bitmap
+            size_t lead = static_cast<size_t>(static_cast<int64_t>(first_) - base_) / 64;
+            if (lead * 2 > words_.size()) {
+                words_.erase(words_.begin(), words_.begin() + static_cast<std::ptrdiff_t>(lead));
+                base_ += static_cast<int>(lead * 64);
+            }
+            return;
+        }
+        if (!eraseSparse(id)) return;
+        if (--count_ == 0) { *this = PostingList(); return; }
+        first_ = blocks_.front().first;
+        last_ = blocks_.back().last;
+    }
+
+    bool contains(int id) const {
+        if (dense_) {
+            if (id < base_) return false;
+            uint64_t off = static_cast<uint64_t>(static_cast<int64_t>(id) - base_);
+            return off / 64 < words_.size() && (words_[off / 64] >> (off % 64) & 1);
+        }
+        Cursor c(*this);
+        c.seek(id);
+        return c.valid() && c.value() == id;
+    }
+
+    vector<int> decode() const {
+        vector<int> out;
+        out.reserve(count_);
+        for (Cursor c(*this); c.valid(); c.advance()) out.push_back(c.value());
+        return out;
+    }
+
+    static int64_t floorDiv64(int64_t v) { return v >= 0 ? v / 64 : -((-v + 63) / 64); }
+
+    uint32_t size() const { return count_; }
+    bool dense() const { return dense_; }
+    // dense only: bitmap word w covers ids [64 * (firstWord() + w), +64)
+    int64_t firstWord() const { return floorDiv64(base_); }
+    const vector<uint64_t>& words() const { return words_; }
+    size_t bytes() const {
+        size_t n = blocks_.size() * sizeof(Block) + words_.size() * 8;
+        for (auto& b : blocks_) n += b.bytes.size();
+        return n;
+    }
+
+    class Cursor {
+        const PostingList* list_;
+        size_t block_ = 0;       // sparse: block of cur_
+        uint32_t index_ = 0;     // sparse: ordinal in the block of the entry after cur_
+        size_t pos_ = 0;         // sparse: byte offset in the block / dense: bit offset of cur_
+        int cur_ = 0;
+        bool valid_ = false;
+
+        void nextSparse() {
+            auto& bl = list_->blocks_;
+            while (block_ < bl.size() && index_ >= bl[block_].count) { ++block_; index_ = 0; pos_ = 0; }
+            if (block_ >= bl.size()) { valid_ = false; return; }
+            uint32_t v = getVarint(bl[block_].bytes, pos_);
+            cur_ = index_ == 0 ? static_cast<int>(v) : static_cast<int>(static_cast<uint32_t>(cur_) + v);
+            ++index_;
+            valid_ = true;
+        }
+        // first set bit at or after bit offset off
+        void scanDense(uint64_t off) {
+            auto& w = list_->words_;
+            size_t i = off / 64;
+            if (i >= w.size()) { valid_ = false; return; }
+            uint64_t bits = w[i] & (~uint64_t(0) << (off % 64));
+            while (!bits) {
+                if (++i >= w.size()) { valid_ = false; return; }
+                bits = w[i];
+            }
+            pos_ = i * 64 + static_cast<size_t>(__builtin_ctzll(bits));
+            cur_ = static_cast<int>(list_->base_ + static_cast<int64_t>(pos_));
+            valid_ = true;
+        }
+    public:
+        explicit Cursor(const PostingList& l) : list_(&l) {
+            if (l.dense_) scanDense(0); else nextSparse();
+        }
+        bool valid() const { return valid_; }
+        int value() const { return cur_; }
+        void advance() {
+            if (list_->dense_) scanDense(pos_ + 1); else nextSparse();
+        }
+        // first id >= target
+        void seek(int target) {
+            if (!valid_ || cur_ >= target) return;
+            if (list_->dense_) {
+                scanDense(static_cast<uint64_t>(static_cast<int64_t>(target) - list_->base_));
+                return;
+            }
+            size_t block = list_->blockOf(target);
+            if (block > block_) {
+                block_ = block;
+                index_ = 0;
+                pos_ = 0;
+                nextSparse();
+            }
+            while (valid_ && cur_ < target) nextSparse();
+        }
+        const PostingList& list() const { return *list_; }
+    };
+};
+
+class SearchIndex {
+    std::map<string, PostingList, std::less<>> terms_;
+    using Mutex = metrics::InstrumentedMutex<std::shared_mutex>;
+    mutable Mutex mtx_{metrics::Lock::Search};
+
+    // One query word's ids in ascending order.
+    struct Source {
+        virtual ~Source() = default;
+        virtual bool valid() const = 0;
+        virtual int value() const = 0;
+        virtual void advance() = 0;
+        virtual void seek(int target) = 0;
+        virtual uint64_t cost() const = 0;
+    };
+
+    struct ListSource : Source {
+        PostingList::Cursor c;
+        explicit ListSource(const PostingList& l) : c(l) {}
+        bool valid() const override { return c.valid(); }
+        int value() const override { return c.value(); }
+        void advance() override { c.advance(); }
+        void seek(int t) override { c.seek(t); }
+        uint64_t cost() const override { return c.list().size(); }
+    };
+
+    // AND of several bitmap lists, evaluated a 64-bit word at a time
+    struct DenseAndSource : Source {
+        vector<const PostingList*> lists;
+        int64_t lo = INT64_MIN, hi = INT64_MAX;   // global word range all lists cover
+        int64_t cur = 0;
+        bool ok = false;
+        explicit DenseAndSource(vector<const PostingList*> l) : lists(move(l)) {
+            for (auto p : lists) {
+                lo = std::max(lo, p->firstWord());
+                hi = std::min(hi, p->firstWord() + static_cast<int64_t>(p->words().size()));
+            }
+            find(lo * 64);
+        }
+        // first id >= from present in every list
+        void find(int64_t from) {
+            ok = false;
+            int64_t g = std::max(lo, PostingList::floorDiv64(from));
+            uint64_t mask = g == PostingList::floorDiv64(from) ? ~uint64_t(0) << (from - g * 64) : ~uint64_t(0);
+            for (; g < hi; ++g, mask = ~uint64_t(0)) {
+                uint64_t w = mask;
+                for (auto p : lists) {
+                    w &= p->words()[static_cast<size_t>(g - p->firstWord())];
+                    if (!w) break;
+                }
+                if (w) { cur = g * 64 + __builtin_ctzll(w); ok = true; return; }
+            }
+        }
+        bool valid() const override { return ok; }
+        int value() const override { return static_cast<int>(cur); }
+        void advance() override { if (ok) find(cur + 1); }
+        void seek(int t) override { if (ok && cur < t) find(t); }
+        uint64_t cost() const override {
+            uint64_t m = UINT64_MAX;
+            for (auto p : lists) m = std::min<uint64_t>(m, p->size());
+            return m;
+        }
+    };
+
+    // OR of every word sharing a prefix, merged lazily through a min-heap
+    struct PrefixSource : Source {
+        vector<PostingList::Cursor> cs;
+        vector<size_t> heap;   // indexes into cs, smallest value on top
+        uint64_t total = 0;
+        bool dup = false;
+        static bool later(const vector<PostingList::Cursor>& c, size_t a, size_t b) { return c[a].value() > c[b].value(); }
+        void push(size_t i) {
+            heap.push_back(i);
+            std::push_heap(heap.begin(), heap.end(), [&](size_t a, size_t b) { return later(cs, a, b); });
+        }
+        size_t pop() {
+            std::pop_heap(heap.begin(), heap.end(), [&](size_t a, size_t b) { return later(cs, a, b); });
+            size_t i = heap.back();
+            heap.pop_back();
+            return i;
+        }
+        explicit PrefixSource(vector<const PostingList*> lists) {
+            for (auto p : lists) { cs.emplace_back(*p); total += p->size(); }
+            for (size_t i = 0; i < cs.size(); ++i) if (cs[i].valid()) push(i);
+        }
+        bool valid() const override { return !heap.empty(); }
+        int value() const override { return cs[heap.front()].value(); }
+        void advance() override {
+            int v = value();
+            while (!heap.empty() && value() == v) {
+                size_t i = pop();
+                cs[i].advance();
+                if (cs[i].valid()) push(i);
+            }
+        }
+        void seek(int t) override {
+            while (!heap.empty() && value() < t) {
+                size_t i = pop();
+                cs[i].seek(t);
+                if (cs[i].valid()) push(i);
+            }
+        }
+        uint64_t cost() const override { return total; }
+    };
+
+    template<typename Fn>
+    static void tokenize(std::string_view text, Fn&& fn) {
+        string tok;
+        auto flush = [&] { if (!tok.empty()) { fn(tok); tok.clear(); } };
+        for (char c : text) {
+            unsigned char u = static_cast<unsigned char>(c);
+            if (std::isalnum(u) || u >= 0x80) tok.push_back(static_cast<char>(std::tolower(u)));
+            else flush();
+        }
+        flush();
+    }
+
+    // kinds are indexed as words that no query text can tokenize to
+    static string kindTerm(ItemKind k) { return string("\x01") + static_cast<char>('0' + static_cast<int>(k)); }
+
+    template<typename Fn>
+    static void tokens(ItemKind kind, std::string_view title, const vector<std::string_view>& authors, Fn&& fn) {
+        std::set<string> seen;
+        auto add = [&](const string& t) { if (seen.insert(t).second) fn(t); };
+        tokenize(title, add);
+        for (auto a : authors) tokenize(a, add);
+        fn(kindTerm(kind));
+    }
+
+
+public:
+    void add(int id, ItemKind kind, std::string_view title, const vector<std::string_view>& authors) {
+        std::unique_lock<Mutex> l(mtx_);
+        tokens(kind, title, authors, [&](const string& t) {
+            auto it = terms_.find(t);
+            if (it == terms_.end()) it = terms_.emplace(t, PostingList()).first;
+            it->second.insert(id);
+        });
+    }
+    void add(const Item& item) { add(item.id(), item.kind(), item.title(), item.authors()); }
+
+    void remove(int id, ItemKind kind, std::string_view title, const vector<std::string_view>& authors) {
+        std::unique_lock<Mutex> l(mtx_);
+        tokens(kind, title, authors, [&](const string& t) {
+            auto it = terms_.find(t);
+            if (it == terms_.end()) return;
+            it->second.erase(id);
+            if (it->second.size() == 0) terms_.erase(it);
+        });
+    }
+    void remove(const Item& item) { remove(item.id(), item.kind(), item.title(), item.authors()); }
+
+    // Up to max ids greater than after that match every term of the query (and
+    // kind, if given), in ascending order. A term ending in '*' matches any word
+    // with that prefix. Callers page through larger results by passing the last id back.
+    vector<int> match(std::string_view query, optional<ItemKind> kind, int after, size_t max) const {
+        vector<int> out;
+        if (after == std::numeric_limits<int>::max()) return out;
+        std::shared_lock<Mutex> l(mtx_);
+        vector<std::unique_ptr<Source>> sources;
+        vector<const PostingList*> dense;
+        auto exact = [&](const string& t) {
+            auto it = terms_.find(t);
+            if (it == terms_.end()) return false;
+            if (it->second.dense()) dense.push_back(&it->second);
+            else sources.push_back(std::make_unique<ListSource>(it->second));
+            return true;
+        };
+        size_t start = 0;
+        while (start < query.size()) {
+            size_t end = query.find_first_of(" \t", start);
+            if (end == std::string_view::npos) end = query.size();
+            std::string_view word = query.substr(start, end - start);
+            start = end + 1;
+            bool prefix = !word.empty() && word.back() == '*';
+            if (prefix) word.remove_suffix(1);
+            vector<string> toks;
+            tokenize(word, [&](const string& t) { toks.push_back(t); });
+            for (size_t k = 0; k < toks.size(); ++k) {
+                if (prefix && k + 1 == toks.size()) {
+                    vector<const PostingList*> lists;
+                    for (auto it = terms_.lower_bound(toks[k]);
+                         it != terms_.end() && it->first.compare(0, toks[k].size(), toks[k]) == 0; ++it)
+                        lists.push_back(&it->second);
+                    if (lists.empty()) return out;
+                    sources.push_back(std::make_unique<PrefixSource>(move(lists)));
+                } else if (!exact(toks[k])) {
+                    return out;
+                }
+            }
+        }
+        if (sources.empty() && dense.empty()) return out;   // no words: not a kind listing
+        if (kind && !exact(kindTerm(*kind))) return out;
+        if (!dense.empty()) sources.push_back(std::make_unique<DenseAndSource>(move(dense)));
+        if (sources.empty()) return out;
+
+        // leapfrog intersection, cheapest source first
+        std::sort(sources.begin(), sources.end(), [](auto& a, auto& b) { return a->cost() < b->cost(); });
+        for (auto& s : sources) { s->seek(after + 1); if (!s->valid()) return out; }
+        int target = sources[0]->value();
+        while (out.size() < max) {
+            bool all = true;
+            for (size_t k = 0; k < sources.size(); ++k) {
+                sources[k]->seek(target);
+                if (!sources[k]->valid()) return out;
+                if (sources[k]->value() > target) { target = sources[k]->value(); all = false; break; }
+            }
+            if (!all) continue;
+            out.push_back(target);
+            sources[0]->advance();
+            if (!sources[0]->valid()) return out;
+            target = sources[0]->value();
+        }
+        return out;
+    }
+
+    // indexed words starting with prefix, most frequent first
+    vector<std::pair<string, uint32_t>> complete(std::string_view prefix, size_t limit) const {
+        string p;
+        tokenize(prefix, [&](const string& t) { p = t; });
+        if (p.empty()) return {};
+        vector<std::pair<string, uint32_t>> res;
+        std::shared_lock<Mutex> l(mtx_);
+        for (auto it = terms_.lower_bound(p); it != terms_.end() && it->first.compare(0, p.size(), p) == 0; ++it)
+            res.emplace_back(it->first, it->second.size());
+        size_t n = std::min(limit, res.size());
+        std::partial_sort(res.begin(), res.begin() + n, res.end(), [](auto& a, auto& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        res.resize(n);
+        return res;
+    }
+
+    size_t termCount() const {
+        std::shared_lock<Mutex> l(mtx_);
+        return terms_.size();
+    }
+};
+
+
+// An item as a snapshot sees it: the object (whose other fields never change)
+// and its availability at the snapshot's epoch.
+struct ItemVersion {
+    shared_ptr<const Item> item;
+    ItemState state;
+};
+
+// Items a columnar query selects: every kind or one, optionally narrowed to
+// one availability and to archived (or not archived) issues.
+struct ItemFilter {
+    optional<ItemKind> kind;
+    optional<AvailabilityStatus> status;
+    optional<bool> archived;
+};
+
+// Availability of one ItemRepo stripe's items as columns, partitioned by
+// kind. A row is a 4-bit cell (availability in the low two bits, then
+// archived, then live) packed 16 to a word, so a filter is a mask-and-compare
+// per word and a count a popcount; neither touches an Item. Rows are added
+// and dropped by a caller holding the stripe exclusively. A stored item's
+// cell is bound to its ColumnCell and changes with one CAS and no lock, so
+// scans may run alongside; words never move once allocated. kStride is the
+// number of stripes, as for the stripe's own table.
+template<size_t kStride>
+class ItemColumns {
+    static constexpr size_t kKinds = 3;
+    static constexpr uint32_t kCells = 16;                      // per word
+    static constexpr uint64_t kLow = 0x1111111111111111ull;     // bit 0 of every cell
+    static constexpr uint64_t kStatus = 3, kArchived = 4, kLive = 8;
+
+    static constexpr size_t kFirstChunk = 4;                     // words; each chunk doubles
+    struct Partition {
+        // chunk c holds kFirstChunk << c words, so 32 cover any row count
+        std::array<std::unique_ptr<std::atomic<uint64_t>[]>, 32> chunks;
+        size_t capacity = 0;        // words allocated
+        vector<int> ids;            // row -> item id
+        vector<uint32_t> free;      // dropped rows, reused first
+
+        std::atomic<uint64_t>& word(size_t i) const {
+            size_t c = 63 - static_cast<size_t>(__builtin_clzll(i / kFirstChunk + 1));
+            return chunks[c][i - kFirstChunk * ((size_t(1) << c) - 1)];
+        }
+    };
+    struct Row {
+        uint32_t row = 0;
+        uint8_t part = 0;
+        ColumnCell* bound = nullptr;   // the stored object's, if any
+    };
+    std::array<Partition, kKinds> parts_;
+    RepoStorage::Table<Row, kStride> rows_;
+
+    static uint32_t shiftOf(uint32_t row) { return (row % kCells) * 4; }
+
+    // bit 0 of every cell of w that equals want under mask
+    static uint64_t matches(uint64_t w, uint64_t mask, uint64_t want) {
+        uint64_t x = (w & mask) ^ want;
+        x |= x >> 1;
+        x |= x >> 2;
+        return ~x & kLow;
+    }
+
+    // (mask, want) for f, repeated into every cell; live is always required
+    static std::pair<uint64_t, uint64_t> pattern(const ItemFilter& f) {
+        uint64_t mask = kLive, want = kLive;
+        if (f.status) { mask |= kStatus; want |= static_cast<uint64_t>(*f.status); }
+        if (f.archived) { mask |= kArchived; want |= *f.archived ? kArchived : 0; }
+        return {mask * kLow, want * kLow};
+    }
+
+    // the partitions f covers, as [first, last)
+    static std::pair<size_t, size_t> partsOf(const ItemFilter& f) {
+        if (!f.kind) return {0, kKinds};
+        size_t p = static_cast<size_t>(*f.kind) - 1;
+        return {p, p + 1};
+    }
+
+    // caller excludes readers; bound neighbours in the word may change alongside
+    void store(Partition& p, uint32_t row, uint64_t cell) {
+        auto& w = p.word(row / kCells);
+        uint32_t shift = shiftOf(row);
+        uint64_t cur = w.load(std::memory_order_relaxed);
+        while (!w.compare_exchange_weak(cur, (cur & ~(uint64_t(0xf) << shift)) | cell << shift,
+                                        std::memory_order_acq_rel, std::memory_order_relaxed)) {}
+    }
+
+    static void grow(Partition& p, size_t words) {
+        for (size_t c = 0; p.capacity < words; ++c) {
+            if (p.chunks[c]) continue;
+            size_t n = kFirstChunk << c;
+            p.chunks[c].reset(new std::atomic<uint64_t>[n]);
+            for (size_t i = 0; i < n; ++i) p.chunks[c][i].store(0, std::memory_order_relaxed);
+            p.capacity += n;
+        }
+    }
+
+    // points found's row at cell, retiring the object bound before
+    void bind(Row& found, ColumnCell* cell) {
+        if (found.bound == cell) return;
+        if (found.bound) found.bound->unbind();
+        found.bound = cell;
+        if (cell) cell->bind(&parts_[found.part].word(found.row / kCells), shiftOf(found.row));
+    }
+public:
+    static uint64_t cellOf(AvailabilityStatus s, bool archived) {
+        return kLive | (archived ? kArchived : 0) | static_cast<uint64_t>(s);
+    }
+    static uint64_t cellOf(const Item& item) {
+        bool archived = item.kind() == ItemKind::EMagazine && static_cast<const EMagazine&>(item).isArchived();
+        return cellOf(item.status(), archived);
+    }
+
+    // Gives id a row of kind's partition holding cell, bound to the stored
+    // object's ColumnCell if there is one; caller excludes readers. The
+    // caller mirrors the object again afterwards, for changes made meanwhile.
+    void place(int id, ItemKind kind, uint64_t cell, ColumnCell* bound = nullptr) {
+        uint8_t part = static_cast<uint8_t>(static_cast<size_t>(kind) - 1);
+        if (auto found = rows_.find(id)) {
+            if (found->part == part) {
+                bind(*found, bound);
+                store(parts_[part], found->row, cell);
+                return;
+            }
+            drop(id);
+        }
+        auto& p = parts_[part];
+        uint32_t row;
+        if (!p.free.empty()) {
+            row = p.free.back();
+            p.free.pop_back();
+            p.ids[row] = id;
+        } else {
+            row = static_cast<uint32_t>(p.ids.size());
+            p.ids.push_back(id);
+            grow(p, row / kCells + 1);
+        }
+        rows_[id] = {row, part, nullptr};
+        bind(*rows_.find(id), bound);
+        store(p, row, cell);
+    }
+
+    // caller excludes readers
+    void drop(int id) {
+        auto found = rows_.find(id);
+        if (!found) return;
+        Row r = *found;
+        if (r.bound) r.bound->unbind();
+        rows_.erase(id);
+        store(parts_[r.part], r.row, 0);
+        parts_[r.part].free.push_back(r.row);
+    }
+
+    void clear() {
+        rows_.forEach([](int, const Row& r) { if (r.bound) r.bound->unbind(); });
+        for (auto& p : parts_) p = Partition{};
+        rows_.clear();
+    }
+
+    size_t count(const ItemFilter& f) const {
+        auto [mask, want] = pattern(f);
+        auto [first, last] = partsOf(f);
+        size_t n = 0;
+        for (size_t k = first; k < last; ++k) {
+            auto& p = parts_[k];
+            size_t words = (p.ids.size() + kCells - 1) / kCells;
+            for (size_t i = 0; i < words; ++i)
+                n += static_cast<size_t>(__builtin_popcountll(matches(p.word(i).load(std::memory_order_relaxed), mask, want)));
+        }
+        return n;
+    }
+
+    // whether id has a row matching filter
+    bool test(int id, const ItemFilter& filter) const {
+        auto found = rows_.find(id);
+        if (!found) return false;
+        auto [first, last] = partsOf(filter);
+        if (found->part < first || found->part >= last) return false;
+        auto [mask, want] = pattern(filter);
+        uint64_t w = parts_[found->part].word(found->row / kCells).load(std::memory_order_relaxed);
+        return ((w >> shiftOf(found->row) ^ want) & mask & 0xf) == 0;
+    }
+
+    // f(id) for every row matching filter, partition by partition in row order
+    template<typename F>
+    void forEach(const ItemFilter& filter, F&& f) const {
+        auto [mask, want] = pattern(filter);
+        auto [first, last] = partsOf(filter);
+        for (size_t k = first; k < last; ++k) {
+            auto& p = parts_[k];
+            size_t words = (p.ids.size() + kCells - 1) / kCells;
+            for (size_t i = 0; i < words; ++i)
+                for (uint64_t m = matches(p.word(i).load(std::memory_order_relaxed), mask, want); m; m &= m - 1)
+                    f(p.ids[i * kCells + static_cast<size_t>(__builtin_ctzll(m)) / 4]);
+        }
+    }
+};
+
+// Items live either in storage or, untouched, in an attached catalog image.
+// findById copies a catalog item into its stripe the first time it is handed
+// out, so the mutable object callers receive stays the one the repo keeps.
+// Reads (all, findWhere, peek) leave the catalog alone and hand out const
+// items, some of them detached copies.
+class ItemRepo : public InMemoryRepo<Item, StripedLocks<16>, RepoStorage> {
+    using Base = InMemoryRepo<Item, StripedLocks<16>, RepoStorage>;
+    // what lived at an id: an object, or (present, null) an untouched catalog item
+    struct Resident {
+        shared_ptr<Item> item;
+        bool present = false;
+    };
+    struct alignas(64) StateLog {
+        std::mutex mtx;
+        History<const Item*, ItemState> history;
+    };
+    shared_ptr<const CatalogImage> catalog_;              // replaced only with every stripe locked
+    std::array<std::unordered_set<int>, kStripes> removed_;  // catalog ids deleted since attach, per stripe
+    std::array<size_t, kStripes> added_{};                // stored ids the catalog lacks, per stripe
+    SearchIndex index_;                                   // titles/authors of every live item
+    std::atomic<bool> catalogIndexed_{true};              // catalog words are indexed on first search
+    using Columns = ItemColumns<kStripes>;
+    std::array<Columns, kStripes> columns_;               // every stored item, plus the catalog once columned
+    std::atomic<bool> catalogColumned_{true};             // catalog rows are added on first filter
+    // Snapshot support. Attaching a catalog is not versioned; attach it
+    // before taking snapshots.
+    Versions* versions_ = nullptr;
+    std::array<History<int, Resident>, kStripes> residents_;   // under the stripe's lock
+    mutable std::array<StateLog, kStripes> states_;            // item states, by object
+    std::atomic<bool> kept_{false};                            // set after saving to either history
+
+    static optional<ItemKind> kindOf(const string& typeName) {
+        if (typeName == "Book") return ItemKind::Book;
+        if (typeName == "Audiobook") return ItemKind::Audiobook;
+        if (typeName == "EMagazine") return ItemKind::EMagazine;
+        return nullopt;
+    }
+
+    vector<std::string_view> catalogAuthors(const CatalogRecord& r) const {
+        vector<std::string_view> res;
+        for (uint32_t k = 0; k < r.authorsCount; ++k) res.push_back(catalog_->author(r, k));
+        return res;
+    }
+
+    // caller holds stripe k exclusively
+    bool shadowed(size_t k, int id) const { return stripes_[k].storage.count(id) || removed_[k].count(id); }
+
+    // caller holds id's stripe exclusively; drops the index words of whatever lives at id
+    void unindex(int id) {
+        size_t k = stripeOf(id);
+        if (auto found = stripes_[k].storage.find(id)) { index_.remove(**found); return; }
+        if (!catalog_ || !catalogIndexed_ || removed_[k].count(id)) return;
+        if (auto r = catalog_->find(id))
+            index_.remove(id, static_cast<ItemKind>(r->kind), catalog_->str(r->title), catalogAuthors(*r));
+    }
+
+    // caller is a Writer and holds stripe k exclusively; call before changing what lives at id
+    void keepResident(size_t k, int id) {
+        if (!versions_ || !versions_->retaining()) return;
+        Resident before;
+        if (auto found = stripes_[k].storage.find(id)) before = {*found, true};
+        else before.present = catalog_ && !removed_[k].count(id) && catalog_->find(id);
+        residents_[k].save(id, versions_->epoch(), before);
+        kept_.store(true);
+    }
+
+    // what `then` says lived at id, with its current state (corrected later); caller holds stripe k
+    void addResident(int id, const Resident& then, vector<ItemVersion>& out, bool catalog = true) const {
+        if (!then.present) return;
+        if (then.item) out.push_back({then.item, then.item->state()});
+        else if (auto r = catalog && catalog_ ? catalog_->find(id) : nullptr) addCatalog(*r, out);
+    }
+    void addCatalog(const CatalogRecord& r, vector<ItemVersion>& out) const {
+        auto item = catalog_->materialize(r);
+        out.push_back({item, item->state()});
+    }
+    // replaces the states of out[first..] by those at epoch, for objects changed since
+    void statesAsOf(size_t k, uint64_t epoch, vector<ItemVersion>& out, size_t first) const {
+        std::lock_guard<std::mutex> l(states_[k].mtx);
+        if (states_[k].history.empty()) return;
+        for (size_t i = first; i < out.size(); ++i)
+            if (auto st = states_[k].history.asOf(out[i].item.get(), epoch)) out[i].state = *st;
+    }
+
+    // caller is a Writer and holds id's stripe exclusively
+    void put(shared_ptr<Item> obj, int id) {
+        size_t k = stripeOf(id);
+        if (!stripes_[k].storage.count(id) && !(catalog_ && catalog_->find(id))) ++added_[k];
+        keepResident(k, id);
+        unindex(id);
+        index_.add(*obj);
+        columns_[k].place(id, obj->kind(), Columns::cellOf(*obj), &obj->columnCell());
+        mirror(*obj);
+        stripes_[k].storage[id] = move(obj);
+        if (!removed_[k].empty()) removed_[k].erase(id);
+    }
+
+    // the catalog's record indices by stripe, from one pass over the image;
+    // attaching a catalog is setup, so it stays the same while callers use this
+    std::array<vector<uint32_t>, kStripes> catalogByStripe() const {
+        std::array<vector<uint32_t>, kStripes> res;
+        std::shared_lock<Mutex> l(stripes_[0].mtx);
+        for (size_t i = 0; catalog_ && i < catalog_->size(); ++i)
+            res[stripeOf(catalog_->record(i).id)].push_back(static_cast<uint32_t>(i));
+        return res;
+    }
+
+    void indexCatalog() {
+        if (catalogIndexed_) return;
+        auto locks = lockAll();
+        if (catalogIndexed_) return;
+        for (size_t i = 0; catalog_ && i < catalog_->size(); ++i) {
+            auto& r = catalog_->record(i);
+            if (!shadowed(stripeOf(r.id), r.id))
+                index_.add(r.id, static_cast<ItemKind>(r.kind), catalog_->str(r.title), catalogAuthors(r));
+        }
+        catalogIndexed_ = true;
+    }
+
+    void columnCatalog() {
+        if (catalogColumned_) return;
+        auto locks = lockAll();
+        if (catalogColumned_) return;
+        for (size_t i = 0; catalog_ && i < catalog_->size(); ++i) {
+            auto& r = catalog_->checked(catalog_->record(i));
+            size_t k = stripeOf(r.id);
+            if (!shadowed(k, r.id))
+                columns_[k].place(r.id, static_cast<ItemKind>(r.kind),
+                                  Columns::cellOf(static_cast<AvailabilityStatus>(r.status), r.archived != 0));
+        }
+        catalogColumned_ = true;
+    }
+
+    // caller holds id's stripe exclusively; stores a catalog item read out on demand
+    shared_ptr<Item> materialize(size_t k, const CatalogRecord& r) {
+        auto item = catalog_->materialize(r);
+        columns_[k].place(r.id, item->kind(), Columns::cellOf(*item), &item->columnCell());
+        stripes_[k].storage[r.id] = item;
+        return item;
+    }
+
+    // copies item's state into its cell, and again if it moved meanwhile, so
+    // the last of several racing changes is what stays; objects no longer
+    // stored have no cell
+    static void mirror(const Item& item) {
+        for (uint64_t cell = Columns::cellOf(item);;) {
+            if (!item.columnCell().set(cell)) return;
+            uint64_t now = Columns::cellOf(item);
+            if (now == cell) return;
+            cell = now;
+        }
+    }
+public:
+    ItemRepo() : Base(metrics::Lock::Items) {}
+
+    void attachCatalog(shared_ptr<const CatalogImage> catalog) {
+        auto locks = lockAll();
+        catalog_ = move(catalog);
+        for (auto& r : removed_) r.clear();
+        catalogIndexed_ = !catalog_;
+        for (size_t k = 0; k < kStripes; ++k) {
+            columns_[k].clear();
+            added_[k] = 0;
+            stripes_[k].storage.forEach([&](int id, const shared_ptr<Item>& item) {
+                columns_[k].place(id, item->kind(), Columns::cellOf(*item), &item->columnCell());
+                mirror(*item);
+                if (!catalog_ || !catalog_->find(id)) ++added_[k];
+            });
+        }
+        catalogColumned_ = !catalog_;
+    }
+
+    optional<shared_ptr<Item>> findById(int id) {
+        size_t k = stripeOf(id);
+        auto& s = stripes_[k];
+        {
+            std::shared_lock<Mutex> l(s.mtx);
+            if (auto found = s.storage.find(id)) return *found;
+            if (!catalog_ || removed_[k].count(id) || !catalog_->find(id)) return nullopt;
+        }
+        std::unique_lock<Mutex> l(s.mtx);
+        if (auto found = s.storage.find(id)) return *found;
+        if (removed_[k].count(id)) return nullopt;
+        return materialize(k, *catalog_->find(id));
+    }
+
+    // The item at id if it matches f, for reading: a stored item as it is,
+    // an untouched catalog item as a detached copy. Unlike findById, this
+    // never stores a catalog item.
+    shared_ptr<const Item> peek(int id, const ItemFilter& f = {}) {
+        columnCatalog();
+        size_t k = stripeOf(id);
+        std::shared_lock<Mutex> l(stripes_[k].mtx);
+        if (!columns_[k].test(id, f)) return nullptr;
+        if (auto found = stripes_[k].storage.find(id)) return *found;
+        auto r = catalog_ ? catalog_->find(id) : nullptr;
+        return r ? catalog_->materialize(*r) : nullptr;
+    }
+
+    // id's kind, read from the catalog record for an untouched catalog item
+    optional<ItemKind> kindOf(int id) const {
+        size_t k = stripeOf(id);
+        std::shared_lock<Mutex> l(stripes_[k].mtx);
+        if (auto found = stripes_[k].storage.find(id)) return (*found)->kind();
+        if (!catalog_ || removed_[k].count(id)) return nullopt;
+        if (auto r = catalog_->find(id)) return static_cast<ItemKind>(catalog_->checked(*r).kind);
+        return nullopt;
+    }
+
+    void save(shared_ptr<Item> obj, int id) {
+        Versions::Writer w(versions_);
+        std::unique_lock<Mutex> l(stripes_[stripeOf(id)].mtx);
+        put(move(obj), id);
+    }
+
+    void saveAll(const vector<shared_ptr<Item>>& objs) {
+        Versions::Writer w(versions_);
+        auto parts = byStripe(objs);
+        for (size_t k = 0; k < kStripes; ++k) {
+            if (parts[k].empty()) continue;
+            std::unique_lock<Mutex> l(stripes_[k].mtx);
+            for (auto o : parts[k]) put(*o, (*o)->id());
+        }
+    }
+
+    void remove(int id) {
+        Versions::Writer w(versions_);
+        size_t k = stripeOf(id);
+        std::unique_lock<Mutex> l(stripes_[k].mtx);
+        keepResident(k, id);
+        unindex(id);
+        columns_[k].drop(id);
+        bool stored = stripes_[k].storage.count(id);
+        stripes_[k].storage.erase(id);
+        if (catalog_ && catalog_->find(id)) removed_[k].insert(id);
+        else if (stored) --added_[k];
+    }
+
+    // item ids matching every keyword, ascending and > after; see SearchIndex::match
+    vector<int> search(std::string_view query, optional<ItemKind> kind, int after, size_t max) {
+        indexCatalog();
+        return index_.match(query, kind, after, max);
+    }
+
+    vector<std::pair<string, uint32_t>> completions(std::string_view prefix, size_t limit) {
+        indexCatalog();
+        return index_.complete(prefix, limit);
+    }
+
+    // Every item, for reading. Catalog entries nobody has touched come back as
+    // detached copies, so items from the scans are const: changes go through
+    // findById, which hands out the object the repo keeps.
+    vector<shared_ptr<const Item>> all() const {
+        vector<shared_ptr<const Item>> res;
+        auto catalog = catalogByStripe();
+        for (size_t k = 0; k < kStripes; ++k) {
+            std::shared_lock<Mutex> l(stripes_[k].mtx);
+            stripes_[k].storage.forEach([&](int, const shared_ptr<Item>& item) { res.push_back(item); });
+            for (uint32_t i : catalog[k]) {
+                auto& r = catalog_->record(i);
+                if (!shadowed(k, r.id)) res.push_back(catalog_->materialize(r));
+            }
+        }
+        return res;
+    }
+
+    // items held as objects: added, or read out of the catalog, since attach
+    vector<shared_ptr<Item>> residentItems() const { return Base::all(); }
+
+    // the catalog's records, less those removed, plus the stored items it lacks
+    size_t size() const {
+        size_t n = 0;
+        for (size_t k = 0; k < kStripes; ++k) {
+            std::shared_lock<Mutex> l(stripes_[k].mtx);
+            if (k == 0 && catalog_) n += catalog_->size();
+            n += added_[k];
+            n -= removed_[k].size();
+        }
+        return n;
+    }
+
+    vector<shared_ptr<const Item>> findByType(const string& typeName) {
+        auto kind = kindOf(typeName);
+        if (!kind) return {};
+        ItemFilter f;
+        f.kind = kind;
+        return findWhere(f);
+    }
+
+    // items matching f, stripe by stripe; read-only, as for all()
+    vector<shared_ptr<const Item>> findWhere(const ItemFilter& f) {
+        columnCatalog();
+        vector<shared_ptr<const Item>> res;
+        for (size_t k = 0; k < kStripes; ++k) {
+            std::shared_lock<Mutex> l(stripes_[k].mtx);
+            columns_[k].forEach(f, [&](int id) {
+                if (auto found = stripes_[k].storage.find(id)) res.push_back(*found);
+                else if (auto r = catalog_ ? catalog_->find(id) : nullptr) res.push_back(catalog_->materialize(*r));
+            });
+        }
+        return res;
+    }
+
+    // ids of the items matching f, in no particular order; answered from the columns alone
+    vector<int> idsWhere(const ItemFilter& f) {
+        columnCatalog();
+        vector<int> res;
+        for (size_t k = 0; k < kStripes; ++k) {
+            std::shared_lock<Mutex> l(stripes_[k].mtx);
+            columns_[k].forEach(f, [&](int id) { res.push_back(id); });
+        }
+        return res;
+    }
+
+    size_t countWhere(const ItemFilter& f) {
+        columnCatalog();
+        size_t n = 0;
+        for (size_t k = 0; k < kStripes; ++k) {
+            std::shared_lock<Mutex> l(stripes_[k].mtx);
+            n += columns_[k].count(f);
+        }
+        return n;
+    }
+
+    // see BorrowRecordRepo::attachVersions
+    void attachVersions(Versions* versions) {
+        if (versions && versions != versions_)
+            versions->onPrune([this](uint64_t oldest) {
+                // a save racing with this sets kept_ again once it is in
+                if (!kept_.exchange(false)) return;
+                bool left = false;
+                for (size_t k = 0; k < kStripes; ++k) {
+                    {
+                        std::unique_lock<Mutex> l(stripes_[k].mtx);
+                        residents_[k].prune(oldest);
+                        left |= !residents_[k].empty();
+                    }
+                    std::lock_guard<std::mutex> l(states_[k].mtx);
+                    states_[k].history.prune(oldest);
+                    left |= !states_[k].history.empty();
+                }
+                if (left) kept_.store(true);
+            });
+        auto locks = lockAll();
+        versions_ = versions;
+    }
+
+    // Runs change(), which moves item's availability (Item::transition,
+    // setStatus, EMagazine::archiveIssue), saving the state it replaces for
+    // open snapshots first and copying the new one into the item columns
+    // after. No stripe lock is taken; the history's lock only while a
+    // snapshot is open. Returns what change() returns.
+    template<typename F>
+    auto changeState(Item& item, F&& change) {
+        Versions::Writer w(versions_);   // nested in the service's WriteScope, this is free
+        if (versions_ && versions_->retaining()) {
+            auto& log = states_[stripeOf(item.id())];
+            {
+                std::lock_guard<std::mutex> l(log.mtx);
+                log.history.save(&item, versions_->epoch(), item.state());
+            }
+            kept_.store(true);
+        }
+        if constexpr (std::is_void_v<decltype(change())>) {
+            change();
+            mirror(item);
+        } else {
+            auto res = change();
+            mirror(item);
+            return res;
+        }
+    }
+
+    // Every item as of p. Each stripe is read under its shared lock, so
+    // writers wait for at most one stripe; catalog items are detached copies.
+    // Without catalog, only the items held as objects at p (residentItems).
+    vector<ItemVersion> allAsOf(const ReadPoint& p, bool catalog = true) const {
+        vector<ItemVersion> res;
+        auto byStripe = catalog ? catalogByStripe() : std::array<vector<uint32_t>, kStripes>{};
+        for (size_t k = 0; k < kStripes; ++k) {
+            size_t first = res.size();
+            {
+                std::shared_lock<Mutex> l(stripes_[k].mtx);
+                auto& hist = residents_[k];
+                stripes_[k].storage.forEach([&](int id, const shared_ptr<Item>& item) {
+                    if (auto then = hist.asOf(id, p.epoch)) addResident(id, *then, res, catalog);
+                    else res.push_back({item, item->state()});
+                });
+                hist.forEachKey([&](int id) {
+                    if (stripes_[k].storage.find(id)) return;
+                    if (auto then = hist.asOf(id, p.epoch)) addResident(id, *then, res, catalog);
+                });
+                for (uint32_t i : byStripe[k]) {
+                    auto& r = catalog_->record(i);
+                    if (!shadowed(k, r.id) && !hist.asOf(r.id, p.epoch)) addCatalog(r, res);
+                }
+            }
+            statesAsOf(k, p.epoch, res, first);
+        }
+        return res;
+    }
+
+    optional<ItemVersion> findAsOf(const ReadPoint& p, int id) const {
+        size_t k = stripeOf(id);
+        vector<ItemVersion> res;
+        {
+            std::shared_lock<Mutex> l(stripes_[k].mtx);
+            if (auto then = residents_[k].asOf(id, p.epoch)) addResident(id, *then, res);
+            else if (auto found = stripes_[k].storage.find(id)) res.push_back({*found, (*found)->state()});
+            else if (catalog_ && !removed_[k].count(id))
+                if (auto r = catalog_->find(id)) addCatalog(*r, res);
+        }
+        if (res.empty()) return nullopt;
+        statesAsOf(k, p.epoch, res, 0);
+        return res[0];
+    }
+};
+
+// Borrow slots are taken and handed back on whichever User object is stored
+// at the time, under its stripe's shared lock. Re-saving a user carries the
+// count over under the exclusive lock, so a concurrent borrow or return lands
+// either before the carry or on the new object, never on a discarded one.
+class UserRepo : public InMemoryRepo<User, StripedLocks<16>, RepoStorage> {
+    // caller holds the stripe exclusively
+    static void carry(Stripe& s, const shared_ptr<User>& user) {
+        if (auto old = s.storage.find(user->id())) user->restoreActiveBorrows((*old)->activeBorrows());
+        s.storage[user->id()] = user;
+    }
+public:
+    UserRepo() : InMemoryRepo(metrics::Lock::Users) {}
+
+    // stores user in place of any earlier one, keeping the borrows it holds
+    void replace(shared_ptr<User> user) {
+        auto& s = stripes_[stripeOf(user->id())];
+        std::unique_lock<Mutex> l(s.mtx);
+        carry(s, user);
+    }
+
+    void replaceAll(const vector<shared_ptr<User>>& users) {
+        auto parts = byStripe(users);
+        for (size_t k = 0; k < kStripes; ++k) {
+            if (parts[k].empty()) continue;
+            std::unique_lock<Mutex> l(stripes_[k].mtx);
+            for (auto u : parts[k]) carry(stripes_[k], *u);
+        }
+    }
+
+    // false if the user is unknown or at their limit
+    bool tryAcquireBorrow(int userId) {
+        auto& s = stripes_[stripeOf(userId)];
+        std::shared_lock<Mutex> l(s.mtx);
+        auto found = s.storage.find(userId);
+        return found && (*found)->tryAcquireBorrow();
+    }
+
+    void releaseBorrow(int userId) {
+        auto& s = stripes_[stripeOf(userId)];
+        std::shared_lock<Mutex> l(s.mtx);
+        if (auto found = s.storage.find(userId)) (*found)->releaseBorrow();
+    }
+};
+
+// Position in the due-time order; records due at or before it were already reported.
+struct OverdueCursor {
+    system_clock::time_point dueAt = system_clock::time_point::min();
+    int recordId = 0;
+};
+
+// Id-indexed pool of fixed-size records, kSlab to a contiguous block. A slot
+// never moves once its block exists, so pointers into the pool stay valid for
+// the pool's lifetime; records are overwritten, never freed. Slots whose id()
+// is 0 are unused. Not synchronised: the owning repo locks around it.
+template<typename T, size_t kSlab = 4096>
+class Slab {
+    vector<std::unique_ptr<T[]>> blocks_;
+    size_t end_ = 0;   // one past the highest slot handed out
+public:
+    // ids are handed out in order, so one this far past the end is corrupt
+    static constexpr size_t kMaxGap = size_t(1) << 20;
+
+    // slot for id (>= 1), allocating blocks up to it; ids that could only
+    // come from a corrupt journal throw rather than allocate
+    T& slot(int id) {
+        if (id < 1 || static_cast<size_t>(id) > end_ + kMaxGap)
+            throw PersistenceException("Record id " + to_string(id) + " out of range");
+        size_t i = static_cast<size_t>(id) - 1;
+        while (blocks_.size() <= i / kSlab) blocks_.push_back(std::make_unique<T[]>(kSlab));
+        end_ = std::max(end_, i + 1);
+        return blocks_[i / kSlab][i % kSlab];
+    }
+    T* find(int id) const {
+        if (id < 1 || static_cast<size_t>(id) > end_) return nullptr;
+        size_t i = static_cast<size_t>(id) - 1;
+        T& t = blocks_[i / kSlab][i % kSlab];
+        return t.id() ? &t : nullptr;
+    }
+    size_t blocks() const { return (end_ + kSlab - 1) / kSlab; }
+    // visits the used slots of one block
+    template<typename F>
+    void forEachIn(size_t block, F&& f) {
+        if (block >= blocks()) return;
+        T* slots = blocks_[block].get();
+        size_t n = std::min(kSlab, end_ - block * kSlab);
+        for (size_t i = 0; i < n; ++i) if (slots[i].id()) f(slots[i]);
+    }
+    template<typename F>
+    void forEachIn(size_t block, F&& f) const {
+        if (block >= blocks()) return;
+        const T* slots = blocks_[block].get();
+        size_t n = std::min(kSlab, end_ - block * kSlab);
+        for (size_t i = 0; i < n; ++i) if (slots[i].id()) f(slots[i]);
+    }
+    // visits used slots in id order, block by block
+    template<typename F>
+    void forEach(F&& f) const {
+        for (size_t b = 0; b * kSlab < end_; ++b) {
+            const T* block = blocks_[b].get();
+            size_t n = std::min(kSlab, end_ - b * kSlab);
+            for (size_t i = 0; i < n; ++i) if (block[i].id()) f(block[i]);
+        }
+    }
+};
+
+// Borrow records are stored by value in a Slab and handed out as const
+// pointers, which stay valid for the repo's lifetime.
+class BorrowRecordRepo {
+public:
+    // what one overdue sweep charged for one record
+    struct Accrual {
+        int recordId, itemId, userId;
+        int days;        // newly charged
+        int finedDays;   // charged in total so far
+    };
+private:
+    using DueKey = std::pair<system_clock::time_point, int>;
+    // the parts of a record that change after it is added
+    struct State {
+        BorrowStatus status;
+        uint16_t finedDays;
+        system_clock::time_point dueAt;
+    };
+    Slab<BorrowRecord> storage_;
+    size_t count_ = 0;
+    Versions* versions_ = nullptr;
+    History<int, State> history_;                // under mtx_
+    // secondary indexes, maintained by add/restore/markReturned/updateDueAt under mtx_
+    IdTable<BorrowRecord*> activeByItem_;
+    IdTable<vector<int>> byUser_;                // record ids, oldest first
+    std::set<DueKey> activeByDue_;
+    using Mutex = metrics::InstrumentedMutex<std::mutex>;
+    mutable Mutex mtx_{metrics::Lock::Records};
+    int nextId_ = 1;
+
+    // caller is a Writer and holds mtx_; call before changing rec
+    void keep(const BorrowRecord& rec) {
+        if (versions_ && versions_->retaining())
+            history_.save(rec.id(), versions_->epoch(),
+                          State{rec.status(), static_cast<uint16_t>(rec.finedDays()), rec.dueAt()});
+    }
+
+    // rec as a snapshot at epoch sees it; caller holds mtx_
+    BorrowRecord asOf(const BorrowRecord& rec, uint64_t epoch) const {
+        BorrowRecord copy(rec);
+        if (auto st = history_.asOf(rec.id(), epoch)) {
+            copy.assign(rec.id(), rec.itemId(), rec.userId(), rec.borrowAt(), st->dueAt, st->status,
+                        st->status == BorrowStatus::RETURNED ? rec.returnedAt() : system_clock::time_point{});
+            copy.finedDays_.store(st->finedDays, std::memory_order_relaxed);
+        }
+        return copy;
+    }
+
+    void unindexActive(const BorrowRecord& rec) {
+        auto a = activeByItem_.find(rec.itemId());
+        if (a && *a == &rec) activeByItem_.erase(rec.itemId());
+        activeByDue_.erase(DueKey(rec.dueAt(), rec.id()));
+    }
+
+    void unindex(const BorrowRecord& rec) {
+        unindexActive(rec);
+        auto v = byUser_.find(rec.userId());
+        if (!v) return;
+        v->erase(std::remove(v->begin(), v->end(), rec.id()), v->end());
+        if (v->empty()) byUser_.erase(rec.userId());
+    }
+
+    BorrowRecord* put(int id, int itemId, int userId, system_clock::time_point borrowAt, system_clock::time_point dueAt,
+                      BorrowStatus status, system_clock::time_point returnedAt = {}) {
+        BorrowRecord& rec = storage_.slot(id);
+        if (id >= nextId_) nextId_ = id + 1;
+        if (rec.id()) {
+            keep(rec);
+            unindex(rec);
+        } else {
+            ++count_;
+        }
+        rec.assign(id, itemId, userId, borrowAt, dueAt, status, returnedAt);
+        byUser_[userId].push_back(id);
+        if (status != BorrowStatus::RETURNED) {
+            activeByItem_[itemId] = &rec;
+            activeByDue_.insert(DueKey(dueAt, id));
+        }
+        return &rec;
+    }
+
+    template<typename F>
+    vector<const BorrowRecord*> userRecords(int userId, F&& keep) const {
+        vector<const BorrowRecord*> res;
+        auto ids = byUser_.find(userId);
+        if (!ids) return res;
+        res.reserve(ids->size());
+        for (int id : *ids) {
+            const BorrowRecord* r = storage_.find(id);
+            if (keep(*r)) res.push_back(r);
+        }
+        return res;
+    }
+public:
+    // new ACTIVE record with the next free id
+    const BorrowRecord* add(int itemId, int userId, system_clock::time_point borrowAt, system_clock::time_point dueAt) {
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        return put(nextId_, itemId, userId, borrowAt, dueAt, BorrowStatus::ACTIVE);
+    }
+
+    // re-creates a record with its original id, replacing any older copy (recovery)
+    const BorrowRecord* restore(int id, int itemId, int userId, system_clock::time_point borrowAt,
+                                system_clock::time_point dueAt, BorrowStatus status, system_clock::time_point returnedAt) {
+        if (id < 1) throw PersistenceException("Invalid borrow record id");
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        return put(id, itemId, userId, borrowAt, dueAt, status, returnedAt);
+    }
+
+    // ACTIVE/OVERDUE -> RETURNED; keeps the item index in step with the record.
+    // false if the record was no longer open (someone else returned it). Once
+    // this succeeds the sweep leaves the record alone, so finedDays() is final.
+    bool markReturned(const BorrowRecord& rec, system_clock::time_point at) {
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        BorrowRecord* r = storage_.find(rec.id());
+        if (r != &rec || !r->isOpen()) return false;
+        keep(*r);
+        unindexActive(*r);
+        r->markReturned(at);
+        return true;
+    }
+
+    // Looks at the open records in one slab block (see sweepBlocks). Those past
+    // due at `now` with overdue days not yet charged are appended to out; they
+    // change only in chargeOverdue. Returns the open records seen.
+    size_t sweepBlock(size_t block, system_clock::time_point now, vector<Accrual>& out) const {
+        std::lock_guard<Mutex> l(mtx_);
+        size_t open = 0;
+        storage_.forEachIn(block, [&](const BorrowRecord& r) {
+            if (!r.isOpen()) return;
+            ++open;
+            int days = std::min(r.overdueDays(now), 0xffff);
+            if (days > r.finedDays()) out.push_back({r.id(), r.itemId(), r.userId(), days - r.finedDays(), days});
+        });
+        return open;
+    }
+
+    // Marks the records sweepBlock found OVERDUE, fined up to a.finedDays,
+    // and sets a.days to what that adds. Records closed or charged since
+    // the scan are dropped from accruals.
+    void chargeOverdue(vector<Accrual>& accruals) {
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        accruals.erase(std::remove_if(accruals.begin(), accruals.end(), [&](Accrual& a) {
+            BorrowRecord* r = storage_.find(a.recordId);
+            if (!r || !r->isOpen() || a.finedDays <= r->finedDays()) return true;
+            a.days = a.finedDays - r->finedDays();
+            keep(*r);
+            r->markOverdue(a.finedDays);
+            return false;
+        }), accruals.end());
+    }
+
+    // number of blocks sweepBlock can be called for
+    size_t sweepBlocks() const {
+        std::lock_guard<Mutex> l(mtx_);
+        return storage_.blocks();
+    }
+
+    // re-applies a sweep's charge to a record that is still open (recovery)
+    void restoreOverdue(int id, int finedDays) {
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        BorrowRecord* r = storage_.find(id);
+        if (!r || !r->isOpen() || finedDays < r->finedDays()) return;
+        keep(*r);
+        r->markOverdue(finedDays);
+    }
+
+    enum class Renewal { Renewed, Closed, OtherUser, Overdue, NotLater };
+
+    // Checks and extends an open record in one step, so a concurrent return
+    // or second renewal cannot slip in between; newDue is set on Renewed
+    Renewal renew(const BorrowRecord& rec, int userId, system_clock::time_point now, const BorrowDuration& extra,
+                  system_clock::time_point& newDue) {
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        BorrowRecord* r = storage_.find(rec.id());
+        if (r != &rec || !r->isOpen()) return Renewal::Closed;
+        if (r->userId() != userId) return Renewal::OtherUser;
+        if (r->isOverdue(now)) return Renewal::Overdue;
+        system_clock::time_point due = extra.computeDueAt(r->dueAt());
+        if (due <= r->dueAt()) return Renewal::NotLater;
+        keep(*r);
+        bool active = activeByDue_.erase(DueKey(r->dueAt(), r->id())) > 0;
+        r->setDueAt(due);
+        if (active) activeByDue_.insert(DueKey(due, r->id()));
+        newDue = due;
+        return Renewal::Renewed;
+    }
+
+    // moves an active record to its new place in the due-time order
+    // false if the record was closed in the meantime
+    bool updateDueAt(const BorrowRecord& rec, system_clock::time_point newDue) {
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        BorrowRecord* r = storage_.find(rec.id());
+        if (r != &rec || !r->isOpen()) return false;
+        keep(*r);
+        bool active = activeByDue_.erase(DueKey(r->dueAt(), r->id())) > 0;
+        r->setDueAt(newDue);
+        if (active) activeByDue_.insert(DueKey(newDue, r->id()));
+        return true;
+    }
+
+    // copies of the active records with dueAt < now, earliest due first;
+    // O(overdue). Taken under the lock renewals and returns change them under.
+    vector<BorrowRecord> findOverdue(system_clock::time_point now) const {
+        vector<BorrowRecord> res;
+        std::lock_guard<Mutex> l(mtx_);
+        for (auto it = activeByDue_.begin(); it != activeByDue_.end() && it->first < now; ++it)
+            res.push_back(*storage_.find(it->second));
+        return res;
+    }
+
+    // active records that became overdue after cursor and before now; advances cursor
+    vector<const BorrowRecord*> findOverdueSince(OverdueCursor& cursor, system_clock::time_point now) const {
+        vector<const BorrowRecord*> res;
+        std::lock_guard<Mutex> l(mtx_);
+        auto it = activeByDue_.upper_bound(DueKey(cursor.dueAt, cursor.recordId));
+        for (; it != activeByDue_.end() && it->first < now; ++it) {
+            res.push_back(storage_.find(it->second));
+            cursor.dueAt = it->first;
+            cursor.recordId = it->second;
+        }
+        return res;
+    }
+
+    // nullptr if there is no such record
+    const BorrowRecord* findById(int id) const {
+        std::lock_guard<Mutex> l(mtx_);
+        return storage_.find(id);
+    }
+
+    const BorrowRecord* findActiveByItemId(int itemId) const {
+        std::lock_guard<Mutex> l(mtx_);
+        auto rec = activeByItem_.find(itemId);
+        return rec ? *rec : nullptr;
+    }
+
+    vector<const BorrowRecord*> findByUserId(int userId) const {
+        std::lock_guard<Mutex> l(mtx_);
+        return userRecords(userId, [](const BorrowRecord&) { return true; });
+    }
+
+    vector<const BorrowRecord*> findActiveByUserId(int userId) const {
+        std::lock_guard<Mutex> l(mtx_);
+        return userRecords(userId, [](const BorrowRecord& r) { return r.isOpen(); });
+    }
+
+    // visits every record in id order under the repo lock; f must not call back into the repo
+    template<typename F>
+    void forEach(F&& f) const {
+        std::lock_guard<Mutex> l(mtx_);
+        storage_.forEach(f);
+    }
+
+    vector<const BorrowRecord*> all() const {
+        vector<const BorrowRecord*> res;
+        std::lock_guard<Mutex> l(mtx_);
+        res.reserve(count_);
+        storage_.forEach([&](const BorrowRecord& r) { res.push_back(&r); });
+        return res;
+    }
+
+    size_t size() const {
+        std::lock_guard<Mutex> l(mtx_);
+        return count_;
+    }
+
+    // Changes are versioned for snapshot reads from here on (see Versions);
+    // nullptr stops that. Not while the repo is in use.
+    void attachVersions(Versions* versions) {
+        if (versions && versions != versions_)
+            versions->onPrune([this](uint64_t oldest) {
+                std::lock_guard<Mutex> l(mtx_);
+                history_.prune(oldest);
+            });
+        std::lock_guard<Mutex> l(mtx_);
+        versions_ = versions;
+    }
+
+    // one past the highest id handed out; read when a snapshot opens
+    int endId() const {
+        std::lock_guard<Mutex> l(mtx_);
+        return nextId_;
+    }
+
+    // Every record as of p, in id order. Copies one slab block at a time, so
+    // writers wait for at most one block; f runs with no lock held.
+    template<typename F>
+    void forEachAsOf(const ReadPoint& p, F&& f) const {
+        vector<BorrowRecord> block;
+        for (size_t b = 0;; ++b) {
+            {
+                std::lock_guard<Mutex> l(mtx_);
+                if (b >= storage_.blocks()) return;
+                block.clear();
+                storage_.forEachIn(b, [&](const BorrowRecord& r) {
+                    if (r.id() < p.recordsEnd) block.push_back(asOf(r, p.epoch));
+                });
+            }
+            for (auto& r : block) f(r);
+        }
+    }
+
+    optional<BorrowRecord> findAsOf(const ReadPoint& p, int id) const {
+        std::lock_guard<Mutex> l(mtx_);
+        const BorrowRecord* r = id < p.recordsEnd ? storage_.find(id) : nullptr;
+        if (!r) return nullopt;
+        return asOf(*r, p.epoch);
+    }
+
+    vector<BorrowRecord> findByUserIdAsOf(const ReadPoint& p, int userId) const {
+        vector<BorrowRecord> res;
+        std::lock_guard<Mutex> l(mtx_);
+        if (auto ids = byUser_.find(userId))
+            for (int id : *ids)
+                if (id < p.recordsEnd) res.push_back(asOf(*storage_.find(id), p.epoch));
+        return res;
+    }
+
+    // Records open at p with dueAt < now, earliest due first. The due-time
+    // index covers the records unchanged since p; the rest have history.
+    vector<BorrowRecord> findOverdueAsOf(const ReadPoint& p, system_clock::time_point now) const {
+        vector<BorrowRecord> res;
+        std::lock_guard<Mutex> l(mtx_);
+        for (auto it = activeByDue_.begin(); it != activeByDue_.end() && it->first < now; ++it)
+            if (it->second < p.recordsEnd && !history_.asOf(it->second, p.epoch))
+                res.push_back(*storage_.find(it->second));
+        size_t indexed = res.size();
+        history_.forEachKey([&](int id) {
+            const BorrowRecord* r = id < p.recordsEnd ? storage_.find(id) : nullptr;
+            if (!r || !history_.asOf(id, p.epoch)) return;
+            BorrowRecord then = asOf(*r, p.epoch);
+            if (then.isOpen() && then.dueAt() < now) res.push_back(then);
+        });
+        if (res.size() > indexed)
+            std::sort(res.begin(), res.end(), [](const BorrowRecord& a, const BorrowRecord& b) {
+                return DueKey(a.dueAt(), a.id()) < DueKey(b.dueAt(), b.id());
+            });
+        return res;
+    }
+};
+
+// Fines plus a per-user ledger. Each user's account keeps running totals of
+// what was charged, paid and waived, so the outstanding balance is a hash
+// lookup, and a set ordered by balance answers top-N debtor queries without
+// walking the fines. Fines themselves live by value in a Slab.
+class FineRepo {
+public:
+    struct Account {
+        Money charged, paid, waived;
+        Money outstanding() const { return charged - paid - waived; }
+    };
+private:
+    Slab<Fine> storage_;
+    size_t count_ = 0;
+    IdTable<vector<int>> byUser_;                // fine ids, oldest first
+    IdTable<Account> accounts_;
+    std::set<std::pair<int64_t, int>, std::greater<>> byBalance_; // (outstanding paise, user) for users who owe
+    using Mutex = metrics::InstrumentedMutex<std::mutex>;
+    mutable Mutex mtx_{metrics::Lock::Fines};
+    int nextId_ = 1;
+    Versions* versions_ = nullptr;
+    History<int, Account> history_;              // accounts, under mtx_; fines never change once added
+
+    // applies `change` to a user's account and keeps byBalance_ in step; caller
+    // is a Writer and holds mtx_
+    template<typename F>
+    Account& adjust(int userId, F change) {
+        Account& acc = accounts_[userId];
+        if (versions_ && versions_->retaining()) history_.save(userId, versions_->epoch(), acc);
+        int64_t before = acc.outstanding().paise();
+        change(acc);
+        int64_t after = acc.outstanding().paise();
+        if (before != after) {
+            if (before > 0) byBalance_.erase({before, userId});
+            if (after > 0) byBalance_.insert({after, userId});
+        }
+        return acc;
+    }
+    const Fine* insert(const Fine& f) {
+        Fine& slot = storage_.slot(f.id());
+        if (f.id() >= nextId_) nextId_ = f.id() + 1;
+        if (slot.id()) {
+            auto& list = byUser_[slot.userId()];
+            list.erase(std::remove(list.begin(), list.end(), slot.id()), list.end());
+            Money old = slot.amount();
+            adjust(slot.userId(), [&](Account& a) { a.charged = a.charged - old; });
+        } else {
+            ++count_;
+        }
+        slot = f;
+        adjust(f.userId(), [&](Account& a) { a.charged = a.charged + f.amount(); });
+        byUser_[f.userId()].push_back(f.id());
+        return &slot;
+    }
+public:
+    // the returned pointer stays valid for the repo's lifetime
+    const Fine* addFine(int itemId, int userId, Money amount, FineReason reason, int32_t reasonParam,
+                        system_clock::time_point appliedAt) {
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        return insert(Fine(nextId_, itemId, userId, amount, reason, reasonParam, appliedAt));
+    }
+    // adds fines under one lock; ids are assigned here and any id in the input is ignored
+    vector<const Fine*> addFines(const vector<Fine>& batch) {
+        vector<const Fine*> res;
+        res.reserve(batch.size());
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        for (auto& f : batch)
+            res.push_back(insert(Fine(nextId_, f.itemId(), f.userId(), f.amount(), f.reasonCode(), f.reasonParam(),
+                                      f.appliedAt())));
+        return res;
+    }
+    // re-inserts a fine with its original id (recovery)
+    void restore(const Fine& f) {
+        if (f.id() < 1) throw PersistenceException("Invalid fine id");
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        insert(f);
+    }
+    // Records a payment (or, with waive, a write-off) against the user's
+    // outstanding balance and returns the account afterwards.
+    Account settle(int userId, Money amount, bool waive) {
+        if (!(amount > Money(0))) throw InvalidInputException("Amount must be positive");
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        auto acc = accounts_.find(userId);
+        Money owed = acc ? acc->outstanding() : Money(0);
+        if (amount > owed) throw InvalidInputException("Amount exceeds outstanding balance of " + owed.str());
+        return adjust(userId, [&](Account& a) {
+            if (waive) a.waived = a.waived + amount;
+            else a.paid = a.paid + amount;
+        });
+    }
+    // sets the paid/waived totals recorded in the journal (recovery)
+    void restoreSettled(int userId, Money paid, Money waived) {
+        Versions::Writer w(versions_);
+        std::lock_guard<Mutex> l(mtx_);
+        adjust(userId, [&](Account& a) { a.paid = paid; a.waived = waived; });
+    }
+    Account account(int userId) const {
+        std::lock_guard<Mutex> l(mtx_);
+        auto acc = accounts_.find(userId);
+        return acc ? *acc : Account();
+    }
+    Money balance(int userId) const { return account(userId).outstanding(); }
+    vector<std::pair<int, Money>> topDebtors(size_t n) const {
+        vector<std::pair<int, Money>> res;
+        std::lock_guard<Mutex> l(mtx_);
+        for (auto it = byBalance_.begin(); it != byBalance_.end() && res.size() < n; ++it)
+            res.emplace_back(it->second, Money(it->first));
+        return res;
+    }
+    // users whose paid or waived totals are non-zero, for snapshots
+    vector<std::pair<int, Account>> settledAccounts() const {
+        vector<std::pair<int, Account>> res;
+        std::lock_guard<Mutex> l(mtx_);
+        accounts_.forEach([&](int userId, const Account& acc) {
+            if (acc.paid.paise() != 0 || acc.waived.paise() != 0) res.emplace_back(userId, acc);
+        });
+        return res;
+    }
+    vector<const Fine*> all() const {
+        vector<const Fine*> res;
+        std::lock_guard<Mutex> l(mtx_);
+        res.reserve(count_);
+        storage_.forEach([&](const Fine& f) { res.push_back(&f); });
+        return res;
+    }
+    vector<const Fine*> findByUserId(int userId) const {
+        vector<const Fine*> res;
+        std::lock_guard<Mutex> l(mtx_);
+        auto ids = byUser_.find(userId);
+        if (!ids) return res;
+        res.reserve(ids->size());
+        for (int id : *ids) res.push_back(storage_.find(id));
+        return res;
+    }
+
+    // see BorrowRecordRepo::attachVersions
+    void attachVersions(Versions* versions) {
+        if (versions && versions != versions_)
+            versions->onPrune([this](uint64_t oldest) {
+                std::lock_guard<Mutex> l(mtx_);
+                history_.prune(oldest);
+            });
+        std::lock_guard<Mutex> l(mtx_);
+        versions_ = versions;
+    }
+    int endId() const {
+        std::lock_guard<Mutex> l(mtx_);
+        return nextId_;
+    }
+    // every fine added before p, in id order, one slab block per lock
+    template<typename F>
+    void forEachAsOf(const ReadPoint& p, F&& f) const {
+        vector<Fine> block;
+        for (size_t b = 0;; ++b) {
+            {
+                std::lock_guard<Mutex> l(mtx_);
+                if (b >= storage_.blocks()) return;
+                block.clear();
+                storage_.forEachIn(b, [&](const Fine& fine) { if (fine.id() < p.finesEnd) block.push_back(fine); });
+            }
+            for (auto& fine : block) f(fine);
+        }
+    }
+    vector<Fine> findByUserIdAsOf(const ReadPoint& p, int userId) const {
+        vector<Fine> res;
+        std::lock_guard<Mutex> l(mtx_);
+        if (auto ids = byUser_.find(userId))
+            for (int id : *ids)
+                if (id < p.finesEnd) res.push_back(*storage_.find(id));
+        return res;
+    }
+    Account accountAsOf(const ReadPoint& p, int userId) const {
+        std::lock_guard<Mutex> l(mtx_);
+        if (auto then = history_.asOf(userId, p.epoch)) return *then;
+        auto acc = accounts_.find(userId);
+        return acc ? *acc : Account();
+    }
+    // settledAccounts() as of p
+    vector<std::pair<int, Account>> settledAccountsAsOf(const ReadPoint& p) const {
+        vector<std::pair<int, Account>> res;
+        auto settled = [](const Account& acc) { return acc.paid.paise() != 0 || acc.waived.paise() != 0; };
+        std::lock_guard<Mutex> l(mtx_);
+        accounts_.forEach([&](int userId, const Account& acc) {
+            auto then = history_.asOf(userId, p.epoch);
+            if (settled(then ? *then : acc)) res.emplace_back(userId, then ? *then : acc);
+        });
+        return res;
+    }
+};
+
+
+// A consistent, read-only view of items, borrow records and fines as of the
+// moment it was opened (see Versions). Opening waits only for the writes in
+// flight; reads lock a slab block or a stripe at a time, so writers never
+// wait for a whole report. Everything is returned by value.
+class ReadView {
+    Versions* versions_;
+    const ItemRepo& items_;
+    const BorrowRecordRepo& records_;
+    const FineRepo& fines_;
+    ReadPoint at_;
+public:
+    ReadView(Versions& versions, const ItemRepo& items, const BorrowRecordRepo& records, const FineRepo& fines)
+      : versions_(&versions), items_(items), records_(records), fines_(fines) {
+        at_.epoch = versions.open([&] {
+            at_.recordsEnd = records.endId();
+            at_.finesEnd = fines.endId();
+        });
+    }
+    ~ReadView() { if (versions_) versions_->close(at_.epoch); }
+    ReadView(ReadView&& o) noexcept
+      : versions_(o.versions_), items_(o.items_), records_(o.records_), fines_(o.fines_), at_(o.at_) {
+        o.versions_ = nullptr;
+    }
+    ReadView(const ReadView&) = delete;
+    ReadView& operator=(const ReadView&) = delete;
+
+    uint64_t epoch() const { return at_.epoch; }
+
+    vector<ItemVersion> items() const { return items_.allAsOf(at_); }
+    // the items held as objects (see ItemRepo::residentItems)
+    vector<ItemVersion> residentItems() const { return items_.allAsOf(at_, false); }
+    optional<ItemVersion> item(int id) const { return items_.findAsOf(at_, id); }
+
+    // f(const BorrowRecord&) for every record, in id order
+    template<typename F>
+    void forEachRecord(F&& f) const { records_.forEachAsOf(at_, f); }
+    vector<BorrowRecord> records() const {
+        vector<BorrowRecord> res;
+        records_.forEachAsOf(at_, [&](const BorrowRecord& r) { res.push_back(r); });
+        return res;
+    }
+    optional<BorrowRecord> record(int id) const { return records_.findAsOf(at_, id); }
+    vector<BorrowRecord> borrowsOf(int userId) const { return records_.findByUserIdAsOf(at_, userId); }
+    // records open at the snapshot and past due at now, earliest due first
+    vector<BorrowRecord> overdue(system_clock::time_point now) const { return records_.findOverdueAsOf(at_, now); }
+
+    template<typename F>
+    void forEachFine(F&& f) const { fines_.forEachAsOf(at_, f); }
+    vector<Fine> finesOf(int userId) const { return fines_.findByUserIdAsOf(at_, userId); }
+    FineRepo::Account account(int userId) const { return fines_.accountAsOf(at_, userId); }
+    vector<std::pair<int, FineRepo::Account>> settledAccounts() const { return fines_.settledAccountsAsOf(at_); }
+};
+
+// Helper: format time_point to human-readable string
+static string formatTime(const system_clock::time_point &tp) {
+    std::time_t t = system_clock::to_time_t(tp);
+    std::tm tm{};
+#ifdef _WIN32
+    localtime_s(&tm, &t);
+#else
+    localtime_r(&t, &tm);
+#endif
+    std::ostringstream ss;
+    ss << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
+    return ss.str();
+}
+
+
+/* ---------- Persistence: write-ahead log + snapshots ---------- */
+
+// Mutations as they appear in the WAL and in snapshots. Payloads carry the
+// resulting state (not the request), so replaying an entry twice is harmless.
+// FineText is the older fine encoding with a free-text reason; it is still
+// read but no longer written.
+enum class WalOp : uint8_t { SaveItem = 1, SaveUser, Borrow, Return, Renew, Reserve, Cancel, FineText, Archive, Settle,
+                             Fine, Overdue, Hold, Unhold, HoldReady, ClockOffset };
+
+class ByteWriter {
+    string buf_;
+public:
+    ByteWriter& u8(uint8_t v) { buf_.push_back(static_cast<char>(v)); return *this; }
+    ByteWriter& u32(uint32_t v) {
+        for (int i = 0; i < 4; ++i) buf_.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+        return *this;
+    }
+    ByteWriter& i64(int64_t v) {
+        uint64_t u = static_cast<uint64_t>(v);
+        for (int i = 0; i < 8; ++i) buf_.push_back(static_cast<char>((u >> (8 * i)) & 0xff));
+        return *this;
+    }
+    ByteWriter& i32(int32_t v) { return u32(static_cast<uint32_t>(v)); }
+    ByteWriter& str(std::string_view v) { u32(static_cast<uint32_t>(v.size())); buf_.append(v.data(), v.size()); return *this; }
+    ByteWriter& time(system_clock::time_point tp) {
+        return i64(duration_cast<std::chrono::microseconds>(tp.time_since_epoch()).count());
+    }
+    const string& bytes() const { return buf_; }
+    void clear() { buf_.clear(); }
+};
+
+class ByteReader {
+    std::string_view in_;
+    size_t pos_ = 0;
+    void need(size_t n) const { if (in_.size() - pos_ < n) throw PersistenceException("Truncated journal payload"); }
+public:
+    explicit ByteReader(std::string_view in) : in_(in) {}
+    uint8_t u8() { need(1); return static_cast<uint8_t>(in_[pos_++]); }
+    uint32_t u32() {
+        need(4); uint32_t v = 0;
+        for (int i = 0; i < 4; ++i) v |= static_cast<uint32_t>(static_cast<uint8_t>(in_[pos_++])) << (8 * i);
+        return v;
+    }
+    int64_t i64() {
+        need(8); uint64_t v = 0;
+        for (int i = 0; i < 8; ++i) v |= static_cast<uint64_t>(static_cast<uint8_t>(in_[pos_++])) << (8 * i);
+        return static_cast<int64_t>(v);
+    }
+    int32_t i32() { return static_cast<int32_t>(u32()); }
+    // entries gain trailing fields over time; older ones simply end early
+    bool atEnd() const { return pos_ == in_.size(); }
+    string str() { uint32_t n = u32(); need(n); string s(in_.substr(pos_, n)); pos_ += n; return s; }
+    system_clock::time_point time() {
+        return system_clock::time_point(duration_cast<system_clock::duration>(std::chrono::microseconds(i64())));
+    }
+};
+
+// Append-only journal in a data directory:
+//   wal-<gen>.log   framed entries [u32 len][u8 op][payload][u32 fnv1a(op+payload)]
+//   snapshot.bin    same framing; header names the first WAL generation not folded in
+// A background flusher writes and fsyncs whatever accumulated since its last
+// pass (group commit). In GroupCommit mode append() returns once its entry is
+// durable; in Async mode durability lags by at most flushInterval.
+class Journal {
+public:
+    enum class Durability { GroupCommit, Async };
+private:
+    static constexpr char kWalMagic[8] = {'L','N','W','A','L','0','0','1'};
+    static constexpr char kSnapMagic[8] = {'L','N','S','N','P','0','0','1'};
+    static constexpr uint32_t kMaxFrame = 1u << 24;   // no entry comes near this; a longer frame is corrupt
+
+    std::filesystem::path dir_;
+    Durability durability_;
+    std::chrono::milliseconds flushInterval_;
+    FILE* file_ = nullptr;
+    uint64_t gen_ = 0;
+
+    std::mutex mtx_;                 // pending_, LSNs, stop_
+    std::mutex ioMtx_;               // file_ / gen_ while writing or rotating
+    std::condition_variable cv_, durableCv_;
+    string pending_;
+    uint64_t appendedLsn_ = 0, durableLsn_ = 0;
+    bool stop_ = false;
+    string failure_;                 // first write/sync error; every later append or wait throws it
+    std::thread flusher_;
+
+    static inline thread_local int deferDepth_ = 0;
+    static inline thread_local uint64_t deferredLsn_ = 0;
+
+    static uint32_t checksum(std::string_view data) {
+        uint32_t h = 2166136261u;
+        for (char c : data) { h ^= static_cast<uint8_t>(c); h *= 16777619u; }
+        return h;
+    }
+
+    static void frame(string& out, WalOp op, const string& payload) {
+        ByteWriter w;
+        w.u32(static_cast<uint32_t>(payload.size())).u8(static_cast<uint8_t>(op));
+        out += w.bytes();
+        out += payload;
+        ByteWriter c;
+        c.u32(checksum(std::string_view(out).substr(out.size() - payload.size() - 1)));
+        out += c.bytes();
+    }
+
+    static void writeAll(FILE* f, const char* data, size_t n) {
+        if (n && std::fwrite(data, 1, n, f) != n) throw PersistenceException("Journal write failed");
+    }
+
+    static void syncFile(FILE* f) {
+        if (std::fflush(f) != 0) throw PersistenceException("Journal write failed");
+#ifdef _WIN32
+        if (_commit(_fileno(f)) != 0) throw PersistenceException("Journal sync failed");
+#else
+        if (fsync(fileno(f)) != 0) throw PersistenceException("Journal sync failed");
+#endif
+    }
+
+    // caller holds mtx_; wakes every waiter so it can throw
+    void failLocked(const string& what) {
+        if (failure_.empty()) failure_ = what;
+        durableCv_.notify_all();
+    }
+    void throwIfFailedLocked() const {
+        if (!failure_.empty()) throw PersistenceException(failure_);
+    }
+
+    std::filesystem::path walPath(uint64_t gen) const { return dir_ / ("wal-" + to_string(gen) + ".log"); }
+
+    vector<uint64_t> walGenerations() const {
+        vector<uint64_t> gens;
+        for (auto& e : std::filesystem::directory_iterator(dir_)) {
+            string name = e.path().filename().string();
+            if (name.size() > 8 && name.compare(0, 4, "wal-") == 0 && name.compare(name.size() - 4, 4, ".log") == 0)
+                gens.push_back(std::stoull(name.substr(4, name.size() - 8)));
+        }
+        std::sort(gens.begin(), gens.end());
+        return gens;
+    }
+
+    FILE* openWal(uint64_t gen) {
+        FILE* f = std::fopen(walPath(gen).string().c_str(), "wb");
+        if (!f) throw PersistenceException("Cannot create " + walPath(gen).string());
+        try {
+            writeAll(f, kWalMagic, sizeof(kWalMagic));
+            syncFile(f);
+        } catch (...) {
+            std::fclose(f);
+            throw;
+        }
+        return f;
+    }
+
+    // Reads framed entries until EOF or the first torn/corrupt frame. torn
+    // tells which it was; goodEnd is the offset just past the last good frame.
+    template<typename Fn>
+    static size_t readFrames(FILE* f, Fn&& fn, bool& torn, long& goodEnd) {
+        size_t n = 0;
+        string payload;
+        unsigned char hdr[5];
+        torn = false;
+        goodEnd = std::ftell(f);
+        while (true) {
+            size_t got = std::fread(hdr, 1, 5, f);
+            if (got != 5) { torn = got != 0; break; }
+            uint32_t len = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | (static_cast<uint32_t>(hdr[3]) << 24);
+            if (len > kMaxFrame) { torn = true; break; }
+            payload.resize(len + 1);
+            payload[0] = static_cast<char>(hdr[4]);
+            unsigned char crc[4];
+            if (std::fread(&payload[1], 1, len, f) != len || std::fread(crc, 1, 4, f) != 4) { torn = true; break; }
+            uint32_t stored = crc[0] | (crc[1] << 8) | (crc[2] << 16) | (static_cast<uint32_t>(crc[3]) << 24);
+            if (stored != checksum(payload)) { torn = true; break; }
+            fn(static_cast<WalOp>(hdr[4]), std::string_view(payload).substr(1));
+            goodEnd = std::ftell(f);
+            ++n;
+        }
+        return n;
+    }
+
+    static bool readMagic(FILE* f, const char (&magic)[8]) {
+        char m[8];
+        return std::fread(m, 1, 8, f) == 8 && std::equal(m, m + 8, magic);
+    }
+
+    void flushLoop() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> l(mtx_);
+                if (durability_ == Durability::Async) cv_.wait_for(l, flushInterval_, [&]{ return stop_; });
+                else cv_.wait(l, [&]{ return stop_ || !pending_.empty(); });
+                if (stop_ && pending_.empty()) return;
+            }
+            std::lock_guard<std::mutex> io(ioMtx_);
+            string batch;
+            uint64_t target;
+            {
+                std::lock_guard<std::mutex> l(mtx_);
+                if (!failure_.empty()) return;
+                batch.swap(pending_);
+                target = appendedLsn_;
+            }
+            try {
+                if (!batch.empty()) {
+                    writeAll(file_, batch.data(), batch.size());
+                    syncFile(file_);
+                }
+            } catch (const std::exception& e) {
+                // nothing after this point is durable: fail the waiters instead of acknowledging them
+                std::lock_guard<std::mutex> l(mtx_);
+                failLocked(e.what());
+                return;
+            }
+            std::lock_guard<std::mutex> l(mtx_);
+            durableLsn_ = std::max(durableLsn_, target);
+            durableCv_.notify_all();
+        }
+    }
+
+public:
+    explicit Journal(std::filesystem::path dir, Durability durability = Durability::GroupCommit,
+                     std::chrono::milliseconds flushInterval = std::chrono::milliseconds(5))
+      : dir_(move(dir)), durability_(durability), flushInterval_(flushInterval) {
+        std::filesystem::create_directories(dir_);
+    }
+
+    ~Journal() { close(); }
+
+    // Lets one thread issue many appends and pay for a single group commit:
+    // inside the scope append() returns once the entry is queued, and the
+    // outermost scope's end waits until everything appended in it is durable.
+    // A journal failure is thrown from the destructor, unless the scope is
+    // already being left by an exception.
+    class Deferred {
+        Journal* j_;
+        int unwinding_ = std::uncaught_exceptions();
+    public:
+        explicit Deferred(Journal* j) : j_(j) { if (++deferDepth_ == 1) deferredLsn_ = 0; }
+        ~Deferred() noexcept(false) {
+            if (--deferDepth_ != 0 || !j_ || !deferredLsn_) return;
+            if (std::uncaught_exceptions() == unwinding_) j_->waitDurable(deferredLsn_);
+            else try { j_->waitDurable(deferredLsn_); } catch (const PersistenceException&) {}
+        }
+        Deferred(const Deferred&) = delete;
+        Deferred& operator=(const Deferred&) = delete;
+    };
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Replays snapshot.bin and then every WAL generation it does not cover, in order.
+    // Returns the number of entries applied. Must be called before open().
+    // Only the newest generation may end in a torn frame (a crash mid-write);
+    // it is cut back to its last good frame. A bad frame anywhere else means
+    // entries after it would replay without their predecessors, so recovery
+    // refuses to go on.
+    size_t recover(const std::function<void(WalOp, ByteReader&)>& apply) {
+        size_t n = 0;
+        uint64_t firstGen = 0;
+        bool torn = false;
+        long goodEnd = 0;
+        auto dispatch = [&](WalOp op, std::string_view payload) { ByteReader r(payload); apply(op, r); };
+        if (FILE* f = std::fopen((dir_ / "snapshot.bin").string().c_str(), "rb")) {
+            unsigned char g[8];
+            if (!readMagic(f, kSnapMagic) || std::fread(g, 1, 8, f) != 8) {
+                std::fclose(f);
+                throw PersistenceException("Corrupt snapshot header");
+            }
+            for (int i = 7; i >= 0; --i) firstGen = (firstGen << 8) | g[i];
+            n += readFrames(f, dispatch, torn, goodEnd);
+            std::fclose(f);
+            if (torn) throw PersistenceException("Corrupt frame in snapshot.bin");
+        }
+        auto gens = walGenerations();
+        for (size_t i = 0; i < gens.size(); ++i) {
+            uint64_t gen = gens[i];
+            gen_ = std::max(gen_, gen);
+            if (gen < firstGen) continue;
+            bool last = i + 1 == gens.size();
+            FILE* f = std::fopen(walPath(gen).string().c_str(), "rb");
+            if (!f) throw PersistenceException("Cannot open " + walPath(gen).string());
+            if (!readMagic(f, kWalMagic)) {
+                std::fclose(f);
+                if (!last) throw PersistenceException("Corrupt header in " + walPath(gen).string());
+                std::filesystem::remove(walPath(gen));   // created, never written
+                continue;
+            }
+            n += readFrames(f, dispatch, torn, goodEnd);
+            std::fclose(f);
+            if (!torn) continue;
+            if (!last)
+                throw PersistenceException("Corrupt frame in " + walPath(gen).string() + ", which later generations follow");
+            std::filesystem::resize_file(walPath(gen), static_cast<uintmax_t>(goodEnd));
+        }
+        return n;
+    }
+
+    // starts a fresh WAL generation after whatever recover() saw
+    void open() {
+        std::lock_guard<std::mutex> io(ioMtx_);
+        if (file_) return;
+        file_ = openWal(++gen_);
+        flusher_ = std::thread(&Journal::flushLoop, this);
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> l(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        if (flusher_.joinable()) flusher_.join();
+        std::lock_guard<std::mutex> io(ioMtx_);
+        if (file_) { std::fclose(file_); file_ = nullptr; }
+    }
+
+    uint64_t append(WalOp op, const string& payload) {
+        return append(vector<std::pair<WalOp, string>>{{op, payload}});
+    }
+
+    // Appends several entries under one lock and (in GroupCommit mode) one
+    // wait. Throws PersistenceException once the journal has failed to write.
+    uint64_t append(const vector<std::pair<WalOp, string>>& entries) {
+        std::unique_lock<std::mutex> l(mtx_);
+        throwIfFailedLocked();
+        for (auto& e : entries) frame(pending_, e.first, e.second);
+        appendedLsn_ += entries.size();
+        uint64_t lsn = appendedLsn_;
+        if (deferDepth_) { deferredLsn_ = lsn; return lsn; }
+        if (durability_ == Durability::GroupCommit) {
+            cv_.notify_one();
+            durableCv_.wait(l, [&]{ return durableLsn_ >= lsn || stop_ || !failure_.empty(); });
+            if (durableLsn_ < lsn) throwIfFailedLocked();
+        }
+        return lsn;
+    }
+
+    // blocks until entries up to lsn are on disk (GroupCommit mode only);
+    // throws if the journal failed before they got there
+    void waitDurable(uint64_t lsn) {
+        if (durability_ != Durability::GroupCommit) return;
+        std::unique_lock<std::mutex> l(mtx_);
+        cv_.notify_one();
+        durableCv_.wait(l, [&]{ return durableLsn_ >= lsn || stop_ || !failure_.empty(); });
+        if (durableLsn_ < lsn) throwIfFailedLocked();
+    }
+
+    uint64_t appendedLsn() {
+        std::lock_guard<std::mutex> l(mtx_);
+        return appendedLsn_;
+    }
+
+    // Switches appends to a new WAL generation and returns it. Entries logged
+    // before the switch are durable in the old generation when this returns.
+    uint64_t rotate() {
+        std::lock_guard<std::mutex> io(ioMtx_);
+        std::lock_guard<std::mutex> l(mtx_);
+        if (!file_) throw PersistenceException("Journal not open");
+        throwIfFailedLocked();
+        try {
+            writeAll(file_, pending_.data(), pending_.size());
+            pending_.clear();
+            syncFile(file_);
+            std::fclose(file_);
+            file_ = nullptr;
+            file_ = openWal(++gen_);
+        } catch (const std::exception& e) {
+            failLocked(e.what());
+            throw;
+        }
+        durableLsn_ = appendedLsn_;
+        durableCv_.notify_all();
+        return gen_;
+    }
+
+    // Writes a snapshot whose entries come from emit(sink), then drops the WAL
+    // generations older than firstGen. The snapshot replaces the old one atomically.
+    void writeSnapshot(uint64_t firstGen, const std::function<void(const std::function<void(WalOp, const string&)>&)>& emit) {
+        auto tmp = dir_ / "snapshot.tmp";
+        FILE* f = std::fopen(tmp.string().c_str(), "wb");
+        if (!f) throw PersistenceException("Cannot create " + tmp.string());
+        ByteWriter hdr;
+        hdr.i64(static_cast<int64_t>(firstGen));
+        try {
+            writeAll(f, kSnapMagic, sizeof(kSnapMagic));
+            writeAll(f, hdr.bytes().data(), hdr.bytes().size());
+            string buf;
+            emit([&](WalOp op, const string& payload) {
+                frame(buf, op, payload);
+                if (buf.size() >= (1u << 20)) { writeAll(f, buf.data(), buf.size()); buf.clear(); }
+            });
+            writeAll(f, buf.data(), buf.size());
+            syncFile(f);
+        } catch (...) {
+            // the old snapshot and the WAL it relies on stay as they were
+            std::fclose(f);
+            std::filesystem::remove(tmp);
+            throw;
+        }
+        std::fclose(f);
+        std::filesystem::rename(tmp, dir_ / "snapshot.bin");
+        for (uint64_t gen : walGenerations()) if (gen < firstGen) std::filesystem::remove(walPath(gen));
+    }
+};
+
+
+/* ---------- Event log ---------- */
+
+enum class EventKind : uint8_t { Borrowed, Returned, FineApplied, Renewed, Reserved, ReservationCancelled, Archived,
+                                 FinePaid, FineWaived, HoldQueued, HoldReady, HoldExpired };
+
+// One thing the service did. Plain data, so recording it is a copy into the
+// ring; all formatting happens on the log's writer thread.
+struct Event {
+    EventKind kind = EventKind::Borrowed;
+    int userId = 0, itemId = 0;
+    int64_t paise = 0;                   // fine, payment or waiver amount
+    system_clock::time_point at;         // when it happened
+    system_clock::time_point due;        // Borrowed / Renewed: the due time; Reserved / HoldReady /
+                                         // HoldExpired: the pickup deadline
+};
+
+// Structured log of service events. Any thread may record(); events go into
+// a bounded multi-producer ring (a sequence number per slot, producers claim
+// slots with one CAS) and a background thread drains it in batches, formats
+// them and writes each batch with a single stream write. record() never
+// blocks: if the ring is full the event is dropped and counted, and the
+// writer reports the count in the log.
+class EventLog {
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        Event ev;
+    };
+    vector<Slot> ring_;
+    uint64_t mask_;
+    alignas(64) std::atomic<uint64_t> head_{0};     // next slot a producer claims
+    alignas(64) uint64_t tail_ = 0;                 // next slot the writer reads (writer thread only)
+    std::atomic<uint64_t> written_{0};              // events written so far
+    std::atomic<uint64_t> dropped_{0};
+    uint64_t droppedReported_ = 0;
+
+    std::unique_ptr<std::ofstream> file_;
+    std::ostream* out_;
+
+    std::mutex mtx_;
+    std::condition_variable wake_, drained_;
+    std::atomic<bool> sleeping_{false};
+    bool stop_ = false;
+    std::thread writer_;
+
+    // formatted "YYYY-MM-DD HH:MM:" of the last minute seen; localtime_r runs
+    // once per distinct minute instead of once per timestamp
+    int64_t cachedMinute_ = std::numeric_limits<int64_t>::min();
+    char minuteText_[24] = {};
+
+    static constexpr size_t kBatch = 1024;
+    static constexpr auto kFlushEvery = std::chrono::milliseconds(5);
+
+    void appendTime(string& line, system_clock::time_point tp) {
+        int64_t secs = duration_cast<std::chrono::seconds>(tp.time_since_epoch()).count();
+        int64_t minute = secs >= 0 ? secs / 60 : (secs - 59) / 60;
+        if (minute != cachedMinute_) {
+            std::time_t t = static_cast<std::time_t>(minute * 60);
+            std::tm tm{};
+#ifdef _WIN32
+            localtime_s(&tm, &t);
+#else
+            localtime_r(&t, &tm);
+#endif
+            std::strftime(minuteText_, sizeof(minuteText_), "%Y-%m-%d %H:%M:", &tm);
+            cachedMinute_ = minute;
+        }
+        int sec = static_cast<int>(secs - minute * 60);
+        line += minuteText_;
+        line += static_cast<char>('0' + sec / 10);
+        line += static_cast<char>('0' + sec % 10);
+    }
+
+    void format(string& line, const Event& e) {
+        static const char* names[] = {"borrowed", "returned", "fine-applied", "renewed", "reserved",
+                                      "reservation-cancelled", "archived", "fine-paid", "fine-waived",
+                                      "hold-queued", "hold-ready", "hold-expired"};
+        appendTime(line, e.at);
+        line += ' ';
+        line += names[static_cast<size_t>(e.kind)];
+        if (e.kind != EventKind::Archived) { line += " user="; line += to_string(e.userId); }
+        if (e.itemId) { line += " item="; line += to_string(e.itemId); }
+        if (e.kind == EventKind::Borrowed || e.kind == EventKind::Renewed) { line += " due="; appendTime(line, e.due); }
+        if (e.kind == EventKind::Reserved || e.kind == EventKind::HoldReady || e.kind == EventKind::HoldExpired) {
+            line += " until=";
+            appendTime(line, e.due);
+        }
+        if (e.kind == EventKind::FineApplied || e.kind == EventKind::FinePaid || e.kind == EventKind::FineWaived) {
+            line += " amount=";
+            line += Money(e.paise).str();
+        }
+        line += '\n';
+    }
+
+    // pops up to kBatch events into buf; writer thread only
+    size_t drain(string& buf) {
+        size_t n = 0;
+        for (; n < kBatch; ++n) {
+            Slot& slot = ring_[tail_ & mask_];
+            if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) break;
+            format(buf, slot.ev);
+            slot.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+            ++tail_;
+        }
+        uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != droppedReported_) {
+            buf += "events dropped: " + to_string(dropped - droppedReported_) + "\n";
+            droppedReported_ = dropped;
+        }
+        return n;
+    }
+
+    void run() {
+        string buf;
+        for (;;) {
+            size_t n;
+            do {
+                buf.clear();
+                n = drain(buf);
+                if (!buf.empty()) { out_->write(buf.data(), static_cast<std::streamsize>(buf.size())); out_->flush(); }
+                written_.fetch_add(n, std::memory_order_release);
+            } while (n == kBatch);
+            std::unique_lock<std::mutex> l(mtx_);
+            drained_.notify_all();
+            if (stop_ && tail_ == head_.load(std::memory_order_acquire)) return;
+            sleeping_.store(true, std::memory_order_relaxed);
+            wake_.wait_for(l, kFlushEvery);
+            sleeping_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void start(size_t capacity) {
+        size_t cap = 1;
+        while (cap < std::max<size_t>(capacity, 2)) cap <<= 1;
+        ring_ = vector<Slot>(cap);
+        mask_ = cap - 1;
+        for (size_t i = 0; i < cap; ++i) ring_[i].seq.store(i, std::memory_order_relaxed);
+        writer_ = std::thread([this] { run(); });
+    }
+
+public:
+    explicit EventLog(std::ostream& out, size_t capacity = 1 << 16) : out_(&out) { start(capacity); }
+
+    explicit EventLog(const string& path, size_t capacity = 1 << 16)
+      : file_(std::make_unique<std::ofstream>(path, std::ios::app)), out_(file_.get()) {
+        if (!*file_) throw PersistenceException("Cannot open event log " + path);
+        start(capacity);
+    }
+
+    EventLog(const EventLog&) = delete;
+    EventLog& operator=(const EventLog&) = delete;
+
+    ~EventLog() {
+        {
+            std::lock_guard<std::mutex> l(mtx_);
+            stop_ = true;
+        }
+        wake_.notify_one();
+        writer_.join();
+    }
+
+    void record(const Event& e) {
+        uint64_t pos = head_.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &ring_[pos & mask_];
+            int64_t diff = static_cast<int64_t>(slot->seq.load(std::memory_order_acquire) - pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        slot->ev = e;
+        slot->seq.store(pos + 1, std::memory_order_release);
+        if (sleeping_.load(std::memory_order_relaxed)) wake_.notify_one();
+    }
+
+    // waits until everything recorded before the call has been written
+    void flush() {
+        uint64_t target = head_.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> l(mtx_);
+        while (written_.load(std::memory_order_acquire) < target) {
+            wake_.notify_one();
+            drained_.wait_for(l, kFlushEvery);
+        }
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+};
+
+
+// Runs fn(task, worker) for tasks 0..n-1 on up to `threads` threads (the
+// caller is worker 0). Each worker starts on its own contiguous share of the
+// tasks; when it runs dry it steals from the back of another worker's share,
+// so uneven tasks do not leave threads idle. The first exception thrown by
+// fn is rethrown here once all workers have stopped.
+template<typename Fn>
+void forEachStealing(size_t n, unsigned threads, Fn&& fn) {
+    if (n == 0) return;
+    threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, n)));
+    struct alignas(64) Share {
+        std::mutex mtx;
+        size_t begin = 0, end = 0;
+    };
+    vector<Share> shares(threads);
+    for (unsigned t = 0; t < threads; ++t) {
+        shares[t].begin = n * t / threads;
+        shares[t].end = n * (t + 1) / threads;
+    }
+    std::exception_ptr error;
+    std::mutex errorMtx;
+    std::atomic<bool> failed{false};
+    auto next = [&](unsigned me, size_t& task) {
+        for (unsigned k = 0; k < threads; ++k) {
+            Share& sh = shares[(me + k) % threads];
+            std::lock_guard<std::mutex> l(sh.mtx);
+            if (sh.begin == sh.end) continue;
+            task = k == 0 ? sh.begin++ : --sh.end;   // own share from the front, others' from the back
+            return true;
+        }
+        return false;
+    };
+    auto work = [&](unsigned me) {
+        size_t task;
+        while (!failed.load(std::memory_order_relaxed) && next(me, task)) {
+            try {
+                fn(task, me);
+            } catch (...) {
+                std::lock_guard<std::mutex> l(errorMtx);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+    vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(work, t);
+    work(0);
+    for (auto& th : pool) th.join();
+    if (error) std::rethrow_exception(error);
+}
+
+
+/* ---------- Reservation holds ---------- */
+
+// Who waits for which item. An item's waiters are kept highest priority
+// first, first come first served within a priority; at most one holder at a
+// time is ready to pick the item up (the item is RESERVED for them) until a
+// deadline. Deadlines sit in a min-heap, so expiring them costs a heap pop
+// each and no pass over the items. Items are striped over mutexes; the
+// service holds an item's stripe (lock()) across any change that moves the
+// item into or out of RESERVED, so a return and a new waiter cannot miss
+// each other. The timer heap has its own lock, taken inside a stripe's.
+class HoldQueues {
+public:
+    struct Waiter {
+        int userId = 0;
+        int priority = 0;
+    };
+    struct Ready {
+        int userId = 0;
+        system_clock::time_point until;
+    };
+    struct Timer {
+        system_clock::time_point until;
+        int itemId = 0;
+        int userId = 0;
+        bool operator>(const Timer& o) const { return until > o.until; }
+    };
+
+private:
+    struct Holds {
+        vector<Waiter> queue;
+        optional<Ready> ready;
+    };
+    struct alignas(64) Stripe {
+        std::mutex mtx;
+        unordered_map<int, Holds> items;
+    };
+    static constexpr size_t kStripes = 64;
+    std::array<Stripe, kStripes> stripes_;
+
+    std::mutex timerMtx_;
+    vector<Timer> timers_;                                  // min-heap on until; stale entries are skipped
+    std::atomic<int64_t> nextDue_{std::numeric_limits<int64_t>::max()};   // ticks of timers_.front()
+
+    Stripe& stripeOf(int itemId) { return stripes_[static_cast<uint32_t>(itemId) % kStripes]; }
+
+    // caller holds itemId's stripe
+    Holds* find(int itemId) {
+        auto& items = stripeOf(itemId).items;
+        auto it = items.find(itemId);
+        return it == items.end() ? nullptr : &it->second;
+    }
+    void prune(int itemId, Holds& h) {
+        if (h.queue.empty() && !h.ready) stripeOf(itemId).items.erase(itemId);
+    }
+    static int64_t ticks(system_clock::time_point t) { return t.time_since_epoch().count(); }
+
+public:
+    std::unique_lock<std::mutex> lock(int itemId) { return std::unique_lock<std::mutex>(stripeOf(itemId).mtx); }
+
+    // Every function below expects the caller to hold itemId's stripe.
+
+    // adds userId behind everyone of equal or higher priority; the 1-based
+    // place it got, or 0 if userId was already waiting
+    size_t enqueue(int itemId, int userId, int priority) {
+        auto& q = stripeOf(itemId).items[itemId].queue;
+        if (std::any_of(q.begin(), q.end(), [&](const Waiter& w) { return w.userId == userId; })) return 0;
+        auto at = std::find_if(q.begin(), q.end(), [&](const Waiter& w) { return w.priority < priority; });
+        at = q.insert(at, {userId, priority});
+        return static_cast<size_t>(at - q.begin()) + 1;
+    }
+
+    bool leave(int itemId, int userId) {
+        auto h = find(itemId);
+        if (!h) return false;
+        auto it = std::find_if(h->queue.begin(), h->queue.end(), [&](const Waiter& w) { return w.userId == userId; });
+        if (it == h->queue.end()) return false;
+        h->queue.erase(it);
+        prune(itemId, *h);
+        return true;
+    }
+
+    // first waiter, not removed
+    optional<int> front(int itemId) {
+        auto h = find(itemId);
+        if (!h || h->queue.empty()) return nullopt;
+        return h->queue.front().userId;
+    }
+
+    // everyone waiting, in order; they are removed
+    vector<Waiter> clear(int itemId) {
+        auto h = find(itemId);
+        if (!h) return {};
+        auto q = move(h->queue);
+        h->queue.clear();
+        prune(itemId, *h);
+        return q;
+    }
+
+    // userId may pick itemId up until the deadline; replaces any previous
+    // holder and leaves the queue if it was in it. True if the deadline is
+    // now the earliest one.
+    bool setReady(int itemId, int userId, system_clock::time_point until) {
+        leave(itemId, userId);
+        stripeOf(itemId).items[itemId].ready = Ready{userId, until};
+        std::lock_guard<std::mutex> l(timerMtx_);
+        timers_.push_back({until, itemId, userId});
+        std::push_heap(timers_.begin(), timers_.end(), std::greater<Timer>());
+        nextDue_.store(ticks(timers_.front().until), std::memory_order_release);
+        return timers_.front().until == until;
+    }
+
+    void clearReady(int itemId) {
+        auto h = find(itemId);
+        if (!h || !h->ready) return;
+        h->ready.reset();
+        prune(itemId, *h);
+    }
+
+    optional<Ready> ready(int itemId) {
+        auto h = find(itemId);
+        return h ? h->ready : nullopt;
+    }
+
+    vector<Waiter> waiting(int itemId) {
+        auto h = find(itemId);
+        return h ? h->queue : vector<Waiter>{};
+    }
+
+    // The functions below take the locks they need themselves.
+
+    // cheap test for due() without taking the timer lock
+    bool anyDue(system_clock::time_point now) const {
+        return nextDue_.load(std::memory_order_acquire) <= ticks(now);
+    }
+
+    // earliest deadline still in the heap (possibly stale); nullopt if none
+    optional<system_clock::time_point> nextDue() const {
+        int64_t t = nextDue_.load(std::memory_order_acquire);
+        if (t == std::numeric_limits<int64_t>::max()) return nullopt;
+        return system_clock::time_point(system_clock::duration(t));
+    }
+
+    // removes and returns every timer due at now; one whose holder is no
+    // longer ready with that deadline is stale and must be ignored
+    vector<Timer> due(system_clock::time_point now) {
+        vector<Timer> res;
+        std::lock_guard<std::mutex> l(timerMtx_);
+        while (!timers_.empty() && timers_.front().until <= now) {
+            std::pop_heap(timers_.begin(), timers_.end(), std::greater<Timer>());
+            res.push_back(timers_.back());
+            timers_.pop_back();
+        }
+        nextDue_.store(timers_.empty() ? std::numeric_limits<int64_t>::max() : ticks(timers_.front().until),
+                       std::memory_order_release);
+        return res;
+    }
+
+    // f(itemId, ready, waiters) for every item with a hold, one stripe locked at a time
+    template<typename F>
+    void forEach(F&& f) {
+        for (auto& s : stripes_) {
+            std::lock_guard<std::mutex> l(s.mtx);
+            for (auto& [itemId, h] : s.items) f(itemId, h.ready, h.queue);
+        }
+    }
+};
+
+
+/* ---------- Circulation analytics ---------- */
+
+// Running circulation figures, fed by the service on every borrow, return and
+// fine, so reports never scan the record or fine stores. Counts are kept per
+// UTC day in a ring of kDays buckets, and a window of the last n days adds up
+// n of them. Popular items are counted by a Space-Saving sketch per week;
+// the current and the previous week are kept. Memory is fixed however long
+// the history grows. Shards are picked by item id, each under its own mutex.
+class CirculationStats {
+public:
+    static constexpr int kDays = 35;              // longest window
+    static constexpr size_t kKinds = 3;           // ItemKind values
+    static constexpr size_t kCounters = 64;       // sketch counters per shard and week
+
+    struct Window {
+        int days = 0;
+        uint64_t borrows[kKinds] = {}, returns[kKinds] = {};
+        int64_t loanSeconds[kKinds] = {};         // summed over the returns
+        uint64_t fines = 0;
+        Money fined;
+
+        static size_t at(ItemKind kind) { return static_cast<size_t>(kind) - 1; }
+        uint64_t borrowsOf(ItemKind kind) const { return borrows[at(kind)]; }
+        uint64_t totalBorrows() const { return borrows[0] + borrows[1] + borrows[2]; }
+        uint64_t totalReturns() const { return returns[0] + returns[1] + returns[2]; }
+        // mean length of the loans returned in the window; every kind if nullopt
+        double averageLoanDays(optional<ItemKind> kind = nullopt) const {
+            uint64_t n = kind ? returns[at(*kind)] : totalReturns();
+            int64_t secs = kind ? loanSeconds[at(*kind)] : loanSeconds[0] + loanSeconds[1] + loanSeconds[2];
+            return n ? secs / 86400.0 / static_cast<double>(n) : 0;
+        }
+    };
+
+    // borrows is an upper bound on the true count, borrows - error a lower one
+    struct Popular {
+        int itemId = 0;
+        uint64_t borrows = 0, error = 0;
+    };
+
+private:
+    // Space-Saving: counts for the most frequent ids only, a min-heap on
+    // count; an id not in it takes over the smallest counter and inherits
+    // that count as its possible error
+    class Sketch {
+        struct Counter { int id; uint64_t count, error; };
+        vector<Counter> heap_;
+        unordered_map<int, size_t> pos_;
+
+        void swapAt(size_t a, size_t b) {
+            std::swap(heap_[a], heap_[b]);
+            pos_[heap_[a].id] = a;
+            pos_[heap_[b].id] = b;
+        }
+        void siftDown(size_t i) {
+            for (size_t c; (c = 2 * i + 1) < heap_.size(); i = c) {
+                if (c + 1 < heap_.size() && heap_[c + 1].count < heap_[c].count) ++c;
+                if (heap_[i].count <= heap_[c].count) return;
+                swapAt(i, c);
+            }
+        }
+        void siftUp(size_t i) {
+            for (; i > 0 && heap_[(i - 1) / 2].count > heap_[i].count; i = (i - 1) / 2) swapAt(i, (i - 1) / 2);
+        }
+
+    public:
+        void add(int id) {
+            auto it = pos_.find(id);
+            if (it != pos_.end()) {
+                ++heap_[it->second].count;
+                siftDown(it->second);
+            } else if (heap_.size() < kCounters) {
+                heap_.push_back({id, 1, 0});
+                pos_[id] = heap_.size() - 1;
+                siftUp(heap_.size() - 1);
+            } else {
+                Counter& min = heap_.front();
+                pos_.erase(min.id);
+                min = {id, min.count + 1, min.count};
+                pos_[id] = 0;
+                siftDown(0);
+            }
+        }
+        // (count, error) for id; one the sketch does not hold is counted as its minimum
+        std::pair<uint64_t, uint64_t> estimate(int id) const {
+            auto it = pos_.find(id);
+            if (it != pos_.end()) return {heap_[it->second].count, heap_[it->second].error};
+            uint64_t floor = heap_.size() < kCounters ? 0 : heap_.front().count;
+            return {floor, floor};
+        }
+        template<class F> void forEachId(F&& f) const { for (auto& c : heap_) f(c.id); }
+        void clear() { heap_.clear(); pos_.clear(); }
+    };
+
+    struct Day {
+        int64_t day = std::numeric_limits<int64_t>::min();
+        uint32_t borrows[kKinds] = {}, returns[kKinds] = {};
+        int64_t loanSeconds[kKinds] = {};
+        uint32_t fines = 0;
+        int64_t finedPaise = 0;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mtx;
+        std::array<Day, kDays> days;
+        int64_t week = std::numeric_limits<int64_t>::min();   // of thisWeek
+        Sketch thisWeek, lastWeek;
+        int64_t onLoan[kKinds] = {};
+    };
+    static constexpr size_t kShards = 16;
+    std::array<Shard, kShards> shards_;
+
+    Shard& shardOf(int itemId) { return shards_[static_cast<uint32_t>(itemId) % kShards]; }
+
+    static int64_t dayOf(system_clock::time_point t) {
+        return std::chrono::floor<std::chrono::duration<int64_t, std::ratio<86400>>>(t.time_since_epoch()).count();
+    }
+    static int64_t weekOf(int64_t day) { return day >= 0 ? day / 7 : (day - 6) / 7; }
+
+    // the bucket for day, recycling its slot; null if a later day has it
+    static Day* bucket(Shard& s, int64_t day) {
+        Day& d = s.days[static_cast<size_t>((day % kDays + kDays) % kDays)];
+        if (d.day == day) return &d;
+        if (d.day > day) return nullptr;
+        d = Day{};
+        d.day = day;
+        return &d;
+    }
+
+    // the sketch for week, moving to a new week if it is later; null if too old
+    static Sketch* sketch(Shard& s, int64_t week) {
+        if (week > s.week) {
+            if (week == s.week + 1) std::swap(s.lastWeek, s.thisWeek);
+            else s.lastWeek.clear();
+            s.thisWeek.clear();
+            s.week = week;
+        }
+        if (week == s.week) return &s.thisWeek;
+        if (week == s.week - 1) return &s.lastWeek;
+        return nullptr;
+    }
+
+    // caller holds s.mtx
+    static void countBorrow(Shard& s, ItemKind kind, int itemId, system_clock::time_point at) {
+        int64_t day = dayOf(at);
+        if (Day* d = bucket(s, day)) ++d->borrows[Window::at(kind)];
+        if (Sketch* sk = sketch(s, weekOf(day))) sk->add(itemId);
+    }
+
+public:
+    void borrowed(ItemKind kind, int itemId, system_clock::time_point at) {
+        Shard& s = shardOf(itemId);
+        std::lock_guard<std::mutex> l(s.mtx);
+        ++s.onLoan[Window::at(kind)];
+        countBorrow(s, kind, itemId, at);
+    }
+
+    void returned(ItemKind kind, int itemId, system_clock::duration loan, system_clock::time_point at) {
+        Shard& s = shardOf(itemId);
+        std::lock_guard<std::mutex> l(s.mtx);
+        --s.onLoan[Window::at(kind)];
+        if (Day* d = bucket(s, dayOf(at))) {
+            ++d->returns[Window::at(kind)];
+            d->loanSeconds[Window::at(kind)] += std::chrono::duration_cast<std::chrono::seconds>(loan).count();
+        }
+    }
+
+    void fined(int itemId, Money amount, system_clock::time_point at) {
+        Shard& s = shardOf(itemId);
+        std::lock_guard<std::mutex> l(s.mtx);
+        if (Day* d = bucket(s, dayOf(at))) {
+            ++d->fines;
+            d->finedPaise += amount.paise();
+        }
+    }
+
+    // Re-counts a borrow, and its return if dated, from its record after
+    // recovery. Records from journals that predate returnedAt count only the
+    // borrow.
+    void restore(ItemKind kind, const BorrowRecord& rec, system_clock::time_point now) {
+        Shard& s = shardOf(rec.itemId());
+        std::lock_guard<std::mutex> l(s.mtx);
+        if (rec.isOpen()) ++s.onLoan[Window::at(kind)];
+        if (dayOf(rec.borrowAt()) > dayOf(now) - kDays) countBorrow(s, kind, rec.itemId(), rec.borrowAt());
+        if (rec.isOpen() || rec.returnedAt() == system_clock::time_point{}) return;
+        if (Day* d = bucket(s, dayOf(rec.returnedAt()))) {
+            ++d->returns[Window::at(kind)];
+            d->loanSeconds[Window::at(kind)] +=
+                std::chrono::duration_cast<std::chrono::seconds>(rec.returnedAt() - rec.borrowAt()).count();
+        }
+    }
+
+    void clear() {
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> l(s.mtx);
+            s.days.fill(Day{});
+            s.week = std::numeric_limits<int64_t>::min();
+            s.thisWeek.clear();
+            s.lastWeek.clear();
+            std::fill(std::begin(s.onLoan), std::end(s.onLoan), 0);
+        }
+    }
+
+    // the last `days` UTC days up to and including now's (1..kDays)
+    Window window(int days, system_clock::time_point now) {
+        Window w;
+        w.days = std::clamp(days, 1, kDays);
+        int64_t last = dayOf(now), first = last - w.days + 1;
+        int64_t paise = 0;
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> l(s.mtx);
+            for (auto& d : s.days) {
+                if (d.day < first || d.day > last) continue;
+                for (size_t k = 0; k < kKinds; ++k) {
+                    w.borrows[k] += d.borrows[k];
+                    w.returns[k] += d.returns[k];
+                    w.loanSeconds[k] += d.loanSeconds[k];
+                }
+                w.fines += d.fines;
+                paise += d.finedPaise;
+            }
+        }
+        w.fined = Money(paise);
+        return w;
+    }
+
+    // the n most borrowed items over this week and last, most borrowed first
+    vector<Popular> top(size_t n, system_clock::time_point now) {
+        int64_t week = weekOf(dayOf(now));
+        vector<Popular> out;
+        vector<int> ids;
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> l(s.mtx);
+            // a shard that has not seen this week yet holds it as lastWeek's successor
+            const Sketch* cur = s.week == week ? &s.thisWeek : nullptr;
+            const Sketch* prev = s.week == week ? &s.lastWeek : s.week == week - 1 ? &s.thisWeek : nullptr;
+            ids.clear();
+            for (const Sketch* sk : {cur, prev})
+                if (sk) sk->forEachId([&](int id) { ids.push_back(id); });
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            for (int id : ids) {
+                Popular p{id, 0, 0};
+                for (const Sketch* sk : {cur, prev}) {
+                    if (!sk) continue;
+                    auto [count, error] = sk->estimate(id);
+                    p.borrows += count;
+                    p.error += error;
+                }
+                out.push_back(p);
+            }
+        }
+        auto more = [](const Popular& a, const Popular& b) {
+            return a.borrows != b.borrows ? a.borrows > b.borrows : a.itemId < b.itemId;
+        };
+        if (out.size() > n) {
+            std::partial_sort(out.begin(), out.begin() + static_cast<std::ptrdiff_t>(n), out.end(), more);
+            out.resize(n);
+        } else {
+            std::sort(out.begin(), out.end(), more);
+        }
+        return out;
+    }
+
+    // items of kind out on loan right now
+    int64_t onLoan(ItemKind kind) {
+        int64_t n = 0;
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> l(s.mtx);
+            n += s.onLoan[Window::at(kind)];
+        }
+        return n;
+    }
+};
+
+
+class LibraryService {
+    ItemRepo& items_;
+    UserRepo& users_;
+    BorrowRecordRepo& records_;
+    FineRepo& fines_;
+    Money dailyFineRate_;
+    const Clock& clock_;
+    optional<Money> fineLimit_;   // borrowing is refused while a user owes more than this
+    // Item availability and reservations live in each item's state word
+    // (Item::transition), so borrow/return/reserve/cancel race only on the
+    // item they touch and need no service-wide lock. Waiters for an item are
+    // in holds_, whose stripe for the item is held by anything that moves it
+    // into or out of RESERVED.
+    HoldQueues holds_;
+    system_clock::duration pickupWindow_ = hours(72);   // how long a ready hold waits for its borrow
+    std::thread expiry_;              // see startHoldExpiry
+    std::mutex expiryMtx_;
+    std::condition_variable expiryCv_;
+    bool expiryStop_ = false, expiryWake_ = false;   // expiryWake_: a new earliest deadline
+
+    // With a journal attached, one item's entries must land in the order its
+    // changes took effect, so the change and its append happen under one of
+    // these striped locks (keyed by user id for ledger settlements). Without
+    // a journal they are never taken.
+    std::array<std::mutex, 64> logOrder_;
+
+    EventLog* events_ = nullptr;  // what the service did; none when running headless
+    CirculationStats circulation_;  // rolling borrow/return/fine figures for reports
+
+public:
+    // A hold that became ready: userId may borrow itemId until `until`.
+    struct HoldNotice {
+        int itemId = 0, userId = 0;
+        system_clock::time_point until;
+    };
+    using HoldListener = std::function<void(const HoldNotice&)>;
+private:
+    std::mutex listenersMtx_;
+    std::map<size_t, HoldListener> listeners_;
+    size_t nextListener_ = 1;
+
+    mutable Versions versions_;   // epochs for snapshot reads
+
+    Journal* journal_ = nullptr;
+    size_t snapshotEvery_ = 0;
+    std::atomic<size_t> sinceSnapshot_{0};
+    std::atomic<int64_t> clockOffset_{0};   // ns a simulated clock was advanced (see recordClockOffset)
+    std::atomic<bool> checkpointing_{false};
+    std::future<void> checkpoint_;
+    std::mutex checkpointMtx_;     // one snapshot at a time
+
+    // status is the item's own unless a snapshot supplies the one it had then
+    static string encodeItem(const Item& item, optional<AvailabilityStatus> status = nullopt) {
+        ByteWriter w;
+        w.u8(static_cast<uint8_t>(item.kind()));
+        w.i32(item.id()).str(item.title()).u32(static_cast<uint32_t>(item.authors().size()));
+        for (auto& a : item.authors()) w.str(a);
+        w.u8(static_cast<uint8_t>(status ? *status : item.status()));
+        if (auto b = dynamic_cast<const Book*>(&item)) w.i32(b->getPageCount());
+        else if (auto a = dynamic_cast<const Audiobook*>(&item)) w.i64(a->getPlaybackDuration().count()).str(a->narrator());
+        else if (auto m = dynamic_cast<const EMagazine*>(&item)) w.i32(m->issueNumber()).time(m->issueDate()).u8(m->isArchived());
+        return w.bytes();
+    }
+
+    static shared_ptr<Item> decodeItem(ByteReader& r) {
+        auto kind = static_cast<ItemKind>(r.u8());
+        int id = r.i32();
+        string title = r.str();
+        vector<string> authors(r.u32());
+        for (auto& a : authors) a = r.str();
+        auto status = static_cast<AvailabilityStatus>(r.u8());
+        shared_ptr<Item> item;
+        if (kind == ItemKind::Book) {
+            item = make_shared<Book>(id, move(title), authors, r.i32());
+        } else if (kind == ItemKind::Audiobook) {
+            hours playback(r.i64());
+            item = make_shared<Audiobook>(id, move(title), authors, playback, r.str());
+        } else if (kind == ItemKind::EMagazine) {
+            int issue = r.i32();
+            auto issueDate = r.time();
+            auto mag = make_shared<EMagazine>(id, move(title), authors, issue, issueDate);
+            mag->restoreArchived(r.u8() != 0);
+            item = mag;
+        } else {
+            throw PersistenceException("Unknown item kind in journal");
+        }
+        item->setStatus(status);
+        return item;
+    }
+
+    static string encodeUser(const User& u) {
+        ByteWriter w;
+        w.i32(u.id()).str(u.name()).i32(u.borrowLimit());
+        return w.bytes();
+    }
+
+    static string encodeRecord(const BorrowRecord& rec) {
+        ByteWriter w;
+        w.i32(rec.id()).i32(rec.itemId()).i32(rec.userId()).time(rec.borrowAt()).time(rec.dueAt())
+         .u8(static_cast<uint8_t>(rec.status())).time(rec.returnedAt());
+        return w.bytes();
+    }
+
+    static string encodeFine(const Fine& f) {
+        ByteWriter w;
+        w.i32(f.id()).i32(f.itemId()).i32(f.userId()).i64(f.amount().paise())
+         .u8(static_cast<uint8_t>(f.reasonCode())).i32(f.reasonParam()).time(f.appliedAt());
+        return w.bytes();
+    }
+
+    // a user's paid/waived totals; absolute, so replay stays idempotent
+    static string encodeSettled(int userId, const FineRepo::Account& acc) {
+        ByteWriter w;
+        w.i32(userId).i64(acc.paid.paise()).i64(acc.waived.paise());
+        return w.bytes();
+    }
+
+    static string encodeIds(int a, int b = 0) {
+        ByteWriter w;
+        w.i32(a).i32(b);
+        return w.bytes();
+    }
+
+    static string encodeHold(int itemId, int userId, int priority) {
+        ByteWriter w;
+        w.i32(itemId).i32(userId).i32(priority);
+        return w.bytes();
+    }
+
+    static string encodeReady(int itemId, int userId, system_clock::time_point until) {
+        ByteWriter w;
+        w.i32(itemId).i32(userId).time(until);
+        return w.bytes();
+    }
+
+    void log(WalOp op, const string& payload) {
+        if (!journal_) return;
+        journal_->append(op, payload);
+        logged(1);
+    }
+
+    void log(const vector<std::pair<WalOp, string>>& entries) {
+        if (!journal_ || entries.empty()) return;
+        journal_->append(entries);
+        logged(entries.size());
+    }
+
+    void logged(size_t n) {
+        if (snapshotEvery_ && (sinceSnapshot_ += n) >= snapshotEvery_ && !checkpointing_.exchange(true)) {
+            sinceSnapshot_ = 0;
+            checkpoint_ = std::async(std::launch::async, [this] {
+                try { checkpoint(); } catch (const std::exception& e) { cerr << "Checkpoint failed: " << e.what() << "\n"; }
+                checkpointing_ = false;
+            });
+        }
+    }
+
+    void event(EventKind kind, int userId, int itemId, int64_t paise, system_clock::time_point due,
+               system_clock::time_point at) {
+        if (events_) events_->record(Event{kind, userId, itemId, paise, at, due});
+    }
+    void event(EventKind kind, int userId, int itemId, int64_t paise = 0, system_clock::time_point due = {}) {
+        if (events_) event(kind, userId, itemId, paise, due, clock_.now());
+    }
+
+    // One service call is one change to snapshot readers: all it does belongs
+    // to one epoch. Journal waits come after the epoch is left, so opening a
+    // snapshot never waits for a disk flush. Taken before logOrder().
+    struct WriteScope {
+        Journal::Deferred durable;
+        Versions::Writer writer;
+        explicit WriteScope(LibraryService& s) : durable(s.journal_), writer(&s.versions_) {}
+    };
+
+    // Rolls back a borrowItem that throws after taking the user's slot: the
+    // record is closed, the item and any pickup it consumed are put back and
+    // the slot is returned. Lives inside the item's logOrder lock.
+    struct BorrowUndo {
+        LibraryService& s;
+        int userId;
+        Item& item;
+        optional<ItemState> was;               // state before it became BORROWED
+        optional<HoldQueues::Ready> hold;
+        const BorrowRecord* rec = nullptr;
+        bool committed = false;
+        BorrowUndo(LibraryService& s, int userId, Item& item) : s(s), userId(userId), item(item) {}
+        ~BorrowUndo() {
+            if (committed) return;
+            if (rec) s.records_.markReturned(*rec, s.clock_.now());
+            if (was) {
+                std::unique_lock<std::mutex> hl;
+                if (hold) hl = s.holds_.lock(item.id());
+                ItemState borrowed{AvailabilityStatus::BORROWED};
+                s.items_.changeState(item, [&] { return item.transition(borrowed, *was); });
+                if (hold) s.holdReady(item.id(), hold->userId, hold->until);
+            }
+            s.users_.releaseBorrow(userId);
+        }
+    };
+
+    std::unique_lock<std::mutex> logOrder(int key) {
+        if (!journal_) return {};
+        return std::unique_lock<std::mutex>(logOrder_[static_cast<uint32_t>(key) % logOrder_.size()]);
+    }
+    // logOrder() for several keys at once, locked in index order; only the
+    // sweep holds more than one
+    vector<std::unique_lock<std::mutex>> logOrders(const vector<int>& keys) {
+        vector<std::unique_lock<std::mutex>> res;
+        if (!journal_) return res;
+        vector<bool> want(logOrder_.size());
+        for (int key : keys) want[static_cast<uint32_t>(key) % want.size()] = true;
+        for (size_t i = 0; i < want.size(); ++i)
+            if (want[i]) res.emplace_back(logOrder_[i]);
+        return res;
+    }
+
+    // Caller holds the item's hold stripe. Makes the hold ready and wakes the
+    // expiry thread if it now has an earlier deadline to sleep until.
+    void holdReady(int itemId, int userId, system_clock::time_point until) {
+        if (!holds_.setReady(itemId, userId, until)) return;
+        {
+            std::lock_guard<std::mutex> l(expiryMtx_);
+            expiryWake_ = true;
+        }
+        expiryCv_.notify_one();
+    }
+
+    // Caller holds the item's hold stripe (and its logOrder lock). Hands the
+    // item, now in `from`, to the first waiter with a fresh pickup deadline,
+    // or makes it available if nobody waits. False if it had left `from`.
+    bool passOn(Item& item, ItemState from, system_clock::time_point now, vector<HoldNotice>& ready) {
+        int itemId = item.id();
+        if (auto next = holds_.front(itemId)) {
+            if (!items_.changeState(item, [&] { return item.transition(from, {AvailabilityStatus::RESERVED, *next}); }))
+                return false;
+            auto until = now + pickupWindow_;
+            holdReady(itemId, *next, until);
+            log(WalOp::HoldReady, encodeReady(itemId, *next, until));
+            event(EventKind::HoldReady, *next, itemId, 0, until, now);
+            ready.push_back({itemId, *next, until});
+            return true;
+        }
+        return items_.changeState(item, [&] { return item.transition(from, {AvailabilityStatus::AVAILABLE}); });
+    }
+
+    // calls every hold listener for each notice; no service lock is held
+    void notify(const vector<HoldNotice>& ready) {
+        if (ready.empty()) return;
+        vector<HoldListener> listeners;
+        {
+            std::lock_guard<std::mutex> l(listenersMtx_);
+            for (auto& entry : listeners_) listeners.push_back(entry.second);
+        }
+        for (auto& n : ready)
+            for (auto& fn : listeners) fn(n);
+    }
+
+    // see the public overload; costs one atomic load unless a deadline is due
+    size_t expireHolds(system_clock::time_point now) {
+        if (!holds_.anyDue(now)) return 0;
+        size_t lapsed = 0;
+        vector<HoldNotice> ready;
+        for (auto& t : holds_.due(now)) {
+            auto itemOpt = items_.findById(t.itemId);
+            if (!itemOpt) continue;
+            auto& item = **itemOpt;
+            WriteScope scope(*this);
+            auto order = logOrder(t.itemId);
+            auto hl = holds_.lock(t.itemId);
+            auto held = holds_.ready(t.itemId);
+            // picked up, cancelled or handed on since the timer was set
+            if (!held || held->userId != t.userId || held->until != t.until) continue;
+            holds_.clearReady(t.itemId);
+            ItemState st = item.state();
+            if (st.status != AvailabilityStatus::RESERVED || st.reservedBy != t.userId) continue;
+            log(WalOp::Cancel, encodeIds(t.itemId));
+            event(EventKind::HoldExpired, t.userId, t.itemId, 0, t.until, now);
+            passOn(item, st, now, ready);
+            ++lapsed;
+        }
+        notify(ready);
+        return lapsed;
+    }
+
+    void setItemStatus(int itemId, AvailabilityStatus s, int reservedBy = 0) {
+        auto itemOpt = items_.findById(itemId);
+        if (itemOpt) items_.changeState(**itemOpt, [&] { (*itemOpt)->setStatus(s, reservedBy); });
+    }
+
+    // Applies one journal entry during recovery. Entries hold resulting state,
+    // so applying them on top of a newer snapshot converges to the same state.
+    void apply(WalOp op, ByteReader& r) {
+        switch (op) {
+        case WalOp::SaveItem: {
+            auto item = decodeItem(r);
+            items_.save(item, item->id());
+            break;
+        }
+        case WalOp::SaveUser: {
+            int id = r.i32();
+            string name = r.str();
+            users_.save(make_shared<User>(id, move(name), r.i32()), id);
+            break;
+        }
+        case WalOp::Borrow: {
+            int id = r.i32(), itemId = r.i32(), userId = r.i32();
+            auto borrowAt = r.time(), dueAt = r.time();
+            auto status = static_cast<BorrowStatus>(r.u8());
+            auto returnedAt = r.atEnd() ? system_clock::time_point{} : r.time();   // absent before returns were dated
+            records_.restore(id, itemId, userId, borrowAt, dueAt, status, returnedAt);
+            if (status != BorrowStatus::RETURNED) {
+                setItemStatus(itemId, AvailabilityStatus::BORROWED);
+                auto hl = holds_.lock(itemId);
+                holds_.clearReady(itemId);
+            }
+            break;
+        }
+        case WalOp::Return: {
+            auto rec = records_.findById(r.i32());
+            if (!rec) break;
+            records_.markReturned(*rec, r.atEnd() ? system_clock::time_point{} : r.time());
+            setItemStatus(rec->itemId(), AvailabilityStatus::AVAILABLE);
+            break;
+        }
+        case WalOp::Renew: {
+            auto rec = records_.findById(r.i32());
+            auto due = r.time();
+            if (rec) records_.updateDueAt(*rec, due);
+            break;
+        }
+        case WalOp::Reserve: {
+            int itemId = r.i32(), userId = r.i32();
+            setItemStatus(itemId, AvailabilityStatus::RESERVED, userId);
+            break;
+        }
+        case WalOp::Cancel: {
+            int itemId = r.i32();
+            setItemStatus(itemId, AvailabilityStatus::AVAILABLE);
+            auto hl = holds_.lock(itemId);
+            holds_.clearReady(itemId);
+            break;
+        }
+        case WalOp::Hold: {
+            int itemId = r.i32(), userId = r.i32();
+            int priority = r.i32();
+            auto hl = holds_.lock(itemId);
+            holds_.enqueue(itemId, userId, priority);
+            break;
+        }
+        case WalOp::Unhold: {
+            int itemId = r.i32(), userId = r.i32();
+            auto hl = holds_.lock(itemId);
+            holds_.leave(itemId, userId);
+            break;
+        }
+        case WalOp::ClockOffset: {
+            int64_t ns = r.i64();
+            if (ns > clockOffset_.load(std::memory_order_relaxed)) clockOffset_.store(ns, std::memory_order_relaxed);
+            break;
+        }
+        case WalOp::HoldReady: {
+            int itemId = r.i32(), userId = r.i32();
+            auto until = r.time();
+            setItemStatus(itemId, AvailabilityStatus::RESERVED, userId);
+            auto hl = holds_.lock(itemId);
+            holds_.setReady(itemId, userId, until);
+            break;
+        }
+        case WalOp::Fine: {
+            int id = r.i32(), itemId = r.i32(), userId = r.i32();
+            Money amount(r.i64());
+            auto code = static_cast<FineReason>(r.u8());
+            int32_t param = r.i32();
+            fines_.restore(Fine(id, itemId, userId, amount, code, param, r.time()));
+            break;
+        }
+        case WalOp::FineText: {
+            int id = r.i32(), itemId = r.i32(), userId = r.i32();
+            Money amount(r.i64());
+            string text = r.str();
+            int days = 0;
+            bool overdue = std::sscanf(text.c_str(), "Overdue by %d days", &days) == 1;
+            fines_.restore(Fine(id, itemId, userId, amount, overdue ? FineReason::Overdue : FineReason::Other,
+                                days, r.time()));
+            break;
+        }
+        case WalOp::Settle: {
+            int userId = r.i32();
+            Money paid(r.i64());
+            fines_.restoreSettled(userId, paid, Money(r.i64()));
+            break;
+        }
+        case WalOp::Overdue: {
+            int id = r.i32();
+            records_.restoreOverdue(id, r.i32());
+            break;
+        }
+        case WalOp::Archive: {
+            auto itemOpt = items_.findById(r.i32());
+            if (!itemOpt) break;
+            items_.changeState(**itemOpt, [&] {
+                if (auto mag = std::dynamic_pointer_cast<EMagazine>(*itemOpt)) mag->restoreArchived(true);
+                (*itemOpt)->setStatus(AvailabilityStatus::MAINTENANCE);
+            });
+            auto hl = holds_.lock((*itemOpt)->id());
+            holds_.clearReady((*itemOpt)->id());
+            holds_.clear((*itemOpt)->id());
+            break;
+        }
+        default:
+            throw PersistenceException("Unknown journal entry");
+        }
+    }
+
+public:
+    LibraryService(ItemRepo& items, UserRepo& users, BorrowRecordRepo& records, FineRepo& fines, Money dailyFineRate,
+                   const Clock& clock = systemClock())
+      : items_(items), users_(users), records_(records), fines_(fines), dailyFineRate_(dailyFineRate), clock_(clock) {
+        items_.attachVersions(&versions_);
+        records_.attachVersions(&versions_);
+        fines_.attachVersions(&versions_);
+    }
+
+    const Clock& clock() const { return clock_; }
+
+    ~LibraryService() {
+        stopHoldExpiry();
+        if (checkpoint_.valid()) checkpoint_.wait();
+        items_.attachVersions(nullptr);
+        records_.attachVersions(nullptr);
+        fines_.attachVersions(nullptr);
+    }
+
+    // Items, borrow records and fines as they are now; later changes do not
+    // show through it. Cheap to open; must not outlive the service.
+    ReadView snapshot() const { return ReadView(versions_, items_, records_, fines_); }
+
+    // refuse borrows by users whose outstanding fines exceed limit (nullopt = never)
+    void setFineLimit(optional<Money> limit) { fineLimit_ = limit; }
+
+    // how long a hold that became ready waits for its holder to borrow
+    void setPickupWindow(system_clock::duration window) { pickupWindow_ = window; }
+
+    // fn runs for every hold that becomes ready, on the thread that made it
+    // ready, after the change and with no service lock held. It must not
+    // subscribe or unsubscribe. Returns the id for unsubscribeHolds.
+    size_t subscribeHolds(HoldListener fn) {
+        std::lock_guard<std::mutex> l(listenersMtx_);
+        listeners_.emplace(nextListener_, move(fn));
+        return nextListener_++;
+    }
+    void unsubscribeHolds(size_t id) {
+        std::lock_guard<std::mutex> l(listenersMtx_);
+        listeners_.erase(id);
+    }
+
+    // Passes on every hold whose pickup deadline has gone by: to the next
+    // waiter, or the item becomes available. Borrow, return, reserve and
+    // cancel do this first, so a lapsed hold is never honoured; call it
+    // after moving a simulated clock. Returns how many holds lapsed.
+    size_t expireHolds() { return expireHolds(clock_.now()); }
+
+    // Starts a thread that expires lapsed pickups when their deadlines pass,
+    // instead of on the next call that happens to look. It sleeps until the
+    // earliest deadline, but never more than a second, so a clock jump or a
+    // shorter pickup window is noticed. No-op if already running.
+    void startHoldExpiry() {
+        std::lock_guard<std::mutex> l(expiryMtx_);
+        if (expiry_.joinable()) return;
+        expiryStop_ = false;
+        expiry_ = std::thread([this] {
+            std::unique_lock<std::mutex> l(expiryMtx_);
+            while (true) {
+                system_clock::duration wait = std::chrono::seconds(1);
+                if (auto due = holds_.nextDue()) wait = std::clamp(*due - clock_.now(), system_clock::duration::zero(), wait);
+                expiryCv_.wait_for(l, wait, [&] { return expiryStop_ || expiryWake_; });
+                if (expiryStop_) return;
+                if (expiryWake_) { expiryWake_ = false; continue; }
+                l.unlock();
+                // a journal failure is reported to the calls that write; retried next pass
+                try { expireHolds(clock_.now()); } catch (const LibraryException&) {}
+                l.lock();
+            }
+        });
+    }
+
+    void stopHoldExpiry() {
+        {
+            std::lock_guard<std::mutex> l(expiryMtx_);
+            if (!expiry_.joinable()) return;
+            expiryStop_ = true;
+        }
+        expiryCv_.notify_all();
+        expiry_.join();
+    }
+
+    // the user an item is ready for and until when, then everyone waiting, in order
+    std::pair<optional<HoldQueues::Ready>, vector<HoldQueues::Waiter>> holdsFor(int itemId) {
+        auto hl = holds_.lock(itemId);
+        return {holds_.ready(itemId), holds_.waiting(itemId)};
+    }
+
+    // where borrow/return/... record what they did; nullptr (the default) records nothing
+    void setEventLog(EventLog* events) { events_ = events; }
+
+    // Journal appends made by this thread while the returned scope lives do
+    // not wait for their group commit; leaving the scope waits once for all.
+    Journal::Deferred deferDurability() { return Journal::Deferred(journal_); }
+
+    // Recovers state from the journal's directory, then logs every further
+    // mutation to it. A snapshot is taken in the background every
+    // snapshotEvery entries (0 = only on explicit checkpoint()).
+    size_t attachJournal(Journal& journal, size_t snapshotEvery = 100000) {
+        size_t n = journal.recover([this](WalOp op, ByteReader& r) { apply(op, r); });
+        // borrow counters and circulation figures are derived state: rebuild
+        // them from the records (and the fines still inside the windows)
+        unordered_map<int, int> active;
+        auto now = clock_.now();
+        auto recent = now - hours(24 * CirculationStats::kDays);
+        circulation_.clear();
+        records_.forEach([&](const BorrowRecord& rec) {
+            if (rec.isOpen()) ++active[rec.userId()];
+            if (!rec.isOpen() && std::max(rec.borrowAt(), rec.returnedAt()) < recent) return;
+            if (auto kind = items_.kindOf(rec.itemId())) circulation_.restore(*kind, rec, now);
+        });
+        for (auto f : fines_.all())
+            if (f->appliedAt() >= recent) circulation_.fined(f->itemId(), f->amount(), f->appliedAt());
+        for (auto& user : users_.all()) {
+            auto it = active.find(user->id());
+            user->restoreActiveBorrows(it == active.end() ? 0 : it->second);
+        }
+        journal.open();
+        journal_ = &journal;
+        snapshotEvery_ = snapshotEvery;
+        return n;
+    }
+
+    // Folds the current state into a snapshot and drops the WAL it covers.
+    void checkpoint() {
+        if (!journal_) return;
+        std::lock_guard<std::mutex> l(checkpointMtx_);
+        uint64_t firstGen = journal_->rotate();
+        journal_->writeSnapshot(firstGen, [this](const std::function<void(WalOp, const string&)>& emit) {
+            // items, records and fines from one snapshot, so they agree with
+            // each other and writers running meanwhile wait for none of it
+            auto view = snapshot();
+            // catalog-backed items only need saving once they have been touched
+            auto resident = view.residentItems();
+            // id order keeps replay appending to the search index's posting lists
+            std::sort(resident.begin(), resident.end(), [](auto& a, auto& b) { return a.item->id() < b.item->id(); });
+            for (auto& v : resident) emit(WalOp::SaveItem, encodeItem(*v.item, v.state.status));
+            for (auto& user : users_.all()) emit(WalOp::SaveUser, encodeUser(*user));
+            view.forEachRecord([&](const BorrowRecord& rec) {
+                emit(WalOp::Borrow, encodeRecord(rec));
+                if (rec.isOpen() && rec.finedDays() > 0) emit(WalOp::Overdue, encodeIds(rec.id(), rec.finedDays()));
+            });
+            view.forEachFine([&](const Fine& fine) { emit(WalOp::Fine, encodeFine(fine)); });
+            for (auto& [userId, acc] : view.settledAccounts()) emit(WalOp::Settle, encodeSettled(userId, acc));
+            // reserving users and waiters are not part of the item encoding
+            for (auto& v : resident)
+                if (v.state.status == AvailabilityStatus::RESERVED) emit(WalOp::Reserve, encodeIds(v.item->id(), v.state.reservedBy));
+            holds_.forEach([&](int itemId, const optional<HoldQueues::Ready>& ready, const vector<HoldQueues::Waiter>& queue) {
+                if (ready) emit(WalOp::HoldReady, encodeReady(itemId, ready->userId, ready->until));
+                for (auto& w : queue) emit(WalOp::Hold, encodeHold(itemId, w.userId, w.priority));
+            });
+            if (int64_t ns = clockOffset_.load(std::memory_order_relaxed)) {
+                ByteWriter w;
+                emit(WalOp::ClockOffset, w.i64(ns).bytes());
+            }
+        });
+    }
+
+    // With --clock sim: how far the simulated clock has been advanced past
+    // wall time. Journalled so that a restart can resume at the same offset
+    // instead of falling back to wall time; offsets only grow.
+    void recordClockOffset(system_clock::duration offset) {
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(offset).count();
+        int64_t cur = clockOffset_.load(std::memory_order_relaxed);
+        while (ns > cur && !clockOffset_.compare_exchange_weak(cur, ns, std::memory_order_relaxed)) {}
+        ByteWriter w;
+        log(WalOp::ClockOffset, w.i64(ns).bytes());
+    }
+
+    // the largest offset recorded or recovered
+    system_clock::duration clockOffset() const {
+        return std::chrono::duration_cast<system_clock::duration>(
+            std::chrono::nanoseconds(clockOffset_.load(std::memory_order_relaxed)));
+    }
+
+    void addItem(shared_ptr<Item> item) {
+        items_.save(item, item->id());
+        log(WalOp::SaveItem, encodeItem(*item));
+    }
+
+    // a re-saved user keeps the borrows they already hold
+    void addUser(shared_ptr<User> user) {
+        users_.replace(user);
+        log(WalOp::SaveUser, encodeUser(*user));
+    }
+
+    // bulk variants: one repo lock and one journal append per batch
+    void addItems(const vector<shared_ptr<Item>>& items) {
+        items_.saveAll(items);
+        vector<std::pair<WalOp, string>> entries;
+        if (journal_) for (auto& item : items) entries.emplace_back(WalOp::SaveItem, encodeItem(*item));
+        log(entries);
+    }
+
+    void addUsers(const vector<shared_ptr<User>>& users) {
+        users_.replaceAll(users);
+        vector<std::pair<WalOp, string>> entries;
+        if (journal_) for (auto& user : users) entries.emplace_back(WalOp::SaveUser, encodeUser(*user));
+        log(entries);
+    }
+
+    // the returned record is owned by the repo and stays valid for its lifetime
+    const BorrowRecord* borrowItem(int userId, int itemId, const string& durationStr) {
+        metrics::OpTimer timer(metrics::Op::Borrow);
+        auto userOpt = users_.findById(userId);
+        if (!userOpt) throw NotFoundException("User not found");
+        if (fineLimit_) {
+            Money owed = fines_.balance(userId);
+            if (owed > *fineLimit_) throw BorrowException("Outstanding fines of " + owed.str() + " exceed the limit");
+        }
+        auto itemOpt = items_.findById(itemId);
+        if (!itemOpt) throw NotFoundException("Item not found");
+        auto item = *itemOpt;
+
+        BorrowDuration bd = BorrowDuration::parse(durationStr);
+        system_clock::time_point now = clock_.now();
+        system_clock::time_point due = bd.computeDueAt(now);
+        if (due <= now) throw InvalidInputException("Computed due date must be in the future");
+        expireHolds(now);
+
+        // the user's slot is taken first; undo hands it back (and the item,
+        // once taken) unless the borrow is committed
+        WriteScope scope(*this);
+        auto order = logOrder(itemId);
+        if (!users_.tryAcquireBorrow(userId))
+            throw BorrowException("Borrow limit of " + to_string((*userOpt)->borrowLimit()) + " reached");
+        BorrowUndo undo(*this, userId, *item);
+        // allow borrow if AVAILABLE or RESERVED by same user; taking it
+        // consumes the reservation in the same step
+        for (ItemState st = item->state();;) {
+            if (st.status == AvailabilityStatus::BORROWED || st.status == AvailabilityStatus::MAINTENANCE)
+                throw ItemNotAvailableException("Item not available for borrowing");
+            if (st.status == AvailabilityStatus::RESERVED && st.reservedBy != userId)
+                throw ItemNotAvailableException("Item reserved by another user");
+            // picking up a hold: the hold ends with the change, not after it
+            std::unique_lock<std::mutex> hl;
+            if (st.status == AvailabilityStatus::RESERVED) hl = holds_.lock(itemId);
+            if (items_.changeState(*item, [&] { return item->transition(st, {AvailabilityStatus::BORROWED}); })) {
+                undo.was = st;
+                if (hl) {
+                    undo.hold = holds_.ready(itemId);
+                    holds_.clearReady(itemId);
+                }
+                break;
+            }
+        }
+        undo.rec = records_.add(itemId, userId, now, due);
+        log(WalOp::Borrow, encodeRecord(*undo.rec));
+        undo.committed = true;
+        event(EventKind::Borrowed, userId, itemId, 0, due, now);
+        circulation_.borrowed(item->kind(), itemId, now);
+        return undo.rec;
+    }
+
+    void returnItem(int userId, int itemId) {
+        metrics::OpTimer timer(metrics::Op::Return);
+        auto userOpt = users_.findById(userId);
+        if (!userOpt) throw NotFoundException("User not found");
+        auto itemOpt = items_.findById(itemId);
+        if (!itemOpt) throw NotFoundException("Item not found");
+        auto item = *itemOpt;
+        expireHolds(clock_.now());
+
+        WriteScope scope(*this);
+        auto order = logOrder(itemId);
+        auto rec = records_.findActiveByItemId(itemId);
+        if (!rec) throw ReturnException("No active borrow record for item");
+        if (rec->userId() != userId) throw ReturnException("Borrow record user mismatch");
+        // only one of several concurrent returns gets to close the record
+        auto now = clock_.now();
+        if (!records_.markReturned(*rec, now)) throw ReturnException("No active borrow record for item");
+        users_.releaseBorrow(userId);
+
+        // days the nightly sweep already charged are not charged again
+        int overdueDays = rec->overdueDays(now) - rec->finedDays();
+        if (overdueDays > 0) {
+            Money fineAmount = dailyFineRate_ * overdueDays;
+            auto fine = fines_.addFine(itemId, userId, fineAmount, FineReason::Overdue, overdueDays, now);
+            log(WalOp::Fine, encodeFine(*fine));
+            event(EventKind::FineApplied, userId, itemId, fine->amount().paise(), {}, now);
+            circulation_.fined(itemId, fine->amount(), now);
+        }
+
+        // logged before the item frees up, so a following borrow's entry comes after it
+        ByteWriter ret;
+        log(WalOp::Return, ret.i32(rec->id()).time(now).bytes());
+        event(EventKind::Returned, userId, itemId, 0, {}, now);
+        circulation_.returned(item->kind(), itemId, now - rec->borrowAt(), now);
+        // the first waiter gets it; an item archived while out stays in maintenance
+        vector<HoldNotice> ready;
+        {
+            auto hl = holds_.lock(itemId);
+            passOn(*item, {AvailabilityStatus::BORROWED}, now, ready);
+        }
+        notify(ready);
+    }
+
+    // renew borrow: only allowed if record exists, same user, not overdue
+    system_clock::time_point renewBorrow(int userId, int itemId, const string& extraDurationStr) {
+        metrics::OpTimer timer(metrics::Op::Renew);
+        BorrowDuration extra = BorrowDuration::parse(extraDurationStr);
+
+        // the records repo checks and extends the record in one step; the
+        // logOrder lock only keeps the journal entry in step with it
+        WriteScope scope(*this);
+        auto order = logOrder(itemId);
+        auto rec = records_.findActiveByItemId(itemId);
+        if (!rec) throw BorrowException("No active borrow record to renew");
+        system_clock::time_point newDue;
+        switch (records_.renew(*rec, userId, clock_.now(), extra, newDue)) {
+        case BorrowRecordRepo::Renewal::Renewed: break;
+        case BorrowRecordRepo::Renewal::Closed: throw BorrowException("No active borrow record to renew");
+        case BorrowRecordRepo::Renewal::OtherUser: throw BorrowException("Only borrowing user can renew");
+        case BorrowRecordRepo::Renewal::Overdue: throw BorrowException("Cannot renew overdue borrow");
+        case BorrowRecordRepo::Renewal::NotLater: throw InvalidInputException("New due must be after current due date");
+        }
+        ByteWriter w;
+        log(WalOp::Renew, w.i32(rec->id()).time(newDue).bytes());
+        event(EventKind::Renewed, userId, itemId, 0, newDue);
+        return newDue;
+    }
+
+    // Reserves item for user: at once if it is available (the hold is then
+    // ready until the pickup window ends), otherwise by joining the item's
+    // queue, ahead of everyone with a lower priority. Returns the place in
+    // the queue, or 0 if the item is now reserved for the user.
+    size_t reserveItem(int userId, int itemId, int priority = 0) {
+        metrics::OpTimer timer(metrics::Op::Reserve);
+        auto now = clock_.now();
+        expireHolds(now);
+        auto userOpt = users_.findById(userId);
+        if (!userOpt) throw NotFoundException("User not found");
+        auto itemOpt = items_.findById(itemId);
+        if (!itemOpt) throw NotFoundException("Item not found");
+        auto item = *itemOpt;
+        WriteScope scope(*this);
+        auto order = logOrder(itemId);
+        auto hl = holds_.lock(itemId);
+        for (ItemState st = item->state();;) {
+            if (st.status == AvailabilityStatus::MAINTENANCE) throw BorrowException("Item is in maintenance");
+            if (st.status == AvailabilityStatus::RESERVED && st.reservedBy == userId)
+                throw BorrowException("Item already reserved by this user");
+            if (st.status != AvailabilityStatus::AVAILABLE) break;
+            if (!items_.changeState(*item, [&] { return item->transition(st, {AvailabilityStatus::RESERVED, userId}); }))
+                continue;
+            auto until = now + pickupWindow_;
+            holdReady(itemId, userId, until);
+            log(WalOp::HoldReady, encodeReady(itemId, userId, until));
+            event(EventKind::Reserved, userId, itemId, 0, until, now);
+            return 0;
+        }
+        auto rec = records_.findActiveByItemId(itemId);
+        if (rec && rec->userId() == userId) throw BorrowException("Item already borrowed by this user");
+        size_t place = holds_.enqueue(itemId, userId, priority);
+        if (!place) throw BorrowException("Already waiting for this item");
+        log(WalOp::Hold, encodeHold(itemId, userId, priority));
+        event(EventKind::HoldQueued, userId, itemId, 0, {}, now);
+        return place;
+    }
+
+    // Drops user's hold on item: the reservation, which then goes to the
+    // next waiter, or the user's place in the queue.
+    void cancelReservation(int userId, int itemId) {
+        metrics::OpTimer timer(metrics::Op::Cancel);
+        auto now = clock_.now();
+        expireHolds(now);
+        auto itemOpt = items_.findById(itemId);
+        if (!itemOpt) throw BorrowException("No reservation found for item");
+        vector<HoldNotice> ready;
+        {
+            WriteScope scope(*this);
+            auto order = logOrder(itemId);
+            auto hl = holds_.lock(itemId);
+            ItemState st = (*itemOpt)->state();
+            if (st.status == AvailabilityStatus::RESERVED && st.reservedBy == userId) {
+                log(WalOp::Cancel, encodeIds(itemId));
+                event(EventKind::ReservationCancelled, userId, itemId);
+                holds_.clearReady(itemId);
+                if (!passOn(**itemOpt, st, now, ready)) throw BorrowException("No reservation found for item");
+            } else if (holds_.leave(itemId, userId)) {
+                log(WalOp::Unhold, encodeIds(itemId, userId));
+                event(EventKind::ReservationCancelled, userId, itemId);
+            } else if (st.status == AvailabilityStatus::RESERVED) {
+                throw BorrowException("Only reserving user can cancel reservation");
+            } else {
+                throw BorrowException("No reservation found for item");
+            }
+        }
+        notify(ready);
+    }
+
+    struct SweepReport {
+        size_t open = 0;       // open borrow records looked at
+        size_t charged = 0;    // records that accrued a fine
+        Money amount;          // total charged
+        double seconds = 0;
+    };
+
+    // Nightly job: marks every open borrow that is past due as OVERDUE and
+    // charges the overdue days not yet fined, so balances and notices are
+    // current without waiting for the return. The record slabs are shared
+    // out block by block to a work-stealing pool; every worker uses the
+    // same clock reading and adds a block's fines (and journal entries) as
+    // one batch, in the same epoch as the records' new state, so snapshots
+    // never see one without the other. A block is scanned first and its
+    // records charged only under their items' logOrder locks, so returnItem
+    // later charges exactly the days the sweep has not.
+    SweepReport sweepOverdue(unsigned threads = std::max(1u, std::thread::hardware_concurrency())) {
+        auto t0 = std::chrono::steady_clock::now();
+        auto now = clock_.now();
+        struct Worker {
+            vector<BorrowRecordRepo::Accrual> pending;
+            SweepReport report;
+        };
+        threads = std::max(1u, threads);
+        vector<Worker> workers(threads);
+        auto commit = [&](Worker& w) {
+            if (w.pending.empty()) return;
+            // under the items' logOrder locks, like returnItem, so a record's
+            // charge and its fine are logged in order with a return of it
+            vector<int> itemIds;
+            itemIds.reserve(w.pending.size());
+            for (auto& a : w.pending) itemIds.push_back(a.itemId);
+            auto orders = logOrders(itemIds);
+            records_.chargeOverdue(w.pending);
+            if (w.pending.empty()) return;
+            vector<Fine> batch;
+            batch.reserve(w.pending.size());
+            for (auto& a : w.pending)
+                batch.emplace_back(0, a.itemId, a.userId, dailyFineRate_ * a.days, FineReason::Overdue, a.days, now);
+            auto added = fines_.addFines(batch);
+            vector<std::pair<WalOp, string>> entries;
+            for (size_t i = 0; i < added.size(); ++i) {
+                auto& a = w.pending[i];
+                w.report.amount = w.report.amount + added[i]->amount();
+                if (journal_) {
+                    entries.emplace_back(WalOp::Overdue, encodeIds(a.recordId, a.finedDays));
+                    entries.emplace_back(WalOp::Fine, encodeFine(*added[i]));
+                }
+                event(EventKind::FineApplied, a.userId, a.itemId, added[i]->amount().paise(), {}, now);
+                circulation_.fined(a.itemId, added[i]->amount(), now);
+            }
+            log(entries);
+            w.report.charged += added.size();
+            w.pending.clear();
+        };
+        forEachStealing(records_.sweepBlocks(), threads, [&](size_t block, unsigned me) {
+            Worker& w = workers[me];
+            WriteScope scope(*this);
+            w.report.open += records_.sweepBlock(block, now, w.pending);
+            commit(w);
+        });
+        SweepReport total;
+        for (auto& w : workers) {
+            total.open += w.report.open;
+            total.charged += w.report.charged;
+            total.amount = total.amount + w.report.amount;
+        }
+        total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        return total;
+    }
+
+    // copies of the borrow records overdue now; reports that must agree with
+    // other reads take them from a snapshot (ReadView::overdue) instead
+    vector<BorrowRecord> listOverdueRecords() const {
+        return records_.findOverdue(clock_.now());
+    }
+
+    // overdue records not yet seen through this cursor (incremental alerting)
+    vector<const BorrowRecord*> listNewlyOverdue(OverdueCursor& cursor) const {
+        return records_.findOverdueSince(cursor, clock_.now());
+    }
+
+    // get active borrows for a user
+    vector<const BorrowRecord*> getActiveBorrowsForUser(int userId) const {
+        return records_.findActiveByUserId(userId);
+    }
+
+    // get fines for a user
+    vector<const Fine*> getFinesForUser(int userId) const {
+        return fines_.findByUserId(userId);
+    }
+
+    // what the user still owes: fines charged minus payments and waivers
+    Money getOutstandingBalance(int userId) const {
+        return fines_.balance(userId);
+    }
+
+    // pays (or waives) part of a user's outstanding fines; returns the new balance
+    Money settleFines(int userId, Money amount, bool waive = false) {
+        if (!users_.findById(userId)) throw NotFoundException("User not found");
+        WriteScope scope(*this);
+        auto order = logOrder(userId);
+        auto acc = fines_.settle(userId, amount, waive);
+        log(WalOp::Settle, encodeSettled(userId, acc));
+        event(waive ? EventKind::FineWaived : EventKind::FinePaid, userId, 0, amount.paise());
+        return acc.outstanding();
+    }
+
+    // users with the largest outstanding balances, largest first
+    vector<std::pair<int, Money>> topDebtors(size_t n) const {
+        return fines_.topDebtors(n);
+    }
+
+    // borrows, returns, loan lengths and fines of the last `days` days (at
+    // most CirculationStats::kDays); read from running totals, no scans
+    CirculationStats::Window circulation(int days) {
+        return circulation_.window(days, clock_.now());
+    }
+
+    // the n most borrowed items this week and last, most borrowed first
+    vector<CirculationStats::Popular> popularItems(size_t n) {
+        return circulation_.top(n, clock_.now());
+    }
+
+    // items of kind out on loan now, and how many items of that kind there are
+    std::pair<int64_t, size_t> utilization(ItemKind kind) {
+        ItemFilter f;
+        f.kind = kind;
+        return {circulation_.onLoan(kind), items_.countWhere(f)};
+    }
+
+    vector<shared_ptr<const Item>> searchByType(const string& typeName) {
+        return items_.findByType(typeName);
+    }
+
+    // ids (in no particular order) of the items matching f, and how many
+    // there are; both come from the item columns without reading any item
+    vector<int> filterItems(const ItemFilter& f) {
+        return items_.idsWhere(f);
+    }
+    size_t countItems(const ItemFilter& f) {
+        return items_.countWhere(f);
+    }
+
+    // keyword search over titles and authors (all words must match, "word*"
+    // matches a prefix), optionally narrowed to one kind and to AVAILABLE
+    // items; availability is read from the item columns, and catalog items
+    // are not read out into the repo
+    vector<shared_ptr<const Item>> searchItems(const string& query, optional<ItemKind> kind = nullopt,
+                                               bool availableOnly = false, size_t limit = 50) {
+        metrics::OpTimer timer(metrics::Op::Search);
+        vector<shared_ptr<const Item>> res;
+        ItemFilter f;
+        if (availableOnly) f.status = AvailabilityStatus::AVAILABLE;
+        int after = std::numeric_limits<int>::min();
+        size_t page = std::max<size_t>(limit * 4, 256);
+        while (res.size() < limit) {
+            auto ids = items_.search(query, kind, after, page);
+            for (int id : ids) {
+                auto item = items_.peek(id, f);
+                if (!item) continue;
+                res.push_back(move(item));
+                if (res.size() == limit) break;
+            }
+            if (ids.size() < page) break;
+            after = ids.back();
+        }
+        return res;
+    }
+
+    // indexed words that start with prefix, most common first
+    vector<string> completeKeyword(const string& prefix, size_t limit = 10) {
+        vector<string> res;
+        for (auto& c : items_.completions(prefix, limit)) res.push_back(c.first);
+        return res;
+    }
+
+    void archiveMagazine(int itemId) {
+        auto itemOpt = items_.findById(itemId);
+        if (!itemOpt) throw NotFoundException("Item not found");
+        auto it = *itemOpt;
+        auto mag = std::dynamic_pointer_cast<EMagazine>(it);
+        if (!mag) throw ArchiveException("Item is not an EMagazine");
+        WriteScope scope(*this);
+        auto order = logOrder(itemId);
+        auto hl = holds_.lock(itemId);
+        items_.changeState(*mag, [&] { mag->archiveIssue(); });
+        log(WalOp::Archive, encodeIds(itemId));
+        event(EventKind::Archived, 0, itemId);
+        // archived issues never come back, so nobody waits for them
+        if (auto held = holds_.ready(itemId)) event(EventKind::ReservationCancelled, held->userId, itemId);
+        holds_.clearReady(itemId);
+        for (auto& w : holds_.clear(itemId)) event(EventKind::ReservationCancelled, w.userId, itemId);
+    }
+};
+
+
+/* ---------- Bulk import (CSV / JSONL) ---------- */
+
+// Streams a feed of items and users into the library. The input is read in
+// chunks cut at line boundaries; chunks are parsed on worker threads and
+// inserted in file order with one repo lock per chunk. A bad row is recorded
+// and skipped, it never aborts the import.
+//
+// CSV, one record per line (quoted fields allowed, no embedded newlines):
+//   Book,<id>,<title>,<author;author>,<pages>
+//   Audiobook,<id>,<title>,<authors>,<hours>,<narrator>
+//   EMagazine,<id>,<title>,<authors>,<issue>[,<YYYY-MM-DD>]
+//   User,<id>,<name>,<borrowLimit>
+// JSONL, one flat object per line:
+//   {"kind":"Book","id":1,"title":"...","authors":["..."],"pages":120}
+//   keys: hours/narrator (Audiobook), issue/issueDate (EMagazine), name/limit (User)
+class BulkImporter {
+public:
+    enum class Format { Csv, Jsonl };
+
+    struct RowError {
+        size_t line;
+        string message;
+    };
+
+    struct Stats {
+        size_t rows = 0, items = 0, users = 0, failed = 0;
+        vector<RowError> errors;   // first maxErrors failures, in file order
+        double seconds = 0;
+        double rowsPerSecond() const { return seconds > 0 ? rows / seconds : 0; }
+    };
+
+    static Format formatFor(const string& path) {
+        auto dot = path.rfind('.');
+        string ext = dot == string::npos ? "" : path.substr(dot + 1);
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+        return (ext == "jsonl" || ext == "json" || ext == "ndjson") ? Format::Jsonl : Format::Csv;
+    }
+
+private:
+    // one parsed row before it becomes an entity
+    struct Row {
+        string kind;
+        string id;
+        string title;            // title, or name for users
+        vector<string> authors;
+        string a, b;             // kind-specific: pages | hours,narrator | issue,date | limit
+    };
+
+    struct Chunk {
+        vector<shared_ptr<Item>> items;
+        vector<shared_ptr<User>> users;
+        vector<RowError> errors;
+        size_t rows = 0;
+    };
+
+    LibraryService& lib_;
+    unsigned threads_;
+    size_t chunkBytes_;
+    size_t maxErrors_;
+
+    static std::string_view trim(std::string_view s) {
+        size_t a = s.find_first_not_of(" \t\r");
+        if (a == std::string_view::npos) return {};
+        return s.substr(a, s.find_last_not_of(" \t\r") - a + 1);
+    }
+
+    static int toInt(const string& s, const char* field) {
+        auto v = trim(s);
+        int out = 0;
+        auto res = std::from_chars(v.data(), v.data() + v.size(), out);
+        if (v.empty() || res.ec != std::errc() || res.ptr != v.data() + v.size())
+            throw InvalidInputException(string("Invalid ") + field + " '" + s + "'");
+        return out;
+    }
+
+    static vector<string> splitCsv(std::string_view line) {
+        vector<string> fields(1);
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); ++i) {
+            char c = line[i];
+            if (quoted) {
+                if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') { fields.back() += '"'; ++i; }
+                else if (c == '"') quoted = false;
+                else fields.back() += c;
+            } else if (c == '"') {
+                quoted = true;
+            } else if (c == ',') {
+                fields.emplace_back();
+            } else {
+                fields.back() += c;
+            }
+        }
+        if (quoted) throw InvalidInputException("Unterminated quoted field");
+        for (auto& f : fields) f = string(trim(f));
+        return fields;
+    }
+
+    static Row parseCsv(std::string_view line) {
+        auto f = splitCsv(line);
+        Row r;
+        r.kind = f[0];
+        size_t need = r.kind == "User" ? 4 : 5;
+        if (f.size() < need) throw InvalidInputException("Expected at least " + to_string(need) + " fields, got " + to_string(f.size()));
+        r.id = f[1];
+        r.title = f[2];
+        if (r.kind == "User") { r.a = f[3]; return r; }
+        std::string_view authors = f[3];
+        while (!authors.empty()) {
+            size_t cut = authors.find(';');
+            auto a = trim(authors.substr(0, cut));
+            if (!a.empty()) r.authors.emplace_back(a);
+            if (cut == std::string_view::npos) break;
+            authors.remove_prefix(cut + 1);
+        }
+        r.a = f[4];
+        if (f.size() > 5) r.b = f[5];
+        return r;
+    }
+
+    // Minimal reader for flat JSON objects whose values are strings, integers
+    // or arrays of strings.
+    class JsonLine {
+        std::string_view s_;
+        size_t p_ = 0;
+        void ws() { while (p_ < s_.size() && std::isspace(static_cast<unsigned char>(s_[p_]))) ++p_; }
+        [[noreturn]] void fail(const char* what) const { throw InvalidInputException(string("Malformed JSON: ") + what); }
+        void expect(char c) { ws(); if (p_ >= s_.size() || s_[p_] != c) fail("unexpected character"); ++p_; }
+        static void utf8(string& out, unsigned cp) {
+            if (cp < 0x80) out += static_cast<char>(cp);
+            else if (cp < 0x800) { out += static_cast<char>(0xC0 | (cp >> 6)); out += static_cast<char>(0x80 | (cp & 0x3F)); }
+            else {
+                out += static_cast<char>(0xE0 | (cp >> 12));
+                out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+                out += static_cast<char>(0x80 | (cp & 0x3F));
+            }
+        }
+    public:
+        explicit JsonLine(std::string_view s) : s_(s) {}
+        string str() {
+            expect('"');
+            string out;
+            while (p_ < s_.size() && s_[p_] != '"') {
+                char c = s_[p_++];
+                if (c != '\\') { out += c; continue; }
+                if (p_ >= s_.size()) fail("bad escape");
+                char e = s_[p_++];
+                switch (e) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    if (p_ + 4 > s_.size()) fail("bad \\u escape");
+                    unsigned cp = 0;
+                    for (int k = 0; k < 4; ++k) {
+                        char h = s_[p_++];
+                        cp <<= 4;
+                        if (h >= '0' && h <= '9') cp |= h - '0';
+                        else if (h >= 'a' && h <= 'f') cp |= h - 'a' + 10;
+                        else if (h >= 'A' && h <= 'F') cp |= h - 'A' + 10;
+                        else fail("bad \\u escape");
+                    }
+                    utf8(out, cp);
+                    break;
+                }
+                default: out += e;
+                }
+            }
+            if (p_ >= s_.size()) fail("unterminated string");
+            ++p_;
+            return out;
+        }
+        // value as text; arrays are returned through arr
+        string value(vector<string>& arr) {
+            ws();
+            if (p_ >= s_.size()) fail("missing value");
+            if (s_[p_] == '"') return str();
+            if (s_[p_] == '[') {
+                ++p_; ws();
+                if (p_ < s_.size() && s_[p_] == ']') { ++p_; return {}; }
+                while (true) {
+                    arr.push_back(str());
+                    ws();
+                    if (p_ < s_.size() && s_[p_] == ',') { ++p_; continue; }
+                    expect(']');
+                    return {};
+                }
+            }
+            size_t start = p_;
+            while (p_ < s_.size() && s_[p_] != ',' && s_[p_] != '}' && !std::isspace(static_cast<unsigned char>(s_[p_]))) ++p_;
+            if (p_ == start) fail("missing value");
+            return string(s_.substr(start, p_ - start));
+        }
+        template<typename Fn>
+        void object(Fn&& field) {
+            expect('{');
+            ws();
+            if (p_ < s_.size() && s_[p_] == '}') { ++p_; return; }
+            while (true) {
+                string key = str();
+                expect(':');
+                vector<string> arr;
+                string v = value(arr);
+                field(key, move(v), move(arr));
+                ws();
+                if (p_ < s_.size() && s_[p_] == ',') { ++p_; continue; }
+                expect('}');
+                ws();
+                if (p_ != s_.size()) fail("trailing characters");
+                return;
+            }
+        }
+    };
+
+    static Row parseJson(std::string_view line) {
+        Row r;
+        JsonLine(line).object([&](const string& key, string v, vector<string> arr) {
+            if (key == "kind" || key == "type") r.kind = move(v);
+            else if (key == "id") r.id = move(v);
+            else if (key == "title" || key == "name") r.title = move(v);
+            else if (key == "authors") r.authors = move(arr);
+            else if (key == "pages" || key == "hours" || key == "issue" || key == "limit") r.a = move(v);
+            else if (key == "narrator" || key == "issueDate") r.b = move(v);
+        });
+        return r;
+    }
+
+    static system_clock::time_point parseDate(const string& d, system_clock::time_point now) {
+        if (d.empty()) return now;
+        std::tm t = {};
+        std::istringstream ss(d);
+        ss >> std::get_time(&t, "%Y-%m-%d");
+        if (ss.fail()) throw InvalidInputException("Invalid issue date '" + d + "'");
+        return system_clock::from_time_t(std::mktime(&t));
+    }
+
+    // constructors run validate()
+    static void build(Row& r, Chunk& out, system_clock::time_point now) {
+        int id = toInt(r.id, "id");
+        if (r.kind == "User") {
+            out.users.push_back(make_shared<User>(id, move(r.title), toInt(r.a, "borrow limit")));
+            return;
+        }
+        if (r.title.empty()) throw InvalidInputException("Missing title");
+        if (r.kind == "Book") {
+            out.items.push_back(make_shared<Book>(id, move(r.title), r.authors, toInt(r.a, "page count")));
+        } else if (r.kind == "Audiobook") {
+            out.items.push_back(make_shared<Audiobook>(id, move(r.title), r.authors, hours(toInt(r.a, "hours")), move(r.b)));
+        } else if (r.kind == "EMagazine") {
+            out.items.push_back(make_shared<EMagazine>(id, move(r.title), r.authors, toInt(r.a, "issue number"), parseDate(r.b, now)));
+        } else {
+            throw InvalidInputException("Unknown record kind '" + r.kind + "'");
+        }
+    }
+
+    // now: the issue date of magazines that give none
+    static Chunk parseChunk(const string& text, size_t firstLine, Format fmt, system_clock::time_point now) {
+        Chunk out;
+        std::string_view rest(text);
+        size_t line = firstLine;
+        for (; !rest.empty(); ++line) {
+            size_t nl = rest.find('\n');
+            auto raw = trim(rest.substr(0, nl));
+            rest = nl == std::string_view::npos ? std::string_view() : rest.substr(nl + 1);
+            if (raw.empty() || raw[0] == '#') continue;
+            if (fmt == Format::Csv && line == 1 && raw.substr(0, 4) == "kind") continue;   // header
+            ++out.rows;
+            try {
+                Row r = fmt == Format::Csv ? parseCsv(raw) : parseJson(raw);
+                build(r, out, now);
+            } catch (const std::exception& e) {
+                out.errors.push_back({line, e.what()});
+            }
+        }
+        return out;
+    }
+
+public:
+    // one row in the CSV feed layout, built into either an item or a user
+    struct Record {
+        shared_ptr<Item> item;
+        shared_ptr<User> user;
+    };
+
+    static Record parseRecord(std::string_view csvRow, system_clock::time_point now) {
+        Row r = parseCsv(csvRow);
+        Chunk c;
+        build(r, c, now);
+        if (!c.items.empty()) return {c.items.front(), nullptr};
+        return {nullptr, c.users.front()};
+    }
+
+    explicit BulkImporter(LibraryService& lib, unsigned threads = std::thread::hardware_concurrency(),
+                          size_t chunkBytes = 4u << 20, size_t maxErrors = 1000)
+      : lib_(lib), threads_(std::max(1u, threads)), chunkBytes_(chunkBytes), maxErrors_(maxErrors) {}
+
+    Stats import(std::istream& in, Format fmt) {
+        Stats stats;
+        auto t0 = std::chrono::steady_clock::now();
+        std::deque<std::future<Chunk>> inflight;
+        string carry;
+        size_t nextLine = 1;
+        auto now = lib_.clock().now();
+
+        auto drainOne = [&] {
+            Chunk c = inflight.front().get();
+            inflight.pop_front();
+            lib_.addItems(c.items);
+            lib_.addUsers(c.users);
+            stats.rows += c.rows;
+            stats.items += c.items.size();
+            stats.users += c.users.size();
+            stats.failed += c.errors.size();
+            for (auto& e : c.errors) {
+                if (stats.errors.size() >= maxErrors_) break;
+                stats.errors.push_back(move(e));
+            }
+        };
+
+        string buf(chunkBytes_, '\0');
+        while (in) {
+            in.read(&buf[0], static_cast<std::streamsize>(buf.size()));
+            size_t got = static_cast<size_t>(in.gcount());
+            if (got == 0) break;
+            string text = move(carry);
+            text.append(buf, 0, got);
+            size_t cut = text.rfind('\n');
+            if (cut == string::npos && in) { carry = move(text); continue; }
+            if (cut != string::npos && in) { carry = text.substr(cut + 1); text.resize(cut + 1); }
+            size_t first = nextLine;
+            nextLine += static_cast<size_t>(std::count(text.begin(), text.end(), '\n'));
+            inflight.push_back(std::async(std::launch::async, [text = move(text), first, fmt, now] {
+                return parseChunk(text, first, fmt, now);
+            }));
+            if (inflight.size() >= threads_) drainOne();
+        }
+        if (!carry.empty()) {
+            size_t first = nextLine;
+            inflight.push_back(std::async(std::launch::async, [text = move(carry), first, fmt, now] {
+                return parseChunk(text, first, fmt, now);
+            }));
+        }
+        while (!inflight.empty()) drainOne();
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        return stats;
+    }
+};
+
+
+/* ---------- Headless batch commands ---------- */
+
+// Runs a stream of commands against the library without the menu, one per line:
+//   borrow <user> <item> <duration>      renew <user> <item> <duration>
+//   return <user> <item>                 reserve <user> <item> [<priority>]
+//   cancel <user> <item>                 archive <item>
+//   holds <item>
+//   search [kind=<Book|Audiobook|EMagazine>] [available] [limit=<n>] <words>
+//   type <Book|Audiobook|EMagazine> [<filter>...]
+//   count [<kind>] [<filter>...]         complete <prefix>
+//   borrows <user>                       fines <user>
+//   circulation [<days>]                 popular <n>
+//   overdue                              metrics
+//   add <row in the --import CSV layout>, e.g. add Book,301,Refactoring,Fowler,448
+// Blank lines and lines starting with '#' are skipped. Every command yields one
+// result line, "<line> ok[ <detail>]" or "<line> error <message>". The detail is
+// the due time in unix seconds for borrow/renew, item ids for search/type/borrows,
+// <item>:<user> pairs for overdue, <item>:<paise> pairs for fines and words for
+// complete. type/count filters are available|borrowed|reserved|maintenance and
+// archived|current; type answers ascending ids, count the number of items.
+// reserve answers the place in the item's queue, or nothing if the item is now
+// held for the user; holds answers ready=<user>:<until> and the waiting users.
+// circulation answers key=value figures for the window and, per kind,
+// <Kind>=<borrows>/<out now>/<items>; popular answers <item>:<borrows> pairs.
+// metrics answers with the multi-line Prometheus dump (meant for --serve).
+//
+// Input is cut into batches of lines. A batch is parsed on a worker thread
+// while the one before it executes; commands run strictly in input order, and
+// a batch's results are written in one piece once its journal entries are durable.
+class BatchRunner {
+public:
+    struct Stats {
+        size_t commands = 0, failed = 0;
+        double seconds = 0;
+        double commandsPerSecond() const { return seconds > 0 ? commands / seconds : 0; }
+    };
+
+private:
+    enum class Op : uint8_t { Borrow, Return, Renew, Reserve, Cancel, Archive, Search, Type, Count, Complete,
+                              Borrows, Fines, Balance, Pay, Waive, Debtors, Overdue, Sweep, Metrics, Advance, Add,
+                              Holds, Circulation, Popular };
+
+    struct Command {
+        size_t line = 0;
+        Op op = Op::Borrow;
+        int user = 0, item = 0;
+        int amount = 0;              // paise, for pay/waive; priority, for reserve; days, for circulation
+        string text;                 // duration, or search words
+        optional<ItemKind> kind;
+        bool availableOnly = false;
+        size_t limit = 20;
+        ItemFilter filter;           // for type/count
+        BulkImporter::Record record;
+        string error;                // set when the line did not parse
+    };
+
+    LibraryService& lib_;
+    unsigned threads_;
+    size_t batchLines_;
+    SimulatedClock* clock_ = nullptr;   // moved by "advance"; null when the service runs on real time
+
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    static std::string_view trim(std::string_view s) {
+        while (!s.empty() && isSpace(s.front())) s.remove_prefix(1);
+        while (!s.empty() && isSpace(s.back())) s.remove_suffix(1);
+        return s;
+    }
+
+    // one word of a type/count filter: a kind, an availability, archived or current
+    static void narrow(ItemFilter& f, std::string_view w) {
+        if (w == "Book") f.kind = ItemKind::Book;
+        else if (w == "Audiobook") f.kind = ItemKind::Audiobook;
+        else if (w == "EMagazine") f.kind = ItemKind::EMagazine;
+        else if (w == "available") f.status = AvailabilityStatus::AVAILABLE;
+        else if (w == "borrowed") f.status = AvailabilityStatus::BORROWED;
+        else if (w == "reserved") f.status = AvailabilityStatus::RESERVED;
+        else if (w == "maintenance") f.status = AvailabilityStatus::MAINTENANCE;
+        else if (w == "archived" || w == "current") f.archived = w == "archived";
+        else throw InvalidInputException("Unknown filter '" + string(w) + "'");
+    }
+
+    static std::string_view token(std::string_view& rest) {
+        rest = trim(rest);
+        size_t n = 0;
+        while (n < rest.size() && !isSpace(rest[n])) ++n;
+        auto tok = rest.substr(0, n);
+        rest.remove_prefix(n);
+        return tok;
+    }
+
+    static int number(std::string_view& rest, const char* field) {
+        auto tok = token(rest);
+        int v = 0;
+        auto res = std::from_chars(tok.data(), tok.data() + tok.size(), v);
+        if (tok.empty() || res.ec != std::errc() || res.ptr != tok.data() + tok.size())
+            throw InvalidInputException(string("Invalid ") + field + " '" + string(tok) + "'");
+        return v;
+    }
+
+    static Command parse(std::string_view line, system_clock::time_point now) {
+        Command c;
+        auto verb = token(line);
+        if (verb == "borrow" || verb == "renew") {
+            c.op = verb == "borrow" ? Op::Borrow : Op::Renew;
+            c.user = number(line, "user id");
+            c.item = number(line, "item id");
+            c.text = string(trim(line));
+            if (c.text.empty()) throw InvalidInputException("Missing duration");
+        } else if (verb == "return" || verb == "reserve" || verb == "cancel") {
+            c.op = verb == "return" ? Op::Return : verb == "reserve" ? Op::Reserve : Op::Cancel;
+            c.user = number(line, "user id");
+            c.item = number(line, "item id");
+            if (c.op == Op::Reserve && !trim(line).empty()) c.amount = number(line, "priority");
+        } else if (verb == "archive" || verb == "holds") {
+            c.op = verb == "archive" ? Op::Archive : Op::Holds;
+            c.item = number(line, "item id");
+        } else if (verb == "borrows" || verb == "fines" || verb == "balance") {
+            c.op = verb == "borrows" ? Op::Borrows : verb == "fines" ? Op::Fines : Op::Balance;
+            c.user = number(line, "user id");
+        } else if (verb == "pay" || verb == "waive") {
+            c.op = verb == "pay" ? Op::Pay : Op::Waive;
+            c.user = number(line, "user id");
+            c.amount = number(line, "amount");
+        } else if (verb == "debtors" || verb == "popular") {
+            c.op = verb == "debtors" ? Op::Debtors : Op::Popular;
+            c.limit = static_cast<size_t>(std::max(1, number(line, "count")));
+        } else if (verb == "circulation") {
+            c.op = Op::Circulation;
+            c.amount = trim(line).empty() ? 7 : number(line, "days");
+            if (c.amount < 1 || c.amount > CirculationStats::kDays)
+                throw InvalidInputException("Days must be 1 to " + to_string(CirculationStats::kDays));
+        } else if (verb == "overdue" || verb == "sweep" || verb == "metrics") {
+            c.op = verb == "overdue" ? Op::Overdue : verb == "sweep" ? Op::Sweep : Op::Metrics;
+        } else if (verb == "advance") {
+            c.op = Op::Advance;
+            c.text = string(trim(line));
+            if (c.text.empty()) throw InvalidInputException("Missing duration");
+            BorrowDuration::parse(c.text);
+            return c;
+        } else if (verb == "type" || verb == "count") {
+            c.op = verb == "type" ? Op::Type : Op::Count;
+            for (auto w = token(line); !w.empty(); w = token(line)) narrow(c.filter, w);
+            if (c.op == Op::Type && !c.filter.kind) throw InvalidInputException("Missing type");
+            return c;
+        } else if (verb == "complete") {
+            c.op = Op::Complete;
+            c.text = string(token(line));
+            if (c.text.empty()) throw InvalidInputException("Missing prefix");
+        } else if (verb == "search") {
+            c.op = Op::Search;
+            while (true) {
+                auto before = line;
+                auto tok = token(line);
+                if (tok == "available") { c.availableOnly = true; continue; }
+                if (tok.substr(0, 6) == "limit=") {
+                    auto n = tok.substr(6);
+                    c.limit = static_cast<size_t>(std::max(1, number(n, "limit")));
+                    continue;
+                }
+                if (tok.substr(0, 5) == "kind=") {
+                    auto k = tok.substr(5);
+                    if (k == "Book") c.kind = ItemKind::Book;
+                    else if (k == "Audiobook") c.kind = ItemKind::Audiobook;
+                    else if (k == "EMagazine") c.kind = ItemKind::EMagazine;
+                    else throw InvalidInputException("Unknown kind '" + string(k) + "'");
+                    continue;
+                }
+                line = before;
+                break;
+            }
+            c.text = string(trim(line));
+        } else if (verb == "add") {
+            c.op = Op::Add;
+            c.record = BulkImporter::parseRecord(trim(line), now);
+            return c;
+        } else {
+            throw InvalidInputException("Unknown command '" + string(verb) + "'");
+        }
+        if (!token(line).empty() && c.op != Op::Borrow && c.op != Op::Renew && c.op != Op::Search)
+            throw InvalidInputException("Trailing input");
+        return c;
+    }
+
+    static vector<Command> parseBatch(const vector<string>& lines, size_t firstLine, system_clock::time_point now) {
+        vector<Command> out;
+        out.reserve(lines.size());
+        for (size_t i = 0; i < lines.size(); ++i) {
+            auto raw = trim(lines[i]);
+            if (raw.empty() || raw[0] == '#') continue;
+            Command c;
+            try {
+                c = parse(raw, now);
+            } catch (const std::exception& e) {
+                c.error = e.what();
+            }
+            c.line = firstLine + i;
+            out.push_back(move(c));
+        }
+        return out;
+    }
+
+    // runs one command and appends "ok[ <detail>]" or "error <message>"; false if it failed
+    bool execute(const Command& c, string& out) const {
+        string error = c.error;
+        if (error.empty()) {
+            try {
+                string detail;
+                switch (c.op) {
+                case Op::Borrow:
+                    detail = to_string(system_clock::to_time_t(lib_.borrowItem(c.user, c.item, c.text)->dueAt()));
+                    break;
+                case Op::Renew:
+                    detail = to_string(system_clock::to_time_t(lib_.renewBorrow(c.user, c.item, c.text)));
+                    break;
+                case Op::Return: lib_.returnItem(c.user, c.item); break;
+                case Op::Reserve:
+                    if (size_t place = lib_.reserveItem(c.user, c.item, c.amount)) detail = to_string(place);
+                    break;
+                case Op::Cancel: lib_.cancelReservation(c.user, c.item); break;
+                case Op::Archive: lib_.archiveMagazine(c.item); break;
+                case Op::Holds: {
+                    auto [ready, waiting] = lib_.holdsFor(c.item);
+                    if (ready)
+                        detail = "ready=" + to_string(ready->userId) + ':' +
+                                 to_string(system_clock::to_time_t(ready->until));
+                    for (auto& w : waiting) append(detail, to_string(w.userId));
+                    break;
+                }
+                case Op::Search:
+                    for (auto& item : lib_.searchItems(c.text, c.kind, c.availableOnly, c.limit)) append(detail, to_string(item->id()));
+                    break;
+                case Op::Type: {
+                    auto ids = lib_.filterItems(c.filter);
+                    std::sort(ids.begin(), ids.end());
+                    for (int id : ids) append(detail, to_string(id));
+                    break;
+                }
+                case Op::Count:
+                    detail = to_string(lib_.countItems(c.filter));
+                    break;
+                case Op::Complete:
+                    for (auto& word : lib_.completeKeyword(c.text)) append(detail, word);
+                    break;
+                case Op::Borrows:
+                    for (auto& rec : lib_.getActiveBorrowsForUser(c.user)) append(detail, to_string(rec->itemId()));
+                    break;
+                case Op::Fines:
+                    for (auto& fine : lib_.getFinesForUser(c.user))
+                        append(detail, to_string(fine->itemId()) + ':' + to_string(fine->amount().paise()));
+                    break;
+                case Op::Balance:
+                    detail = to_string(lib_.getOutstandingBalance(c.user).paise());
+                    break;
+                case Op::Pay:
+                case Op::Waive:
+                    detail = to_string(lib_.settleFines(c.user, Money(c.amount), c.op == Op::Waive).paise());
+                    break;
+                case Op::Debtors:
+                    for (auto& [user, owed] : lib_.topDebtors(c.limit))
+                        append(detail, to_string(user) + ':' + to_string(owed.paise()));
+                    break;
+                case Op::Popular:
+                    for (auto& p : lib_.popularItems(c.limit))
+                        append(detail, to_string(p.itemId) + ':' + to_string(p.borrows));
+                    break;
+                case Op::Circulation: {
+                    auto w = lib_.circulation(c.amount);
+                    char loan[32];
+                    std::snprintf(loan, sizeof(loan), "%.2f", w.averageLoanDays());
+                    detail = "borrows=" + to_string(w.totalBorrows()) + " returns=" + to_string(w.totalReturns()) +
+                             " loan-days=" + loan + " fines=" + to_string(w.fines) +
+                             " fined=" + to_string(w.fined.paise());
+                    // <kind>=<borrows in window>/<out now>/<items>
+                    static const char* kinds[] = {"Book", "Audiobook", "EMagazine"};
+                    for (size_t k = 0; k < std::size(kinds); ++k) {
+                        auto kind = static_cast<ItemKind>(k + 1);
+                        auto [out, total] = lib_.utilization(kind);
+                        append(detail, string(kinds[k]) + '=' + to_string(w.borrowsOf(kind)) + '/' +
+                                       to_string(out) + '/' + to_string(total));
+                    }
+                    break;
+                }
+                case Op::Overdue:
+                    for (auto& rec : lib_.listOverdueRecords())
+                        append(detail, to_string(rec.itemId()) + ':' + to_string(rec.userId()));
+                    break;
+                case Op::Sweep: {
+                    auto rep = lib_.sweepOverdue();
+                    detail = to_string(rep.open) + ' ' + to_string(rep.charged) + ' ' + to_string(rep.amount.paise());
+                    break;
+                }
+                case Op::Metrics:
+                    detail = "\n" + metrics::prometheus();
+                    break;
+                case Op::Advance: {
+                    if (!clock_) throw InvalidInputException("Clock is not simulated");
+                    auto now = clock_->now();
+                    auto by = BorrowDuration::parse(c.text).computeDueAt(now) - now;
+                    if (by <= system_clock::duration::zero()) throw InvalidInputException("Can only advance forward");
+                    clock_->advance(by);
+                    lib_.recordClockOffset(clock_->offset());
+                    lib_.expireHolds();
+                    detail = to_string(system_clock::to_time_t(clock_->now()));
+                    break;
+                }
+                case Op::Add:
+                    if (c.record.item) lib_.addItem(c.record.item);
+                    else lib_.addUser(c.record.user);
+                    break;
+                }
+                out += "ok";
+                if (!detail.empty()) { out += ' '; out += detail; }
+                return true;
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+        }
+        out += "error ";
+        out += error;
+        return false;
+    }
+
+    static void append(string& detail, const string& word) {
+        if (!detail.empty()) detail += ' ';
+        detail += word;
+    }
+
+public:
+    explicit BatchRunner(LibraryService& lib, unsigned threads = 2, size_t batchLines = 4096)
+      : lib_(lib), threads_(std::max(1u, threads)), batchLines_(std::max<size_t>(1, batchLines)) {}
+
+    // lets "advance <duration>" move the service's simulated clock
+    void setSimulatedClock(SimulatedClock* clock) { clock_ = clock; }
+
+    LibraryService& service() const { return lib_; }
+
+    // Runs a single command, e.g. one network request; same grammar, and the
+    // result without a line number. Safe to call from several threads.
+    string runLine(std::string_view line) const {
+        Command c;
+        auto raw = trim(line);
+        try {
+            if (raw.empty()) throw InvalidInputException("Empty command");
+            c = parse(raw, lib_.clock().now());
+        } catch (const std::exception& e) {
+            c.error = e.what();
+        }
+        string out;
+        execute(c, out);
+        return out;
+    }
+
+    Stats run(std::istream& in, std::ostream& out) {
+        Stats stats;
+        auto t0 = std::chrono::steady_clock::now();
+        std::deque<std::future<vector<Command>>> inflight;
+
+        auto drainOne = [&] {
+            vector<Command> cmds = inflight.front().get();
+            inflight.pop_front();
+            string results;
+            {
+                auto durable = lib_.deferDurability();
+                for (auto& c : cmds) {
+                    results += to_string(c.line);
+                    results += ' ';
+                    if (!execute(c, results)) ++stats.failed;
+                    results += '\n';
+                }
+            }
+            stats.commands += cmds.size();
+            out.write(results.data(), static_cast<std::streamsize>(results.size()));
+        };
+
+        size_t lineNo = 0;
+        string line;
+        while (in) {
+            vector<string> lines;
+            lines.reserve(batchLines_);
+            size_t first = lineNo + 1;
+            while (lines.size() < batchLines_ && std::getline(in, line)) {
+                ++lineNo;
+                lines.push_back(move(line));
+            }
+            if (lines.empty()) break;
+            inflight.push_back(std::async(std::launch::async, [lines = move(lines), first, now = lib_.clock().now()] {
+                return parseBatch(lines, first, now);
+            }));
+            if (inflight.size() >= threads_) drainOne();
+        }
+        while (!inflight.empty()) drainOne();
+        out.flush();
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        return stats;
+    }
+};
+
+
+/* ---------- Network front end (Linux) ---------- */
+
+#ifdef __linux__
+// Frames on the wire, both directions: [u32 little-endian length][payload].
+// A request payload is one BatchRunner command line ("borrow 201 101 7 days"),
+// the response payload its result ("ok 1767225600" / "error ...").
+namespace wire {
+constexpr uint32_t kMaxFrame = 1u << 20;
+
+inline void put(string& out, std::string_view payload) {
+    uint32_t n = static_cast<uint32_t>(payload.size());
+    for (int i = 0; i < 4; ++i) out += static_cast<char>((n >> (8 * i)) & 0xff);
+    out.append(payload.data(), payload.size());
+}
+
+// pops every complete frame off the front of buf; false if a frame is oversized
+inline bool take(string& buf, vector<string>& frames) {
+    size_t pos = 0;
+    while (buf.size() - pos >= 4) {
+        uint32_t n = 0;
+        for (int i = 3; i >= 0; --i) n = (n << 8) | static_cast<uint8_t>(buf[pos + i]);
+        if (n > kMaxFrame) return false;
+        if (buf.size() - pos - 4 < n) break;
+        frames.emplace_back(buf, pos + 4, n);
+        pos += 4 + n;
+    }
+    buf.erase(0, pos);
+    return true;
+}
+
+inline int listenLoopback(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw LibraryException("socket() failed");
+    int one = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 512) != 0) {
+        ::close(fd);
+        throw LibraryException("Cannot listen on 127.0.0.1:" + to_string(port));
+    }
+    return fd;
+}
+
+inline int connectLoopback(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw LibraryException("socket() failed");
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(fd);
+        throw LibraryException("Cannot connect to 127.0.0.1:" + to_string(port));
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+}
+
+// Serves the library on a loopback TCP port. One I/O thread runs an epoll loop
+// over all connections; requests are executed on a worker pool. Connections are
+// persistent and may pipeline: a connection's requests run one batch at a time,
+// in order, so its responses come back in request order, while different
+// connections run in parallel.
+// "watch <user>" (answered "ok") subscribes the connection to the user's holds:
+// whenever one becomes ready the server pushes an unrequested frame
+// "hold-ready <item> <user> <until unix seconds>" between responses.
+class NetServer {
+    struct Conn {
+        int fd = -1;
+        string in, out;
+        vector<string> queued;        // parsed requests waiting for the worker slot
+        bool busy = false;            // a batch of this connection is on a worker
+        bool closed = false;          // fd closed; forget it once the worker is done
+        bool eof = false;             // peer finished sending; close after answering
+        uint32_t armed = 0;           // events currently registered with epoll
+    };
+    struct Job { uint64_t conn; vector<string> requests; };
+    struct Done { uint64_t conn; string responses; bool push = false; };   // push: not a job's answer
+
+    // A connection stops being read while it has this many requests waiting
+    // or this many unsent bytes, so c.in holds at most one partial frame plus
+    // one read; a watcher whose pushes would go past kMaxOut is dropped.
+    static constexpr size_t kMaxQueued = 1024;
+    static constexpr size_t kMaxOut = 4u << 20;
+    static bool throttled(const Conn& c) { return c.queued.size() >= kMaxQueued || c.out.size() >= kMaxOut; }
+
+    const BatchRunner& runner_;
+    int listenFd_ = -1, epollFd_ = -1, wakeFd_ = -1;
+    unordered_map<uint64_t, Conn> conns_;     // I/O thread only
+    uint64_t nextConn_ = 2;                   // 0 and 1 tag the listen and wake fds
+
+    std::mutex jobMtx_;
+    std::condition_variable jobCv_;
+    std::deque<Job> jobs_;
+    std::mutex doneMtx_;
+    vector<Done> done_;
+    std::atomic<bool> stop_{false};
+    vector<std::thread> workers_;
+
+    std::mutex watchMtx_;
+    std::unordered_multimap<int, uint64_t> watchers_;   // user -> watching connection
+    size_t holdListener_ = 0;
+
+    void wake() {
+        uint64_t one = 1;
+        [[maybe_unused]] auto n = ::write(wakeFd_, &one, sizeof(one));
+    }
+
+    void watch(uint64_t tag, int fd, uint32_t events, int op) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = tag;
+        ::epoll_ctl(epollFd_, op, fd, &ev);
+    }
+
+    void workerLoop() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> l(jobMtx_);
+                jobCv_.wait(l, [&]{ return stop_ || !jobs_.empty(); });
+                if (jobs_.empty()) return;
+                job = move(jobs_.front());
+                jobs_.pop_front();
+            }
+            string responses;
+            for (auto& r : job.requests) wire::put(responses, answer(job.conn, r));
+            {
+                std::lock_guard<std::mutex> l(doneMtx_);
+                done_.push_back({job.conn, move(responses)});
+            }
+            wake();
+        }
+    }
+
+    string answer(uint64_t conn, std::string_view request) {
+        if (request.substr(0, 6) != "watch ") return runner_.runLine(request);
+        auto user = request.substr(6);
+        int id = 0;
+        auto res = std::from_chars(user.data(), user.data() + user.size(), id);
+        if (user.empty() || res.ec != std::errc() || res.ptr != user.data() + user.size())
+            return "error Invalid user id '" + string(user) + "'";
+        std::lock_guard<std::mutex> l(watchMtx_);
+        auto range = watchers_.equal_range(id);
+        if (std::none_of(range.first, range.second, [&](auto& w) { return w.second == conn; }))
+            watchers_.emplace(id, conn);
+        return "ok";
+    }
+
+    // hold listener; runs on whichever thread made the hold ready
+    void onHoldReady(const LibraryService::HoldNotice& n) {
+        string frame;
+        wire::put(frame, "hold-ready " + to_string(n.itemId) + ' ' + to_string(n.userId) + ' ' +
+                         to_string(system_clock::to_time_t(n.until)));
+        {
+            std::lock_guard<std::mutex> wl(watchMtx_);
+            auto range = watchers_.equal_range(n.userId);
+            if (range.first == range.second) return;
+            std::lock_guard<std::mutex> l(doneMtx_);
+            for (auto it = range.first; it != range.second; ++it) done_.push_back({it->second, frame, true});
+        }
+        wake();
+    }
+
+    void dispatch(uint64_t id, Conn& c) {
+        if (c.busy || c.closed || c.queued.empty()) return;
+        c.busy = true;
+        {
+            std::lock_guard<std::mutex> l(jobMtx_);
+            jobs_.push_back({id, move(c.queued)});
+        }
+        c.queued.clear();
+        jobCv_.notify_one();
+    }
+
+    void drop(uint64_t id) {
+        auto it = conns_.find(id);
+        if (it == conns_.end()) return;
+        Conn& c = it->second;
+        if (c.fd >= 0) { ::close(c.fd); c.fd = -1; }
+        c.closed = true;
+        {
+            std::lock_guard<std::mutex> l(watchMtx_);
+            for (auto w = watchers_.begin(); w != watchers_.end();)
+                w = w->second == id ? watchers_.erase(w) : std::next(w);
+        }
+        if (!c.busy) conns_.erase(it);
+    }
+
+    // registers the events c needs now; false if c was finished and dropped
+    bool rearm(uint64_t id, Conn& c) {
+        if (c.eof && !c.busy && c.queued.empty() && c.out.empty()) { drop(id); return false; }
+        uint32_t want = (c.eof || throttled(c) ? 0u : static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP))
+                      | (c.out.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+        if (want != c.armed) {
+            c.armed = want;
+            watch(id, c.fd, want, EPOLL_CTL_MOD);
+        }
+        return true;
+    }
+
+    // false if the connection was dropped
+    bool flush(uint64_t id, Conn& c) {
+        size_t sent = 0;
+        while (sent < c.out.size()) {
+            ssize_t n = ::send(c.fd, c.out.data() + sent, c.out.size() - sent, MSG_NOSIGNAL);
+            if (n > 0) { sent += static_cast<size_t>(n); continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            drop(id);
+            return false;
+        }
+        c.out.erase(0, sent);
+        return rearm(id, c);
+    }
+
+    void onAccept() {
+        while (true) {
+            int fd = ::accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            uint64_t id = nextConn_++;
+            Conn& c = conns_[id];
+            c.fd = fd;
+            c.armed = EPOLLIN | EPOLLRDHUP;
+            watch(id, fd, c.armed, EPOLL_CTL_ADD);
+        }
+    }
+
+    void onReadable(uint64_t id) {
+        auto it = conns_.find(id);
+        if (it == conns_.end() || it->second.closed || it->second.eof) return;
+        Conn& c = it->second;
+        char buf[64 * 1024];
+        while (!throttled(c)) {
+            ssize_t n = ::recv(c.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                c.in.append(buf, static_cast<size_t>(n));
+                if (!wire::take(c.in, c.queued)) { drop(id); return; }
+                continue;
+            }
+            if (n == 0) { c.eof = true; break; }   // half-close: still answer what was sent
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            drop(id);
+            return;
+        }
+        dispatch(id, c);
+        rearm(id, c);
+    }
+
+    void onWorkDone() {
+        uint64_t n;
+        [[maybe_unused]] auto r = ::read(wakeFd_, &n, sizeof(n));
+        vector<Done> done;
+        {
+            std::lock_guard<std::mutex> l(doneMtx_);
+            done.swap(done_);
+        }
+        for (auto& d : done) {
+            auto it = conns_.find(d.conn);
+            if (it == conns_.end()) continue;
+            Conn& c = it->second;
+            if (d.push) {
+                if (c.closed || c.eof) continue;
+                if (c.out.size() + d.responses.size() > kMaxOut) { drop(d.conn); continue; }
+                c.out += d.responses;
+                flush(d.conn, c);
+                continue;
+            }
+            c.busy = false;
+            if (c.closed) { conns_.erase(it); continue; }
+            c.out += d.responses;
+            dispatch(d.conn, c);
+            flush(d.conn, c);
+        }
+    }
+
+public:
+    NetServer(const BatchRunner& runner, uint16_t port, unsigned workers = std::thread::hardware_concurrency())
+      : runner_(runner) {
+        listenFd_ = wire::listenLoopback(port);
+        epollFd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        wakeFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd_ < 0 || wakeFd_ < 0) throw LibraryException("Cannot set up the event loop");
+        watch(0, listenFd_, EPOLLIN, EPOLL_CTL_ADD);
+        watch(1, wakeFd_, EPOLLIN, EPOLL_CTL_ADD);
+        for (unsigned i = 0; i < std::max(1u, workers); ++i) workers_.emplace_back(&NetServer::workerLoop, this);
+        holdListener_ = runner_.service().subscribeHolds([this](const LibraryService::HoldNotice& n) { onHoldReady(n); });
+    }
+
+    // the listener can only be running on a worker, so it is done once they are joined
+    ~NetServer() {
+        runner_.service().unsubscribeHolds(holdListener_);
+        stop();
+        jobCv_.notify_all();
+        for (auto& w : workers_) w.join();
+        for (auto& c : conns_) if (c.second.fd >= 0) ::close(c.second.fd);
+        ::close(listenFd_);
+        ::close(epollFd_);
+        ::close(wakeFd_);
+    }
+
+    NetServer(const NetServer&) = delete;
+    NetServer& operator=(const NetServer&) = delete;
+
+    uint16_t port() const {
+        sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+        ::getsockname(listenFd_, reinterpret_cast<sockaddr*>(&addr), &len);
+        return ntohs(addr.sin_port);
+    }
+
+    // async-signal-safe; run() returns soon after
+    void stop() {
+        stop_ = true;
+        wake();
+    }
+
+    void run() {
+        epoll_event events[256];
+        while (!stop_) {
+            int n = ::epoll_wait(epollFd_, events, 256, -1);
+            if (n < 0 && errno != EINTR) throw LibraryException("epoll_wait failed");
+            for (int i = 0; i < n; ++i) {
+                uint64_t tag = events[i].data.u64;
+                if (tag == 0) { onAccept(); continue; }
+                if (tag == 1) { onWorkDone(); continue; }
+                uint32_t ev = events[i].events;
+                if (ev & (EPOLLHUP | EPOLLERR)) { drop(tag); continue; }
+                if (ev & (EPOLLIN | EPOLLRDHUP)) onReadable(tag);
+                if (ev & EPOLLOUT) {
+                    auto it = conns_.find(tag);
+                    if (it != conns_.end() && !it->second.closed) flush(tag, it->second);
+                }
+            }
+        }
+    }
+};
+
+// Open-loop load against a NetServer: each connection sends requests on a fixed
+// schedule whether or not earlier ones have been answered, and latency is taken
+// from the scheduled send time, so a stalled server shows up in the tail.
+class LoadGenerator {
+public:
+    struct Report {
+        size_t sent = 0, received = 0, failed = 0;   // failed: answered with "error ..."
+        double seconds = 0;
+        double p50us = 0, p99us = 0, p999us = 0;
+        double achievedRate() const { return seconds > 0 ? received / seconds : 0; }
+    };
+
+private:
+    uint16_t port_;
+    vector<string> requests_;
+
+    struct Result { vector<double> latencies; size_t sent = 0, failed = 0; };
+
+    Result connection(double rate, std::chrono::steady_clock::time_point start,
+                      std::chrono::steady_clock::time_point end, size_t offset) const {
+        using clock = std::chrono::steady_clock;
+        Result res;
+        int fd = wire::connectLoopback(port_);
+        auto interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / rate));
+        auto next = start;
+        std::deque<clock::time_point> inflight;
+        string in, out;
+        vector<string> frames;
+        size_t k = offset;
+        // keep sending until the end, then wait up to a second for stragglers
+        while (clock::now() < end || (!inflight.empty() && clock::now() < end + std::chrono::seconds(1))) {
+            auto now = clock::now();
+            while (next <= now && next < end) {
+                wire::put(out, requests_[k++ % requests_.size()]);
+                inflight.push_back(next);
+                next += interval;
+                ++res.sent;
+            }
+            if (!out.empty()) {
+                ssize_t n = ::send(fd, out.data(), out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n > 0) out.erase(0, static_cast<size_t>(n));
+                else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) break;
+            }
+            // sleep until the next send is due or a reply arrives
+            long long waitNs = next < end ? std::chrono::duration_cast<std::chrono::nanoseconds>(next - clock::now()).count() : 5000000;
+            waitNs = std::max<long long>(0, waitNs);
+            timespec ts{static_cast<time_t>(waitNs / 1000000000), static_cast<long>(waitNs % 1000000000)};
+            pollfd p{fd, static_cast<short>(POLLIN | (out.empty() ? 0 : POLLOUT)), 0};
+            if (::ppoll(&p, 1, &ts, nullptr) <= 0 || !(p.revents & POLLIN)) continue;
+            char buf[64 * 1024];
+            ssize_t n = ::recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n <= 0) { if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue; break; }
+            in.append(buf, static_cast<size_t>(n));
+            frames.clear();
+            if (!wire::take(in, frames)) break;
+            auto got = clock::now();
+            for (auto& f : frames) {
+                if (inflight.empty()) break;
+                res.latencies.push_back(std::chrono::duration<double, std::micro>(got - inflight.front()).count());
+                inflight.pop_front();
+                if (f.compare(0, 2, "ok") != 0) ++res.failed;
+            }
+        }
+        ::close(fd);
+        return res;
+    }
+
+public:
+    LoadGenerator(uint16_t port, vector<string> requests) : port_(port), requests_(move(requests)) {
+        if (requests_.empty()) throw InvalidInputException("Load generator needs at least one request");
+    }
+
+    // rate is the total target in requests/second, spread over the connections
+    Report run(double rate, double seconds, unsigned connections) const {
+        using clock = std::chrono::steady_clock;
+        connections = std::max(1u, connections);
+        auto start = clock::now() + std::chrono::milliseconds(50);
+        auto end = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+        vector<std::future<Result>> parts;
+        for (unsigned i = 0; i < connections; ++i)
+            parts.push_back(std::async(std::launch::async, [this, rate, connections, start, end, i] {
+                return connection(rate / connections, start, end, i);
+            }));
+        Report rep;
+        vector<double> all;
+        for (auto& p : parts) {
+            Result r = p.get();
+            rep.sent += r.sent;
+            rep.failed += r.failed;
+            all.insert(all.end(), r.latencies.begin(), r.latencies.end());
+        }
+        rep.received = all.size();
+        rep.seconds = seconds;
+        if (!all.empty()) {
+            std::sort(all.begin(), all.end());
+            auto at = [&](double q) { return all[std::min(all.size() - 1, static_cast<size_t>(q * all.size()))]; };
+            rep.p50us = at(0.50);
+            rep.p99us = at(0.99);
+            rep.p999us = at(0.999);
+        }
+        return rep;
+    }
+};
+
+static NetServer* g_server = nullptr;
+#endif
+
+
+/* ---------- Benchmarks ---------- */
+
+// Synthetic workloads for --bench. Repos are filled at the configured scale
+// (items, users, returned BorrowRecords as history, some fines and a few
+// overdue borrows), then each scenario is timed per call:
+//   mix       borrow/return/renew/reserve/cancel/overdue/fines/search/parse
+//             against LibraryService from each thread count
+//   stress    the same calls racing on a few items and users, then a check
+//             that items, records, holds, borrow counts and the journal agree;
+//             run again without a journal as stress-memory
+//   repo      InMemoryRepo lookups with 1 write in 16, striped vs single lock,
+//             then bulk lookup and all() throughput; node, flat and dense storage
+//   recovery  journal replay time, from the WAL alone and from a snapshot
+//   history   return and renew latency as the borrow history grows tenfold
+//   durations BorrowDuration::parse checked against the regex parser it replaced
+// Percentiles are exact, taken over every sample.
+class Benchmark {
+public:
+    struct Config {
+        size_t items = 100000, users = 10000, history = 1000000;
+        size_t opsPerThread = 50000;
+        size_t days = 56;                            // simulated days for the weeks scenario
+        vector<unsigned> threads = {1, 4};
+        std::filesystem::path dir = "bench-data";   // scratch directory for recovery
+    };
+
+    struct OpStats {
+        string op;
+        size_t count = 0, failed = 0;
+        double opsPerSec = 0, p50us = 0, p99us = 0, p999us = 0;
+        double bytesPer = 0;   // heap growth per entry added, where measured
+    };
+
+    struct Run {
+        string scenario;
+        unsigned threads = 1;
+        double seconds = 0;
+        vector<OpStats> ops;
+    };
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    enum Op { Borrow, Return, Renew, Reserve, Cancel, Overdue, Fines, Search, Parse, kOps };
+    static constexpr const char* kOpNames[kOps] = {"borrow", "return", "renew", "reserve", "cancel",
+                                                   "overdue", "fines", "search", "parse"};
+    // relative frequency of each operation in the mix
+    static constexpr int kWeights[kOps] = {25, 20, 10, 8, 7, 2, 15, 8, 5};
+
+    struct Samples {
+        vector<uint32_t> ns[kOps];
+        size_t failed[kOps] = {};
+    };
+
+    Config cfg_;
+
+    // cheap per-thread generator; quality is irrelevant here
+    struct Rng {
+        uint64_t s;
+        explicit Rng(uint64_t seed) : s(seed * 0x9E3779B97F4A7C15ull + 1) {}
+        uint64_t next() { s ^= s << 13; s ^= s >> 7; s ^= s << 17; return s; }
+        int upTo(size_t n) { return static_cast<int>(next() % n) + 1; }
+    };
+
+    static uint32_t since(clock::time_point t0) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t0).count();
+        return static_cast<uint32_t>(std::min<long long>(ns, std::numeric_limits<uint32_t>::max()));
+    }
+
+    static OpStats summarize(string op, vector<uint32_t>& ns, size_t failed, double seconds) {
+        OpStats s;
+        s.op = move(op);
+        s.count = ns.size();
+        s.failed = failed;
+        s.opsPerSec = seconds > 0 ? ns.size() / seconds : 0;
+        if (ns.empty()) return s;
+        std::sort(ns.begin(), ns.end());
+        auto at = [&](double q) { return ns[std::min(ns.size() - 1, static_cast<size_t>(q * ns.size()))] / 1000.0; };
+        s.p50us = at(0.50);
+        s.p99us = at(0.99);
+        s.p999us = at(0.999);
+        return s;
     }
 
-    vector<shared_ptr<T>> all() const {
-        std::lock_guard<std::mutex> l(mtx_);
-        vector<shared_ptr<T>> res;
-        res.reserve(storage_.size());
-        for (auto &p : storage_) res.push_back(p.second);
-        return res;
+    // bytes currently allocated from the heap; 0 where the allocator cannot say
+    static size_t heapBytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+        struct mallinfo2 mi = mallinfo2();
+        return mi.uordblks + mi.hblkhd;
+#else
+        return 0;
+#endif
     }
 
-    void remove(int id) {
-        std::lock_guard<std::mutex> l(mtx_);
-        storage_.erase(id);
+    static shared_ptr<Item> makeItem(int id) {
+        return make_shared<Book>(id, "Title " + to_string(id) + " topic" + to_string(id % 997),
+                                 vector<string>{"Author " + to_string(id % 5000)}, 100 + id % 400);
     }
-};
 
+    // count returned borrows spread over the last two years, with a fine on every tenth
+    void fillHistory(BorrowRecordRepo& records, FineRepo& fines, Rng& rng, size_t count) const {
+        auto now = system_clock::now();
+        for (size_t h = 0; h < count; ++h) {
+            int item = rng.upTo(cfg_.items), user = rng.upTo(cfg_.users);
+            auto at = now - hours(24 * static_cast<int>(30 + h % 700));
+            records.markReturned(*records.add(item, user, at, at + hours(24 * 14)), at + hours(24 * 10));
+            if (h % 10 == 0) fines.addFine(item, user, Money(1000), FineReason::Overdue, 1, at + hours(24 * 15));
+        }
+    }
 
-class ItemRepo : public InMemoryRepo<Item> {
-public:
-    vector<shared_ptr<Item>> findByType(const string& typeName) const {
-        vector<shared_ptr<Item>> res;
-        std::lock_guard<std::mutex> l(mtx_);
-        for (auto &p: storage_) {
-            if (p.second->typeName() == typeName) res.push_back(p.second);
+    void fillCatalog(LibraryService& lib) const {
+        vector<shared_ptr<Item>> batch;
+        for (size_t i = 1; i <= cfg_.items; ++i) {
+            batch.push_back(makeItem(static_cast<int>(i)));
+            if (batch.size() == 10000 || i == cfg_.items) { lib.addItems(batch); batch.clear(); }
         }
-        return res;
+        vector<shared_ptr<User>> users;
+        for (size_t u = 1; u <= cfg_.users; ++u) users.push_back(make_shared<User>(static_cast<int>(u), "user" + to_string(u), 1000));
+        lib.addUsers(users);
     }
-};
 
-class UserRepo : public InMemoryRepo<User> {};
+    void fill(LibraryService& lib, ItemRepo& items, BorrowRecordRepo& records, FineRepo& fines) const {
+        fillCatalog(lib);
 
-class BorrowRecordRepo {
-    unordered_map<int, shared_ptr<BorrowRecord>> storage_;
-    mutable std::mutex mtx_;
-    int nextId_ = 1;
-public:
-    shared_ptr<BorrowRecord> save(shared_ptr<BorrowRecord> rec) {
-        std::lock_guard<std::mutex> l(mtx_);
-        if (rec->id() == 0) rec->setId(nextId_++);
-        storage_[rec->id()] = rec;
-        return rec;
+        Rng rng(7);
+        fillHistory(records, fines, rng, cfg_.history);
+        // a few items out and overdue, so overdue listing has something to find
+        auto now = system_clock::now();
+        for (size_t i = 1; i <= cfg_.items; i += 200) {
+            int user = rng.upTo(cfg_.users);
+            records.add(static_cast<int>(i), user, now - hours(24 * 30), now - hours(24 * 2));
+            auto item = *items.findById(static_cast<int>(i));
+            items.changeState(*item, [&] { item->setStatus(AvailabilityStatus::BORROWED); });
+        }
     }
 
-    void add(shared_ptr<BorrowRecord> rec) { save(rec); }
+    void mixWorker(LibraryService& lib, unsigned t, unsigned threads, Samples& out) const {
+        Rng rng(t + 1);
+        int total = 0;
+        for (int w : kWeights) total += w;
+        vector<std::pair<int, int>> held, reserved;   // (user, item) this thread borrowed / reserved
+        size_t usersPerThread = std::max<size_t>(1, cfg_.users / threads);
+        auto pickUser = [&] { return static_cast<int>(t * usersPerThread + (rng.next() % usersPerThread) + 1); };
+        const char* durations[] = {"14 days", "2 weeks", "P7D", "48h", "3 weeks"};
 
-    optional<shared_ptr<BorrowRecord>> findActiveByItemId(int itemId) const {
-        std::lock_guard<std::mutex> l(mtx_);
-        for (auto &p: storage_) {
-            auto r = p.second;
-            if (r->itemId() == itemId && r->status() == BorrowStatus::ACTIVE) return r;
+        for (size_t n = 0; n < cfg_.opsPerThread; ++n) {
+            int r = static_cast<int>(rng.next() % total), op = 0;
+            while (r >= kWeights[op]) r -= kWeights[op++];
+            if ((op == Return || op == Renew) && held.empty()) op = Borrow;
+            if (op == Cancel && reserved.empty()) op = Reserve;
+            bool ok = true;
+            auto t0 = clock::now();
+            try {
+                switch (op) {
+                case Borrow: {
+                    int user = pickUser(), item = rng.upTo(cfg_.items);
+                    lib.borrowItem(user, item, durations[n % 5]);
+                    held.emplace_back(user, item);
+                    break;
+                }
+                case Return: {
+                    size_t k = rng.next() % held.size();
+                    auto h = held[k];
+                    held[k] = held.back();
+                    held.pop_back();
+                    lib.returnItem(h.first, h.second);
+                    break;
+                }
+                case Renew: {
+                    auto h = held[rng.next() % held.size()];
+                    lib.renewBorrow(h.first, h.second, "1 day");
+                    break;
+                }
+                case Reserve: {
+                    int user = pickUser(), item = rng.upTo(cfg_.items);
+                    lib.reserveItem(user, item);
+                    reserved.emplace_back(user, item);
+                    break;
+                }
+                case Cancel: {
+                    auto h = reserved.back();
+                    reserved.pop_back();
+                    lib.cancelReservation(h.first, h.second);
+                    break;
+                }
+                case Overdue: lib.listOverdueRecords(); break;
+                case Fines: lib.getFinesForUser(pickUser()); break;
+                case Search: lib.searchItems("topic" + to_string(rng.next() % 997), nullopt, false, 20); break;
+                case Parse: BorrowDuration::parse(durations[n % 5]); break;
+                }
+            } catch (const LibraryException&) {
+                ok = false;
+            }
+            out.ns[op].push_back(since(t0));
+            if (!ok) ++out.failed[op];
         }
-        return nullopt;
     }
 
-    vector<shared_ptr<BorrowRecord>> findByUserId(int userId) const {
-        vector<shared_ptr<BorrowRecord>> res;
-        std::lock_guard<std::mutex> l(mtx_);
-        for (auto &p: storage_) if (p.second->userId() == userId) res.push_back(p.second);
-        return res;
+    template<typename Fn>
+    static double parallel(unsigned threads, Fn&& body) {
+        auto t0 = clock::now();
+        vector<std::thread> pool;
+        for (unsigned t = 0; t < threads; ++t) pool.emplace_back([&body, t] { body(t); });
+        for (auto& th : pool) th.join();
+        return std::chrono::duration<double>(clock::now() - t0).count();
     }
 
-    vector<shared_ptr<BorrowRecord>> findActiveByUserId(int userId) const {
-        vector<shared_ptr<BorrowRecord>> res;
-        std::lock_guard<std::mutex> l(mtx_);
-        for (auto &p: storage_) if (p.second->userId() == userId && p.second->status() == BorrowStatus::ACTIVE) res.push_back(p.second);
-        return res;
-    }
+    Run runMix(unsigned threads) const {
+        ItemRepo items;
+        UserRepo users;
+        BorrowRecordRepo records;
+        FineRepo fines;
+        LibraryService lib(items, users, records, fines, Money::fromINR(10.0));
+        fill(lib, items, records, fines);
 
-    vector<shared_ptr<BorrowRecord>> all() const {
-        vector<shared_ptr<BorrowRecord>> res;
-        std::lock_guard<std::mutex> l(mtx_);
-        for (auto &p: storage_) res.push_back(p.second);
-        return res;
+        vector<Samples> samples(threads);
+        Run run{"mix", threads, 0, {}};
+        run.seconds = parallel(threads, [&](unsigned t) { mixWorker(lib, t, threads, samples[t]); });
+        for (int op = 0; op < kOps; ++op) {
+            vector<uint32_t> all;
+            size_t failed = 0;
+            for (auto& s : samples) {
+                all.insert(all.end(), s.ns[op].begin(), s.ns[op].end());
+                failed += s.failed[op];
+            }
+            run.ops.push_back(summarize(kOpNames[op], all, failed, run.seconds));
+        }
+        return run;
     }
-};
 
-class FineRepo {
-    unordered_map<int, shared_ptr<Fine>> storage_;
-    mutable std::mutex mtx_;
-    int nextId_ = 1;
-public:
-    shared_ptr<Fine> addFine(int itemId, int userId, Money amount, const string& reason) {
-        std::lock_guard<std::mutex> l(mtx_);
-        int id = nextId_++;
-        auto f = make_shared<Fine>(id, itemId, userId, amount, reason);
-        storage_[id] = f;
-        return f;
-    }
-    vector<shared_ptr<Fine>> findByUserId(int userId) const {
-        vector<shared_ptr<Fine>> res;
-        std::lock_guard<std::mutex> l(mtx_);
-        for (auto &p: storage_) if (p.second->userId() == userId) res.push_back(p.second);
-        return res;
+    // Every thread hammers the same few items and users with borrow, return,
+    // renew, reserve and cancel. Calls are aimed where they can succeed (a
+    // free item, a live borrow, a hold someone has), so the racing happens
+    // on the success paths rather than in precondition checks. Afterwards
+    // the service must still agree with itself: an item is BORROWED exactly
+    // when it has an open record, RESERVED exactly when its holder has a
+    // ready hold, each user's slot count matches their open records, and,
+    // if journalled, replaying the journal gives the same items and records.
+    // Without a journal the service takes no logOrder locks, so the repos
+    // alone must keep the calls apart.
+    // Broken invariants are counted as failures of the "invariants" row.
+    Run runStress(unsigned threads, bool journalled) const {
+        const int nItems = static_cast<int>(std::min<size_t>(cfg_.items, 64));
+        const int nUsers = static_cast<int>(std::min<size_t>(cfg_.users, 16));
+        auto dir = cfg_.dir / "stress";
+        std::filesystem::remove_all(dir);
+        enum { SBorrow, SReturn, SRenew, SReserve, SCancel, kSOps };
+        static constexpr const char* names[kSOps] = {"borrow", "return", "renew", "reserve", "cancel"};
+        vector<std::array<vector<uint32_t>, kSOps>> ns(threads);
+        vector<std::array<size_t, kSOps>> failed(threads, std::array<size_t, kSOps>{});
+
+        ItemRepo items;
+        UserRepo users;
+        BorrowRecordRepo records;
+        FineRepo fines;
+        SimulatedClock sim;
+        LibraryService lib(items, users, records, fines, Money::fromINR(10.0), sim);
+        std::optional<Journal> journal;
+        if (journalled) {
+            journal.emplace(dir, Journal::Durability::Async);
+            lib.attachJournal(*journal, 0);
+        }
+        vector<shared_ptr<Item>> batch;
+        for (int i = 1; i <= nItems; ++i) batch.push_back(makeItem(i));
+        lib.addItems(batch);
+        vector<shared_ptr<User>> us;
+        for (int u = 1; u <= nUsers; ++u) us.push_back(make_shared<User>(u, "user" + to_string(u), nItems));
+        lib.addUsers(us);
+
+        // who each item was last seen borrowed by (0: nobody), shared by all
+        // threads. Only a hint, but enough that returns and renews go to live
+        // borrows, so most calls succeed and threads race on the same records.
+        // Users may borrow every item, so their limit never gets in the way.
+        vector<std::atomic<int>> holder(static_cast<size_t>(nItems) + 1);
+        static constexpr int kStressWeights[kSOps] = {30, 25, 20, 15, 10};
+        Run run{journalled ? "stress" : "stress-memory", threads, 0, {}};
+        run.seconds = parallel(threads, [&](unsigned t) {
+            Rng rng(t + 31);
+            // an item that looks borrowed, or free to borrow or held for
+            // pickup; 0 if none turns up
+            auto pick = [&](bool held) {
+                for (int k = 0; k < 8; ++k) {
+                    int item = rng.upTo(static_cast<size_t>(nItems));
+                    auto st = batch[item - 1]->state().status;
+                    bool ok = held ? holder[item].load() != 0
+                                   : st == AvailabilityStatus::AVAILABLE || st == AvailabilityStatus::RESERVED;
+                    if (ok) return item;
+                }
+                return 0;
+            };
+            for (size_t n = 0; n < cfg_.opsPerThread; ++n) {
+                int r = static_cast<int>(rng.next() % 100), op = 0;
+                while (r >= kStressWeights[op]) r -= kStressWeights[op++];
+                int user = rng.upTo(static_cast<size_t>(nUsers)), item = 0;
+                switch (op) {
+                case SBorrow:
+                    // an item held for pickup is collected by its holder
+                    item = pick(false);
+                    if (item)
+                        if (auto ready = lib.holdsFor(item).first) user = ready->userId;
+                    break;
+                case SReturn:
+                case SRenew:
+                    item = pick(true);
+                    if (item) user = holder[item].load();
+                    break;
+                case SReserve: item = pick(true); break;
+                case SCancel:
+                    // a hold someone has now, ready or waiting
+                    for (int k = 0; k < 8; ++k) {
+                        item = rng.upTo(static_cast<size_t>(nItems));
+                        auto [ready, waiting] = lib.holdsFor(item);
+                        size_t w = rng.next() % (waiting.size() + 1);
+                        if (w < waiting.size()) user = waiting[w].userId;
+                        else if (ready) user = ready->userId;
+                        else continue;
+                        break;
+                    }
+                    break;
+                }
+                // nothing suitable turned up: any item, and the call most likely fails
+                if (!item) item = rng.upTo(static_cast<size_t>(nItems));
+                if (!user) user = rng.upTo(static_cast<size_t>(nUsers));
+                auto t0 = clock::now();
+                try {
+                    switch (op) {
+                    case SBorrow:
+                        lib.borrowItem(user, item, "14 days");
+                        holder[item].store(user);
+                        break;
+                    case SReturn: {
+                        lib.returnItem(user, item);
+                        int was = user;
+                        holder[item].compare_exchange_strong(was, 0);
+                        break;
+                    }
+                    case SRenew: lib.renewBorrow(user, item, "1 day"); break;
+                    case SReserve: lib.reserveItem(user, item, static_cast<int>(rng.next() % 3)); break;
+                    case SCancel: lib.cancelReservation(user, item); break;
+                    }
+                } catch (const LibraryException&) {
+                    ++failed[t][op];
+                }
+                ns[t][op].push_back(since(t0));
+            }
+        });
+        for (int op = 0; op < kSOps; ++op) {
+            vector<uint32_t> all;
+            size_t f = 0;
+            for (unsigned t = 0; t < threads; ++t) {
+                all.insert(all.end(), ns[t][op].begin(), ns[t][op].end());
+                f += failed[t][op];
+            }
+            run.ops.push_back(summarize(names[op], all, f, run.seconds));
+        }
+
+        OpStats inv;
+        inv.op = "invariants";
+        auto check = [&](bool ok) { ++inv.count; inv.failed += !ok; };
+        for (int i = 1; i <= nItems; ++i) {
+            ItemState st = (*items.findById(i))->state();
+            auto open = records.findActiveByItemId(i);
+            auto ready = lib.holdsFor(i).first;
+            check((st.status == AvailabilityStatus::BORROWED) == (open != nullptr));
+            check((st.status == AvailabilityStatus::RESERVED) == ready.has_value());
+            if (ready) check(ready->userId == st.reservedBy);
+        }
+        for (int u = 1; u <= nUsers; ++u) {
+            int n = (*users.findById(u))->activeBorrows();
+            check(n == static_cast<int>(records.findActiveByUserId(u).size()) && n <= nItems);
+        }
+        if (journalled) {
+            journal->close();
+            ItemRepo items2;
+            UserRepo users2;
+            BorrowRecordRepo records2;
+            FineRepo fines2;
+            LibraryService replayed(items2, users2, records2, fines2, Money::fromINR(10.0), sim);
+            Journal journal2(dir, Journal::Durability::Async);
+            replayed.attachJournal(journal2, 0);
+            for (int i = 1; i <= nItems; ++i) {
+                check((*items2.findById(i))->state() == (*items.findById(i))->state());
+                auto a = records.findActiveByItemId(i), b = records2.findActiveByItemId(i);
+                check((a == nullptr) == (b == nullptr));
+                // the journal keeps times to the microsecond
+                if (a && b) check(a->id() == b->id() && a->userId() == b->userId()
+                                  && std::chrono::abs(a->dueAt() - b->dueAt()) < std::chrono::microseconds(1));
+            }
+            for (int u = 1; u <= nUsers; ++u)
+                check((*users2.findById(u))->activeBorrows() == (*users.findById(u))->activeBorrows());
+        }
+        run.ops.push_back(inv);
+        std::filesystem::remove_all(dir);
+        return run;
     }
-};
 
+    // The regex duration parser BorrowDuration::parse replaced, kept as the
+    // reference for runDurations. Returns the due date for a borrow starting
+    // at `start`. Where the original called stoi on the whole ISO match, or
+    // multiplied past INT_MAX in int, this throws Legacy instead.
+    struct Legacy : std::runtime_error { using std::runtime_error::runtime_error; };
+    static system_clock::time_point legacyDueAt(const string& input, system_clock::time_point start) {
+        string s = input;
+        // trim
+        auto trim = [](string& t) {
+            size_t a = t.find_first_not_of(" \t\n\r");
+            size_t b = t.find_last_not_of(" \t\n\r");
+            if (a == string::npos) { t.clear(); return; }
+            t = t.substr(a, b - a + 1);
+        };
+        trim(s);
+        if (s.empty()) throw InvalidInputException("Empty duration string");
 
-// Helper: format time_point to human-readable string
-static string formatTime(const system_clock::time_point &tp) {
-    std::time_t t = system_clock::to_time_t(tp);
-    std::tm tm = *std::localtime(&t);
-    std::ostringstream ss;
-    ss << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
-    return ss.str();
-}
+        // Date range: YYYY-MM-DD to YYYY-MM-DD
+        static const std::regex rangeRx(R"((\d{4}-\d{2}-\d{2})\s+to\s+(\d{4}-\d{2}-\d{2}))", std::regex::icase);
+        std::smatch m;
+        if (std::regex_search(s, m, rangeRx)) {
+            std::tm t1 = {}, t2 = {};
+            std::istringstream ss1(m[1].str()), ss2(m[2].str());
+            ss1 >> std::get_time(&t1, "%Y-%m-%d");
+            ss2 >> std::get_time(&t2, "%Y-%m-%d");
+            if (ss1.fail() || ss2.fail()) throw InvalidInputException("Invalid date format in range");
+            std::time_t tt1 = std::mktime(&t1);
+            std::time_t tt2 = std::mktime(&t2);
+            if (tt1 == -1 || tt2 == -1) throw InvalidInputException("Failed to convert dates");
+            system_clock::time_point p1 = system_clock::from_time_t(tt1);
+            system_clock::time_point p2 = system_clock::from_time_t(tt2);
+            if (p2 <= p1) throw InvalidInputException("End date must be after start date");
+            return p2;
+        }
 
+        static const std::regex isoRx(R"(^(P(?:(\d+)D)|PT?(?:(\d+)H))$)", std::regex::icase);
+        if (std::regex_search(s, m, isoRx)) throw Legacy("stoi on the whole ISO match");
 
-class LibraryService {
-    ItemRepo& items_;
-    UserRepo& users_;
-    BorrowRecordRepo& records_;
-    FineRepo& fines_;
-    Money dailyFineRate_;
-    // simple reservation map: itemId -> userId
-    unordered_map<int,int> reservations_;
-public:
-    LibraryService(ItemRepo& items, UserRepo& users, BorrowRecordRepo& records, FineRepo& fines, Money dailyFineRate)
-      : items_(items), users_(users), records_(records), fines_(fines), dailyFineRate_(dailyFineRate) {}
+        static const std::regex nlRx(R"(^\s*(\d+)\s*(days?|d|weeks?|w|hours?|h)\s*$)", std::regex::icase);
+        if (std::regex_search(s, m, nlRx)) {
+            int num;
+            try { num = std::stoi(m[1].str()); } catch (const std::out_of_range&) { throw Legacy("stoi out of range"); }
+            string unit = m[2].str();
+            int64_t perUnit;
+            if (std::regex_search(unit, std::regex(R"(week|w)", std::regex::icase))) perUnit = 24 * 7;
+            else if (std::regex_search(unit, std::regex(R"(day|d)", std::regex::icase))) perUnit = 24;
+            else if (std::regex_search(unit, std::regex(R"(hour|h)", std::regex::icase))) perUnit = 1;
+            else throw InvalidInputException("Unsupported duration unit");
+            if (perUnit * num > std::numeric_limits<int>::max()) throw Legacy("int overflow");
+            return start + hours(perUnit * num);
+        }
 
-    void borrowItem(int userId, int itemId, const string& durationStr) {
-        auto userOpt = users_.findById(userId);
-        if (!userOpt) throw NotFoundException("User not found");
-        auto itemOpt = items_.findById(itemId);
-        if (!itemOpt) throw NotFoundException("Item not found");
-        auto item = *itemOpt;
+        throw InvalidInputException("Unsupported duration format. Supported: '10 days', '2 weeks', 'P14D', 'PT48H', 'YYYY-MM-DD to YYYY-MM-DD'");
+    }
 
-        // allow borrow if AVAILABLE or RESERVED by same user
-        if (item->status() == AvailabilityStatus::BORROWED || item->status() == AvailabilityStatus::MAINTENANCE) 
-            throw ItemNotAvailableException("Item not available for borrowing");
-        if (item->status() == AvailabilityStatus::RESERVED) {
-            auto it = reservations_.find(itemId);
-            if (it == reservations_.end() || it->second != userId) throw ItemNotAvailableException("Item reserved by another user");
-            // otherwise allow borrowing and remove reservation
-            reservations_.erase(itemId);
+    // BorrowDuration::parse against legacyDueAt over a fixed corpus of valid
+    // and invalid strings plus cfg_.opsPerThread generated ones: both must
+    // give the same due date or the same error. Inputs the original could
+    // not handle (Legacy) are counted as "known" and must parse now, or be
+    // rejected as out of range. Any other disagreement fails the
+    // "invariants" row.
+    Run runDurations() const {
+        vector<string> corpus = {
+            "14 days", "1 day", "2 weeks", "1 week", "48 hours", "1 hour", "7d", "3w", "12h", "  10 days  ",
+            "10DAYS", "5 Weeks", "\t3 d\n", "0 days", "P14D", "p3d", "PT48H", "pt1h", "P5H", "PT5D", "P", "PT",
+            "2024-01-01 to 2024-01-15", "2024-03-01 TO 2024-02-01", "from 2024-05-01 to 2024-05-09 please",
+            "2024-01-01 to 2024-01-01", "2024-13-01 to 2024-14-01", "2024-01-00 to 2024-01-05", "2024-1-1 to 2024-1-5",
+            "2024-01-01to2024-01-05", "2024-02-30 to 2024-03-02", "", "   ", "days", "14", "14 dayz", "-3 days",
+            "3.5 days", "1 fortnight", "14 days later", "2147483647 hours", "2147483648 hours", "99999999999 days",
+            "89478485 days", "89478486 days", "12782641 weeks", "12782642 weeks", "1 d a y", "1\vday",
+        };
+        static const char* units[] = {"d", "day", "days", "DAYS", "w", "week", "weeks", "Weeks", "h", "hour",
+                                      "hours", "HOURS", "x", "dayz", "", "to"};
+        static const char* gaps[] = {"", " ", "  ", "\t", "\n"};
+        static const char* numbers[] = {"0", "1", "7", "14", "365", "08", "2147483647", "2147483648", "99999999999"};
+        static const char symbols[] = "0123456789 dwhptoDWHPTO-x\t";
+        Rng rng(17);
+        auto pick = [&](auto& from) -> string { return from[rng.next() % std::size(from)]; };
+        auto date = [&] {
+            char buf[16];
+            std::snprintf(buf, sizeof buf, "%04d-%02d-%02d", 1990 + static_cast<int>(rng.next() % 60),
+                          static_cast<int>(rng.next() % 14), static_cast<int>(rng.next() % 34));
+            return string(buf);
+        };
+        for (size_t n = 0; n < cfg_.opsPerThread; ++n) {
+            string in;
+            switch (rng.next() % 4) {
+            case 0: in = pick(gaps) + pick(numbers) + pick(gaps) + pick(units) + pick(gaps); break;
+            case 1: in = string(rng.next() % 2 ? "P" : "p") + (rng.next() % 2 ? "T" : "") + pick(numbers) + pick(units); break;
+            case 2: in = pick(gaps) + date() + pick(gaps) + (rng.next() % 4 ? "to" : "TO") + pick(gaps) + date() + pick(gaps); break;
+            default:
+                for (size_t k = rng.next() % 12; k > 0; --k) in += symbols[rng.next() % (sizeof symbols - 1)];
+            }
+            corpus.push_back(move(in));
         }
 
-        BorrowDuration bd = BorrowDuration::parse(durationStr);
-        system_clock::time_point now = system_clock::now();
-        system_clock::time_point due = bd.computeDueAt(now);
-        if (due <= now) throw InvalidInputException("Computed due date must be in the future");
+        auto start = system_clock::from_time_t(1700000000);
+        // "due <ticks>", the error message, or "legacy"
+        auto outcome = [](auto&& dueAt) -> string {
+            try {
+                return "due " + to_string(dueAt().time_since_epoch().count());
+            } catch (const Legacy&) {
+                return "legacy";
+            } catch (const LibraryException& e) {
+                return e.what();
+            }
+        };
+        vector<uint32_t> oldNs, newNs;
+        OpStats known, inv;
+        known.op = "known";
+        inv.op = "invariants";
+        Run run{"durations", 1, 0, {}};
+        auto t0 = clock::now();
+        for (auto& in : corpus) {
+            auto t1 = clock::now();
+            string was = outcome([&] { return legacyDueAt(in, start); });
+            oldNs.push_back(since(t1));
+            t1 = clock::now();
+            string now = outcome([&] { return BorrowDuration::parse(in).computeDueAt(start); });
+            newNs.push_back(since(t1));
+            bool legacy = was == "legacy";
+            known.count += legacy;
+            ++inv.count;
+            bool agree = legacy ? now.rfind("due ", 0) == 0 || now == "Duration value out of range" : now == was;
+            if (!agree && ++inv.failed <= 5) cerr << "durations: '" << in << "' was '" << was << "', now '" << now << "'\n";
+        }
+        run.seconds = std::chrono::duration<double>(clock::now() - t0).count();
+        run.ops.push_back(summarize("regex", oldNs, 0, run.seconds));
+        run.ops.push_back(summarize("parse", newNs, 0, run.seconds));
+        run.ops.push_back(known);
+        run.ops.push_back(inv);
+        return run;
+    }
 
-        item->setStatus(AvailabilityStatus::BORROWED);
-        auto rec = make_shared<BorrowRecord>(0, itemId, userId, now, due);
-        records_.add(rec);
-        cout << "Borrowed item " << itemId << " by user " << userId << ". Due at " << formatTime(due) << "\n";
+    template<typename Repo>
+    Run runRepo(const string& name, unsigned threads) const {
+        Repo repo;
+        vector<shared_ptr<User>> all;
+        for (size_t u = 1; u <= cfg_.users; ++u) all.push_back(make_shared<User>(static_cast<int>(u), "user", 5));
+        repo.saveAll(all);
+        vector<vector<uint32_t>> reads(threads), writes(threads);
+        Run run{name, threads, 0, {}};
+        run.seconds = parallel(threads, [&](unsigned t) {
+            Rng rng(t + 1);
+            for (size_t n = 0; n < cfg_.opsPerThread; ++n) {
+                int id = rng.upTo(cfg_.users);
+                auto t0 = clock::now();
+                if (n % 16 == 0) {
+                    repo.save(all[id - 1], id);
+                    writes[t].push_back(since(t0));
+                } else {
+                    repo.findById(id);
+                    reads[t].push_back(since(t0));
+                }
+            }
+        });
+        vector<uint32_t> r, w;
+        for (unsigned t = 0; t < threads; ++t) {
+            r.insert(r.end(), reads[t].begin(), reads[t].end());
+            w.insert(w.end(), writes[t].begin(), writes[t].end());
+        }
+        run.ops.push_back(summarize("findById", r, 0, run.seconds));
+        run.ops.push_back(summarize("save", w, 0, run.seconds));
+        // throughput without the per-call timer: random lookups from every
+        // thread, then whole-repo passes through forEach() and all()
+        std::atomic<size_t> hits{0};
+        double secs = parallel(threads, [&](unsigned t) {
+            Rng rng(t + 101);
+            size_t n = 0;
+            for (size_t k = 0; k < cfg_.opsPerThread; ++k) n += repo.findById(rng.upTo(cfg_.users)).has_value();
+            hits += n;
+        });
+        OpStats lookups;
+        lookups.op = "lookups";
+        lookups.count = cfg_.opsPerThread * threads;
+        lookups.failed = lookups.count - hits;
+        lookups.opsPerSec = secs > 0 ? lookups.count / secs : 0;
+        run.ops.push_back(lookups);
+        size_t passes = std::max<size_t>(1, cfg_.opsPerThread * 16 / std::max<size_t>(1, cfg_.users));
+        auto scan = [&](const char* op, auto&& pass) {
+            size_t seen = 0;
+            auto t0 = clock::now();
+            for (size_t p = 0; p < passes; ++p) seen += pass();
+            double secs = std::chrono::duration<double>(clock::now() - t0).count();
+            OpStats st;
+            st.op = op;
+            st.count = seen;
+            st.opsPerSec = secs > 0 ? seen / secs : 0;
+            run.ops.push_back(st);
+        };
+        scan("forEach", [&] {
+            size_t n = 0;
+            repo.forEach([&](int id, const shared_ptr<User>&) { n += id > 0; });
+            return n;
+        });
+        scan("all", [&] { return repo.all().size(); });
+        return run;
     }
 
-    void returnItem(int userId, int itemId) {
-        auto userOpt = users_.findById(userId);
-        if (!userOpt) throw NotFoundException("User not found");
-        auto itemOpt = items_.findById(itemId);
-        if (!itemOpt) throw NotFoundException("Item not found");
-        auto item = *itemOpt;
+    // cfg_.days of library activity on a simulated clock. Each day every
+    // thread borrows its share of opsPerThread items for 14 days and returns
+    // about a tenth of what it holds, so the stragglers come back late and
+    // are fined. The clock jumps a day at a time, so weeks take seconds.
+    Run runWeeks(unsigned threads) const {
+        ItemRepo items;
+        UserRepo users;
+        BorrowRecordRepo records;
+        FineRepo fines;
+        SimulatedClock sim;
+        LibraryService lib(items, users, records, fines, Money::fromINR(10.0), sim);
+        fillCatalog(lib);
 
-        auto recOpt = records_.findActiveByItemId(itemId);
-        if (!recOpt) throw ReturnException("No active borrow record for item");
-        auto rec = *recOpt;
-        if (rec->userId() != userId) throw ReturnException("Borrow record user mismatch");
+        size_t days = std::max<size_t>(1, cfg_.days);
+        size_t perDay = std::max<size_t>(1, cfg_.opsPerThread / days);
+        size_t usersPerThread = std::max<size_t>(1, cfg_.users / threads);
+        vector<vector<std::pair<int, int>>> held(threads);
+        vector<vector<uint32_t>> borrows(threads), returns(threads);
+        vector<size_t> borrowFailed(threads), returnFailed(threads);
+        vector<Rng> rngs;
+        for (unsigned t = 0; t < threads; ++t) rngs.emplace_back(t + 11);
+        Run run{"weeks", threads, 0, {}};
+        for (size_t day = 0; day < days; ++day) {
+            run.seconds += parallel(threads, [&](unsigned t) {
+                Rng& rng = rngs[t];
+                for (size_t n = 0; n < perDay; ++n) {
+                    int user = static_cast<int>(t * usersPerThread + (rng.next() % usersPerThread) + 1);
+                    int item = rng.upTo(cfg_.items);
+                    auto t0 = clock::now();
+                    try {
+                        lib.borrowItem(user, item, "14 days");
+                        held[t].emplace_back(user, item);
+                    } catch (const LibraryException&) {
+                        ++borrowFailed[t];
+                    }
+                    borrows[t].push_back(since(t0));
+                }
+                for (size_t n = held[t].size() / 10; n > 0; --n) {
+                    size_t k = rng.next() % held[t].size();
+                    auto h = held[t][k];
+                    held[t][k] = held[t].back();
+                    held[t].pop_back();
+                    auto t0 = clock::now();
+                    try { lib.returnItem(h.first, h.second); } catch (const LibraryException&) { ++returnFailed[t]; }
+                    returns[t].push_back(since(t0));
+                }
+            });
+            sim.advance(hours(24));
+        }
+        vector<uint32_t> b, r;
+        size_t bf = 0, rf = 0;
+        for (unsigned t = 0; t < threads; ++t) {
+            b.insert(b.end(), borrows[t].begin(), borrows[t].end());
+            r.insert(r.end(), returns[t].begin(), returns[t].end());
+            bf += borrowFailed[t];
+            rf += returnFailed[t];
+        }
+        run.ops.push_back(summarize("borrow", b, bf, run.seconds));
+        run.ops.push_back(summarize("return", r, rf, run.seconds));
+        OpStats f;
+        f.op = "fined";
+        f.count = fines.all().size();
+        run.ops.push_back(f);
+        OpStats d;
+        d.op = "days";
+        d.count = days;
+        d.opsPerSec = run.seconds > 0 ? days / run.seconds : 0;
+        run.ops.push_back(d);
+        return run;
+    }
 
-        int overdueDays = rec->overdueDays();
-        if (overdueDays > 0) {
-            Money fineAmount = dailyFineRate_ * overdueDays;
-            auto fine = fines_.addFine(itemId, userId, fineAmount, "Overdue by " + to_string(overdueDays) + " days");
-            cout << "Applied fine " << fine->amount().str() << " for user " << userId << " on item " << itemId << "\n";
-        } else {
-            cout << "No fine. Item returned on time.\n";
+    // nightly overdue sweep over cfg_.history open borrows, about half of
+    // them past due; each thread count sweeps one simulated day later, so
+    // every run charges one more day on each overdue record
+    vector<Run> runSweep() const {
+        ItemRepo items;
+        UserRepo users;
+        BorrowRecordRepo records;
+        FineRepo fines;
+        SimulatedClock sim;
+        LibraryService lib(items, users, records, fines, Money::fromINR(10.0), sim);
+        Rng rng(9);
+        auto now = sim.now();
+        for (size_t h = 0; h < cfg_.history; ++h) {
+            auto at = now - hours(24 * 30) + std::chrono::minutes(rng.next() % (60 * 24 * 36));
+            records.add(rng.upTo(cfg_.items), rng.upTo(cfg_.users), at, at + hours(24 * 14));
+        }
+        vector<Run> runs;
+        for (unsigned t : cfg_.threads) {
+            sim.advance(hours(24));
+            auto rep = lib.sweepOverdue(t);
+            Run run{"sweep", t, rep.seconds, {}};
+            OpStats open;
+            open.op = "records";
+            open.count = rep.open;
+            open.opsPerSec = rep.seconds > 0 ? rep.open / rep.seconds : 0;
+            run.ops.push_back(open);
+            OpStats charged;
+            charged.op = "fined";
+            charged.count = rep.charged;
+            charged.opsPerSec = rep.seconds > 0 ? rep.charged / rep.seconds : 0;
+            run.ops.push_back(charged);
+            runs.push_back(run);
+        }
+        return runs;
+    }
+
+    // "AVAILABLE Audiobooks" over cfg_.items items of all three kinds, a
+    // third of them out: a pass over the objects comparing typeName() and
+    // status(), against the item columns (ids, count) and findByType
+    Run runItems() const {
+        ItemRepo items;
+        vector<shared_ptr<Item>> all, batch;
+        for (size_t i = 1; i <= cfg_.items; ++i) {
+            int id = static_cast<int>(i);
+            if (i % 3 == 0) batch.push_back(makeItem(id));
+            else if (i % 3 == 1) batch.push_back(make_shared<Audiobook>(id, "Audio " + to_string(id), vector<string>{"Reader"}, hours(1 + id % 20)));
+            else batch.push_back(make_shared<EMagazine>(id, "Issue " + to_string(id), vector<string>{"Editor"}, 1 + id % 50, system_clock::now()));
+            if (batch.size() == 10000 || i == cfg_.items) { all.insert(all.end(), batch.begin(), batch.end()); items.saveAll(batch); batch.clear(); }
+        }
+        for (size_t i = 0; i < all.size(); i += 3) {
+            auto& item = all[(i * 7) % all.size()];
+            items.changeState(*item, [&] { item->setStatus(AvailabilityStatus::BORROWED); });
         }
 
-        rec->markReturned();
-        item->setStatus(AvailabilityStatus::AVAILABLE);
+        ItemFilter f;
+        f.kind = ItemKind::Audiobook;
+        f.status = AvailabilityStatus::AVAILABLE;
+        size_t passes = std::max<size_t>(5, cfg_.opsPerThread / 1000);
+        Run run{"items", 1, 0, {}};
+        auto t0 = clock::now();
+        auto time = [&](const char* op, auto&& pass) {
+            vector<uint32_t> ns;
+            size_t sink = 0;
+            auto t1 = clock::now();
+            for (size_t p = 0; p < passes; ++p) {
+                auto t2 = clock::now();
+                sink += pass();
+                ns.push_back(since(t2));
+            }
+            volatile size_t keep = sink;   // keeps the passes from being optimised away
+            (void)keep;
+            run.ops.push_back(summarize(op, ns, 0, std::chrono::duration<double>(clock::now() - t1).count()));
+        };
+        time("scan", [&] {
+            size_t n = 0;
+            items.forEach([&](int, const shared_ptr<Item>& item) {
+                n += item->typeName() == "Audiobook" && item->status() == AvailabilityStatus::AVAILABLE;
+            });
+            return n;
+        });
+        time("filter", [&] { return items.idsWhere(f).size(); });
+        time("count", [&] { return items.countWhere(f); });
+        time("byType", [&] { return items.findByType("Audiobook").size(); });
+        run.seconds = std::chrono::duration<double>(clock::now() - t0).count();
+        return run;
     }
 
-    // renew borrow: only allowed if record exists, same user, not overdue
-    void renewBorrow(int userId, int itemId, const string& extraDurationStr) {
-        auto recOpt = records_.findActiveByItemId(itemId);
-        if (!recOpt) throw BorrowException("No active borrow record to renew");
-        auto rec = *recOpt;
-        if (rec->userId() != userId) throw BorrowException("Only borrowing user can renew");
-        if (rec->isOverdue()) throw BorrowException("Cannot renew overdue borrow");
+    // a dashboard over cfg_.history loans of the last 60 days, a tenth of
+    // them fined: 7-day borrows, fines and top 10 items by a pass over the
+    // records and fines, against CirculationStats fed with the same loans
+    Run runCirculation() const {
+        BorrowRecordRepo records;
+        FineRepo fines;
+        CirculationStats stats;
+        Rng rng(13);
+        auto now = system_clock::now();
+        size_t hot = std::max<size_t>(1, cfg_.items / 100);
+        for (size_t h = 0; h < cfg_.history; ++h) {
+            // half the loans go to the hottest 1% of items
+            int item = h % 2 ? rng.upTo(hot) : rng.upTo(cfg_.items), user = rng.upTo(cfg_.users);
+            auto at = now - std::chrono::minutes(rng.next() % (60 * 24 * 60));
+            auto back = std::min(now, at + hours(24 * (1 + rng.next() % 20)));
+            auto kind = static_cast<ItemKind>(1 + item % 3);
+            auto rec = records.add(item, user, at, at + hours(24 * 14));
+            stats.borrowed(kind, item, at);
+            records.markReturned(*rec, back);
+            stats.returned(kind, item, back - at, back);
+            if (h % 10 == 0) {
+                auto fine = fines.addFine(item, user, Money(1000), FineReason::Overdue, 1, back);
+                stats.fined(item, fine->amount(), back);
+            }
+        }
 
-        BorrowDuration extra = BorrowDuration::parse(extraDurationStr);
-        system_clock::time_point newDue = extra.computeDueAt(rec->dueAt());
-        if (newDue <= rec->dueAt()) throw InvalidInputException("New due must be after current due date");
-        rec->setDueAt(newDue);
-        cout << "Renewed borrow for item " << itemId << ". New due: " << formatTime(newDue) << "\n";
+        size_t passes = std::max<size_t>(5, cfg_.opsPerThread / 1000);
+        Run run{"circulation", 1, 0, {}};
+        auto t0 = clock::now();
+        auto time = [&](const char* op, size_t n, auto&& pass) {
+            vector<uint32_t> ns;
+            size_t sink = 0;
+            auto t1 = clock::now();
+            for (size_t p = 0; p < n; ++p) {
+                auto t2 = clock::now();
+                sink += pass();
+                ns.push_back(since(t2));
+            }
+            volatile size_t keep = sink;   // keeps the passes from being optimised away
+            (void)keep;
+            run.ops.push_back(summarize(op, ns, 0, std::chrono::duration<double>(clock::now() - t1).count()));
+        };
+        time("scan", passes, [&] {
+            auto week = now - hours(24 * 7), fortnight = now - hours(24 * 14);
+            size_t borrows = 0, fined = 0;
+            unordered_map<int, size_t> counts;
+            records.forEach([&](const BorrowRecord& r) {
+                if (r.borrowAt() >= week) ++borrows;
+                if (r.borrowAt() >= fortnight) ++counts[r.itemId()];
+            });
+            for (auto f : fines.all()) fined += f->appliedAt() >= week;
+            vector<std::pair<size_t, int>> top;
+            for (auto& [item, n] : counts) top.emplace_back(n, item);
+            std::partial_sort(top.begin(), top.begin() + std::min<std::ptrdiff_t>(10, static_cast<std::ptrdiff_t>(top.size())),
+                              top.end(), std::greater<>());
+            return borrows + fined + (top.empty() ? 0 : top.front().second);
+        });
+        time("window", passes * 100, [&] { return static_cast<size_t>(stats.window(7, now).totalBorrows()); });
+        time("top", passes * 100, [&] { return stats.top(10, now).size(); });
+        run.seconds = std::chrono::duration<double>(clock::now() - t0).count();
+        return run;
     }
 
-    // reserve item for user
-    void reserveItem(int userId, int itemId) {
-        auto userOpt = users_.findById(userId);
-        if (!userOpt) throw NotFoundException("User not found");
-        auto itemOpt = items_.findById(itemId);
-        if (!itemOpt) throw NotFoundException("Item not found");
-        auto item = *itemOpt;
-        if (item->status() != AvailabilityStatus::AVAILABLE) throw BorrowException("Only available items can be reserved");
-        item->setStatus(AvailabilityStatus::RESERVED);
-        reservations_[itemId] = userId;
-        cout << "Reserved item " << itemId << " for user " << userId << "\n";
+    // Return and renew latency against a history of 10^4 returned records,
+    // then ten times as many, up to --history; one run per size. Each timed
+    // pair follows an untimed borrow of a random item, so the lookups go
+    // through item and user indexes that hold the whole history.
+    vector<Run> runHistory() const {
+        vector<size_t> sizes;
+        for (size_t n = 10000; n <= cfg_.history; n *= 10) sizes.push_back(n);
+        if (sizes.empty()) sizes.push_back(cfg_.history);
+        vector<Run> runs;
+        for (size_t n : sizes) {
+            ItemRepo items;
+            UserRepo users;
+            BorrowRecordRepo records;
+            FineRepo fines;
+            LibraryService lib(items, users, records, fines, Money::fromINR(10.0));
+            fillCatalog(lib);
+            Rng rng(11);
+            fillHistory(records, fines, rng, n);
+
+            enum { HRenew, HReturn, kHOps };
+            static constexpr const char* names[kHOps] = {"renew", "return"};
+            vector<uint32_t> ns[kHOps];
+            size_t failed[kHOps] = {};
+            Run run{"history-" + to_string(n), 1, 0, {}};
+            auto t0 = clock::now();
+            for (size_t k = 0; k < cfg_.opsPerThread; ++k) {
+                int user = rng.upTo(cfg_.users), item = rng.upTo(cfg_.items);
+                try {
+                    lib.borrowItem(user, item, "14 days");
+                } catch (const LibraryException&) {
+                    continue;
+                }
+                auto timed = [&](int op, auto&& call) {
+                    auto t1 = clock::now();
+                    try {
+                        call();
+                    } catch (const LibraryException&) {
+                        ++failed[op];
+                    }
+                    ns[op].push_back(since(t1));
+                };
+                timed(HRenew, [&] { lib.renewBorrow(user, item, "1 day"); });
+                timed(HReturn, [&] { lib.returnItem(user, item); });
+            }
+            run.seconds = std::chrono::duration<double>(clock::now() - t0).count();
+            for (int op = 0; op < kHOps; ++op) run.ops.push_back(summarize(names[op], ns[op], failed[op], run.seconds));
+            runs.push_back(move(run));
+        }
+        return runs;
     }
 
-    void cancelReservation(int userId, int itemId) {
-        auto it = reservations_.find(itemId);
-        if (it == reservations_.end()) throw BorrowException("No reservation found for item");
-        if (it->second != userId) throw BorrowException("Only reserving user can cancel reservation");
-        reservations_.erase(itemId);
-        auto itemOpt = items_.findById(itemId);
-        if (itemOpt) (*itemOpt)->setStatus(AvailabilityStatus::AVAILABLE);
-        cout << "Cancelled reservation for item " << itemId << " by user " << userId << "\n";
+    // footprint of the borrow-history, fine and item stores, and the cost of
+    // scanning the history whole and per user
+    Run runRecords() const {
+        BorrowRecordRepo records;
+        FineRepo fines;
+        Rng rng(5);
+        auto now = system_clock::now();
+        vector<uint32_t> adds, fineAdds, scans, userScans, fineScans;
+        adds.reserve(cfg_.history);
+        fineAdds.reserve(cfg_.history / 10 + 1);
+        auto t0 = clock::now();
+        size_t heap0 = heapBytes();
+        for (size_t h = 0; h < cfg_.history; ++h) {
+            int item = rng.upTo(cfg_.items), user = rng.upTo(cfg_.users);
+            auto at = now - hours(24 * static_cast<int>(30 + h % 700));
+            auto t1 = clock::now();
+            records.markReturned(*records.add(item, user, at, at + hours(24 * 14)), at + hours(24 * 10));
+            adds.push_back(since(t1));
+        }
+        size_t heap1 = heapBytes();
+        for (size_t h = 0; h < cfg_.history; h += 10) {
+            auto t1 = clock::now();
+            fines.addFine(rng.upTo(cfg_.items), rng.upTo(cfg_.users), Money(1000), FineReason::Overdue, 1, now);
+            fineAdds.push_back(since(t1));
+        }
+        size_t heap2 = heapBytes();
+
+        // Items as a feed describes them: unique titles, one to three authors
+        // out of 5000 names and three metadata fields from short lists. Then
+        // the same fields in plain strings and a std::map, as Item kept them
+        // before the string pool.
+        struct PlainItem {
+            std::atomic<uint64_t> state{0};
+            int id = 0;
+            string title;
+            vector<string> authors;
+            map<string, string> metadata;
+            int pages = 0;
+            virtual ~PlainItem() = default;
+        };
+        static const char* languages[] = {"English", "Hindi", "Tamil", "French"};
+        static const char* formats[] = {"hardcover", "paperback", "large print"};
+        auto describe = [](size_t i, auto&& set) {
+            vector<string> authors;
+            for (size_t a = 0; a <= i % 3; ++a) authors.push_back("Author Firstname Lastname " + to_string((i * 7 + a) % 5000));
+            set(static_cast<int>(i), "Title " + to_string(i) + " topic" + to_string(i % 997), authors,
+                languages[i % 4], "Publishing House " + to_string(i % 200), formats[i % 3]);
+        };
+        vector<uint32_t> itemAdds, plainAdds;
+        vector<shared_ptr<Item>> itemsHeld;
+        vector<shared_ptr<PlainItem>> plainHeld;
+        itemsHeld.reserve(cfg_.items);
+        plainHeld.reserve(cfg_.items);
+        size_t heap3 = heapBytes();
+        for (size_t i = 1; i <= cfg_.items; ++i)
+            describe(i, [&](int id, string title, const vector<string>& authors, const char* lang, const string& publisher,
+                            const char* format) {
+                auto t1 = clock::now();
+                auto item = make_shared<Book>(id, move(title), authors, 100);
+                item->setMetadata("language", lang);
+                item->setMetadata("publisher", publisher);
+                item->setMetadata("format", format);
+                itemsHeld.push_back(move(item));
+                itemAdds.push_back(since(t1));
+            });
+        size_t heap4 = heapBytes();
+        for (size_t i = 1; i <= cfg_.items; ++i)
+            describe(i, [&](int id, string title, const vector<string>& authors, const char* lang, const string& publisher,
+                            const char* format) {
+                auto t1 = clock::now();
+                auto item = make_shared<PlainItem>();
+                item->id = id;
+                item->title = move(title);
+                item->authors = authors;
+                item->metadata["language"] = lang;
+                item->metadata["publisher"] = publisher;
+                item->metadata["format"] = format;
+                item->pages = 100;
+                plainHeld.push_back(move(item));
+                plainAdds.push_back(since(t1));
+            });
+        size_t heap5 = heapBytes();
+
+        int64_t sink = 0;
+        for (int pass = 0; pass < 5; ++pass) {
+            auto t1 = clock::now();
+            records.forEach([&](const BorrowRecord& r) { sink += r.dueAt() < now; });
+            scans.push_back(since(t1));
+        }
+        for (size_t u = 1; u <= cfg_.users; ++u) {
+            auto t1 = clock::now();
+            for (auto* r : records.findByUserId(static_cast<int>(u))) sink += r->itemId();
+            userScans.push_back(since(t1));
+            t1 = clock::now();
+            for (auto* f : fines.findByUserId(static_cast<int>(u))) sink += f->amount().paise();
+            fineScans.push_back(since(t1));
+        }
+        Run run{"records", 1, std::chrono::duration<double>(clock::now() - t0).count(), {}};
+        volatile int64_t keep = sink;   // keeps the scans from being optimised away
+        (void)keep;
+        double elapsed = run.seconds;
+        run.ops.push_back(summarize("add", adds, 0, elapsed));
+        run.ops.back().bytesPer = adds.empty() ? 0 : static_cast<double>(heap1 - heap0) / adds.size();
+        run.ops.push_back(summarize("fine", fineAdds, 0, elapsed));
+        run.ops.back().bytesPer = fineAdds.empty() ? 0 : static_cast<double>(heap2 - heap1) / fineAdds.size();
+        run.ops.push_back(summarize("item", itemAdds, 0, elapsed));
+        run.ops.back().bytesPer = itemAdds.empty() ? 0 : static_cast<double>(heap4 - heap3) / itemAdds.size();
+        run.ops.push_back(summarize("item-plain", plainAdds, 0, elapsed));
+        run.ops.back().bytesPer = plainAdds.empty() ? 0 : static_cast<double>(heap5 - heap4) / plainAdds.size();
+        run.ops.push_back(summarize("scan", scans, 0, elapsed));
+        run.ops.push_back(summarize("user-hist", userScans, 0, elapsed));
+        run.ops.push_back(summarize("user-fine", fineScans, 0, elapsed));
+        return run;
     }
 
-    // list overdue borrow records
-    vector<shared_ptr<BorrowRecord>> listOverdueRecords() const {
-        vector<shared_ptr<BorrowRecord>> res;
-        for (auto &r : records_.all()) {
-            if (r->status() == BorrowStatus::ACTIVE && r->isOverdue()) res.push_back(r);
+    // time to bring a service back from the journal written by a mix of
+    // item/user adds and history borrow/return pairs
+    vector<Run> runRecovery() const {
+        std::filesystem::remove_all(cfg_.dir);
+        size_t cycles = cfg_.history / 2;
+        {
+            ItemRepo items;
+            UserRepo users;
+            BorrowRecordRepo records;
+            FineRepo fines;
+            LibraryService lib(items, users, records, fines, Money::fromINR(10.0));
+            Journal journal(cfg_.dir, Journal::Durability::Async);
+            lib.attachJournal(journal, 0);
+            vector<shared_ptr<Item>> batch;
+            for (size_t i = 1; i <= cfg_.items; ++i) {
+                batch.push_back(makeItem(static_cast<int>(i)));
+                if (batch.size() == 10000 || i == cfg_.items) { lib.addItems(batch); batch.clear(); }
+            }
+            vector<shared_ptr<User>> us;
+            for (size_t u = 1; u <= cfg_.users; ++u) us.push_back(make_shared<User>(static_cast<int>(u), "user" + to_string(u), 1000));
+            lib.addUsers(us);
+            Rng rng(3);
+            auto deferred = lib.deferDurability();
+            for (size_t c = 0; c < cycles; ++c) {
+                int user = rng.upTo(cfg_.users), item = rng.upTo(cfg_.items);
+                try {
+                    lib.borrowItem(user, item, "14 days");
+                    lib.returnItem(user, item);
+                } catch (const LibraryException&) {}
+            }
         }
-        return res;
+        vector<Run> runs;
+        auto replay = [&](const string& name, bool snapshotFirst) {
+            ItemRepo items;
+            UserRepo users;
+            BorrowRecordRepo records;
+            FineRepo fines;
+            LibraryService lib(items, users, records, fines, Money::fromINR(10.0));
+            Journal journal(cfg_.dir, Journal::Durability::Async);
+            auto t0 = clock::now();
+            size_t n = lib.attachJournal(journal, 0);
+            Run run{name, 1, std::chrono::duration<double>(clock::now() - t0).count(), {}};
+            OpStats s;
+            s.op = "entries";
+            s.count = n;
+            s.opsPerSec = run.seconds > 0 ? n / run.seconds : 0;
+            run.ops.push_back(s);
+            runs.push_back(run);
+            if (snapshotFirst) lib.checkpoint();
+        };
+        replay("recovery-wal", true);
+        replay("recovery-snapshot", false);
+        std::filesystem::remove_all(cfg_.dir);
+        return runs;
     }
 
-    // get active borrows for a user
-    vector<shared_ptr<BorrowRecord>> getActiveBorrowsForUser(int userId) const {
-        return records_.findActiveByUserId(userId);
+public:
+    explicit Benchmark(Config cfg) : cfg_(move(cfg)) {
+        cfg_.items = std::max<size_t>(1, cfg_.items);
+        cfg_.users = std::max<size_t>(1, cfg_.users);
     }
 
-    // get fines for a user
-    vector<shared_ptr<Fine>> getFinesForUser(int userId) const {
-        return fines_.findByUserId(userId);
+    // scenario: mix | stress | repo | recovery | history | records | weeks | sweep | items | circulation | durations | all
+    vector<Run> run(const string& scenario) const {
+        vector<Run> runs;
+        bool all = scenario == "all";
+        if (!all && scenario != "mix" && scenario != "repo" && scenario != "recovery" && scenario != "records"
+            && scenario != "history" && scenario != "weeks" && scenario != "sweep" && scenario != "items"
+            && scenario != "circulation" && scenario != "stress" && scenario != "durations")
+            throw InvalidInputException("Unknown benchmark scenario '" + scenario + "'");
+        for (unsigned t : cfg_.threads) {
+            if (all || scenario == "mix") runs.push_back(runMix(t));
+            if (all || scenario == "stress") {
+                runs.push_back(runStress(t, true));
+                runs.push_back(runStress(t, false));
+            }
+            if (all || scenario == "repo") {
+                runs.push_back(runRepo<InMemoryRepo<User, StripedLocks<16>>>("repo-striped", t));
+                runs.push_back(runRepo<InMemoryRepo<User, SingleLock>>("repo-single", t));
+                runs.push_back(runRepo<InMemoryRepo<User, StripedLocks<16>, FlatStorage>>("repo-flat", t));
+                runs.push_back(runRepo<InMemoryRepo<User, StripedLocks<16>, DenseStorage>>("repo-dense", t));
+            }
+            if (all || scenario == "weeks") runs.push_back(runWeeks(t));
+        }
+        if (all || scenario == "recovery") for (auto& r : runRecovery()) runs.push_back(move(r));
+        if (all || scenario == "history") for (auto& r : runHistory()) runs.push_back(move(r));
+        if (all || scenario == "records") runs.push_back(runRecords());
+        if (all || scenario == "items") runs.push_back(runItems());
+        if (all || scenario == "circulation") runs.push_back(runCirculation());
+        if (all || scenario == "sweep") for (auto& r : runSweep()) runs.push_back(move(r));
+        if (all || scenario == "durations") runs.push_back(runDurations());
+        return runs;
     }
 
-    vector<shared_ptr<Item>> searchByType(const string& typeName) {
-        return items_.findByType(typeName);
+    static void printTable(const vector<Run>& runs, std::ostream& out) {
+        for (auto& run : runs) {
+            out << run.scenario << ", " << run.threads << " thread(s), " << std::fixed << std::setprecision(3)
+                << run.seconds << " s\n";
+            out << "  " << std::left << std::setw(10) << "op" << std::right << std::setw(10) << "count"
+                << std::setw(9) << "failed" << std::setw(13) << "ops/s" << std::setw(10) << "p50 us"
+                << std::setw(10) << "p99 us" << std::setw(10) << "p999 us";
+            bool bytes = std::any_of(run.ops.begin(), run.ops.end(), [](auto& s) { return s.bytesPer > 0; });
+            out << (bytes ? "   bytes/entry\n" : "\n");
+            for (auto& s : run.ops) {
+                out << "  " << std::left << std::setw(10) << s.op << std::right << std::setw(10) << s.count
+                    << std::setw(9) << s.failed << std::setprecision(0) << std::setw(13) << s.opsPerSec
+                    << std::setprecision(2) << std::setw(10) << s.p50us << std::setw(10) << s.p99us
+                    << std::setw(10) << s.p999us;
+                if (bytes && s.bytesPer > 0) out << std::setprecision(1) << std::setw(14) << s.bytesPer;
+                out << "\n";
+            }
+        }
+        out.unsetf(std::ios::fixed);
     }
 
-    void archiveMagazine(int itemId) {
-        auto itemOpt = items_.findById(itemId);
-        if (!itemOpt) throw NotFoundException("Item not found");
-        auto it = *itemOpt;
-        auto mag = std::dynamic_pointer_cast<EMagazine>(it);
-        if (!mag) throw ArchiveException("Item is not an EMagazine");
-        mag->archiveIssue();
-        cout << "Archived magazine item " << itemId << "\n";
+    void printJson(const vector<Run>& runs, std::ostream& out) const {
+        out << "{\"config\":{\"items\":" << cfg_.items << ",\"users\":" << cfg_.users << ",\"history\":" << cfg_.history
+            << ",\"opsPerThread\":" << cfg_.opsPerThread << "},\"runs\":[";
+        for (size_t i = 0; i < runs.size(); ++i) {
+            auto& run = runs[i];
+            out << (i ? "," : "") << "{\"scenario\":\"" << run.scenario << "\",\"threads\":" << run.threads
+                << ",\"seconds\":" << run.seconds << ",\"ops\":[";
+            for (size_t k = 0; k < run.ops.size(); ++k) {
+                auto& s = run.ops[k];
+                out << (k ? "," : "") << "{\"op\":\"" << s.op << "\",\"count\":" << s.count << ",\"failed\":" << s.failed
+                    << ",\"opsPerSec\":" << s.opsPerSec << ",\"p50us\":" << s.p50us << ",\"p99us\":" << s.p99us
+                    << ",\"p999us\":" << s.p999us;
+                if (s.bytesPer > 0) out << ",\"bytesPer\":" << s.bytesPer;
+                out << "}";
+            }
+            out << "]}";
+        }
+        out << "]}\n";
     }
 };
 
 
-int main() {
+int main(int argc, char** argv) {
+    // --data <dir>: persist to a WAL + snapshot in dir and recover from it on start
+    // --catalog <file>: serve items from a memory-mapped catalog image
+    // --export-catalog <file>: write the current items as a catalog image on start
+    // --import <file>: bulk-load items/users from a .csv or .jsonl feed (repeatable)
+    // --batch <file|->: run the commands in file (or stdin) headless instead of the menu
+    // --serve <port>: serve the batch command set over TCP on 127.0.0.1 until SIGINT/SIGTERM
+    // --loadgen <port> [--rate <req/s>] [--seconds <n>] [--connections <n>] [--requests <file>]:
+    //     drive a running server and report latency percentiles; nothing else is started
+    // --bench <mix|stress|repo|recovery|history|records|weeks|sweep|items|circulation|durations|all> [--items <n>] [--users <n>] [--history <n>] [--ops <n>]
+    //     [--days <n>] [--threads <n,n,...>] [--json <file>]: run the synthetic benchmarks and exit
+    // --metrics <file>: write the Prometheus-style metrics dump there on exit
+    // --fine-limit <INR>: refuse borrows by users owing more than this in fines
+    // --pickup <duration>: how long a ready hold waits to be borrowed (default 72h)
+    // --events <file>: append the service event log there (the menu logs to stdout by default)
+    // --clock <system|coarse|sim>: wall clock, wall clock cached every 1 ms, or a simulated clock
+    //     that starts at the current time and moves only on the batch command "advance <duration>"
+    //     (with --data, a restart resumes as far ahead of the current time as the last run got)
+    string dataDir, catalogFile, exportFile, batchFile, requestsFile, metricsFile, eventsFile;
+    int servePort = -1, loadgenPort = -1;
+    double rate = 1000, loadSeconds = 10;
+    unsigned connections = 8;
+    string benchScenario, benchJson;
+    Benchmark::Config bench;
+    vector<string> imports;
+    optional<Money> fineLimit;
+    string clockName = "system";
+    string pickup;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--data" && i + 1 < argc) dataDir = argv[++i];
+        else if (arg == "--catalog" && i + 1 < argc) catalogFile = argv[++i];
+        else if (arg == "--export-catalog" && i + 1 < argc) exportFile = argv[++i];
+        else if (arg == "--import" && i + 1 < argc) imports.push_back(argv[++i]);
+        else if (arg == "--batch" && i + 1 < argc) batchFile = argv[++i];
+        else if (arg == "--serve" && i + 1 < argc) servePort = std::atoi(argv[++i]);
+        else if (arg == "--loadgen" && i + 1 < argc) loadgenPort = std::atoi(argv[++i]);
+        else if (arg == "--rate" && i + 1 < argc) rate = std::atof(argv[++i]);
+        else if (arg == "--seconds" && i + 1 < argc) loadSeconds = std::atof(argv[++i]);
+        else if (arg == "--connections" && i + 1 < argc) connections = static_cast<unsigned>(std::atoi(argv[++i]));
+        else if (arg == "--requests" && i + 1 < argc) requestsFile = argv[++i];
+        else if (arg == "--bench" && i + 1 < argc) benchScenario = argv[++i];
+        else if (arg == "--items" && i + 1 < argc) bench.items = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--users" && i + 1 < argc) bench.users = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--history" && i + 1 < argc) bench.history = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--ops" && i + 1 < argc) bench.opsPerThread = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--days" && i + 1 < argc) bench.days = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--clock" && i + 1 < argc) clockName = argv[++i];
+        else if (arg == "--json" && i + 1 < argc) benchJson = argv[++i];
+        else if (arg == "--metrics" && i + 1 < argc) metricsFile = argv[++i];
+        else if (arg == "--events" && i + 1 < argc) eventsFile = argv[++i];
+        else if (arg == "--fine-limit" && i + 1 < argc) fineLimit = Money::fromINR(std::atof(argv[++i]));
+        else if (arg == "--pickup" && i + 1 < argc) pickup = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc) {
+            bench.threads.clear();
+            std::stringstream list(argv[++i]);
+            for (string t; std::getline(list, t, ',');) if (std::atoi(t.c_str()) > 0) bench.threads.push_back(std::atoi(t.c_str()));
+            if (bench.threads.empty()) bench.threads.push_back(1);
+        }
+        else {
+            cerr << "Usage: " << argv[0] << " [--data <dir>] [--catalog <file>] [--export-catalog <file>] [--import <file>]..."
+                 << " [--metrics <file>] [--fine-limit <INR>] [--pickup <duration>] [--events <file>]"
+                 << " [--clock <system|coarse|sim>] [--batch <file|-> | --serve <port>]\n"
+                 << "       " << argv[0] << " --loadgen <port> [--rate <req/s>] [--seconds <n>] [--connections <n>]"
+                 << " [--requests <file>]\n"
+                 << "       " << argv[0] << " --bench <mix|stress|repo|recovery|history|records|weeks|sweep|items|circulation|durations|all> [--items <n>] [--users <n>] [--history <n>]"
+                 << " [--ops <n>] [--days <n>] [--threads <n,n,...>] [--json <file>]\n";
+            return 2;
+        }
+    }
+    if (!benchScenario.empty()) {
+        if (!dataDir.empty()) bench.dir = std::filesystem::path(dataDir) / "bench";
+        try {
+            Benchmark b(bench);
+            auto runs = b.run(benchScenario);
+            Benchmark::printTable(runs, cout);
+            if (!benchJson.empty()) {
+                std::ofstream json(benchJson);
+                if (!json) { cerr << "Error: cannot write " << benchJson << "\n"; return 1; }
+                b.printJson(runs, json);
+            }
+            for (auto& run : runs)
+                for (auto& s : run.ops)
+                    if (s.op == "invariants" && s.failed) {
+                        cerr << "Error: " << s.failed << " invariant(s) broken in " << run.scenario << "\n";
+                        return 1;
+                    }
+        } catch (const std::exception& e) {
+            cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+#ifndef __linux__
+    if (servePort >= 0 || loadgenPort >= 0) {
+        cerr << "Error: --serve and --loadgen are only available on Linux\n";
+        return 2;
+    }
+#else
+    if (loadgenPort >= 0) {
+        // default mix against the demo data: searches plus a borrow/return pair
+        vector<string> requests = {"search design", "type Book", "borrow 201 101 7 days", "return 201 101", "borrows 201"};
+        if (!requestsFile.empty()) {
+            std::ifstream in(requestsFile);
+            if (!in) { cerr << "Error: cannot open " << requestsFile << "\n"; return 1; }
+            requests.clear();
+            for (string line; std::getline(in, line);)
+                if (!line.empty() && line[0] != '#') requests.push_back(line);
+        }
+        try {
+            auto rep = LoadGenerator(static_cast<uint16_t>(loadgenPort), requests).run(rate, loadSeconds, connections);
+            cout << std::fixed << std::setprecision(1)
+                 << "target " << rate << " req/s, achieved " << rep.achievedRate() << " req/s over " << connections
+                 << " connections\n"
+                 << "sent " << rep.sent << ", answered " << rep.received << " (" << rep.failed << " with error)\n"
+                 << "latency p50 " << rep.p50us << " us, p99 " << rep.p99us << " us, p999 " << rep.p999us << " us\n";
+        } catch (const std::exception& e) {
+            cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        return 0;
+    }
+#endif
+
+    // in batch mode stdout carries the results, so startup notes go to stderr
+    std::ostream& info = batchFile.empty() ? cout : cerr;
+
     ItemRepo itemRepo;
     UserRepo userRepo;
     BorrowRecordRepo recordRepo;
     FineRepo fineRepo;
 
-    auto book1 = make_shared<Book>(101, "Design Patterns", vector<string>{"Gamma","Helm","Johnson","Vlissides"}, 395);
-    auto audio1 = make_shared<Audiobook>(102, "Clean Code (Audio)", vector<string>{"Robert C. Martin"}, hours(9), "Narrator A");
-    auto mag1 = make_shared<EMagazine>(103, "Tech Monthly", vector<string>{"Editorial Team"}, 15, system_clock::now());
+    auto dumpMetrics = [&] {
+        if (metricsFile.empty()) return;
+        std::ofstream out(metricsFile);
+        if (out) out << metrics::prometheus();
+        else cerr << "Error: cannot write " << metricsFile << "\n";
+    };
+
+    std::unique_ptr<EventLog> events;
+    try {
+        if (!eventsFile.empty()) events = std::make_unique<EventLog>(eventsFile);
+        else if (batchFile.empty() && servePort < 0) events = std::make_unique<EventLog>(cout);
+    } catch (const std::exception& e) {
+        cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    std::unique_ptr<Clock> clock;
+    SimulatedClock* simClock = nullptr;
+    if (clockName == "coarse") {
+        clock = std::make_unique<CoarseClock>();
+    } else if (clockName == "sim") {
+        auto sim = std::make_unique<SimulatedClock>();
+        simClock = sim.get();
+        clock = move(sim);
+    } else if (clockName != "system") {
+        cerr << "Error: unknown clock '" << clockName << "'\n";
+        return 2;
+    }
+
+    std::unique_ptr<Journal> journal;
+    LibraryService lib(itemRepo, userRepo, recordRepo, fineRepo, Money::fromINR(10.0), clock ? *clock : systemClock());
+    lib.setFineLimit(fineLimit);
+    lib.setEventLog(events.get());
+    if (!pickup.empty()) {
+        try {
+            auto now = lib.clock().now();
+            auto window = BorrowDuration::parse(pickup).computeDueAt(now) - now;
+            if (window <= system_clock::duration::zero()) throw InvalidInputException("Pickup window must be positive");
+            lib.setPickupWindow(window);
+        } catch (const std::exception& e) {
+            cerr << "Error: " << e.what() << "\n";
+            return 2;
+        }
+    }
+    if (!catalogFile.empty()) {
+        try {
+            itemRepo.attachCatalog(make_shared<CatalogImage>(catalogFile));
+        } catch (const std::exception& e) {
+            cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+    if (!dataDir.empty()) {
+        try {
+            journal = std::make_unique<Journal>(dataDir);
+            auto t0 = std::chrono::steady_clock::now();
+            size_t n = lib.attachJournal(*journal);
+            if (simClock) simClock->setOffset(lib.clockOffset());   // resume where the last run left the clock
+            auto ms = duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+            info << "Recovered " << n << " journal entries from " << dataDir << " in " << ms << " ms\n";
+        } catch (const std::exception& e) {
+            cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
 
-    itemRepo.save(book1, book1->id());
-    itemRepo.save(audio1, audio1->id());
-    itemRepo.save(mag1, mag1->id());
+    if (itemRepo.size() == 0) {
+        lib.addItem(make_shared<Book>(101, "Design Patterns", vector<string>{"Gamma","Helm","Johnson","Vlissides"}, 395));
+        lib.addItem(make_shared<Audiobook>(102, "Clean Code (Audio)", vector<string>{"Robert C. Martin"}, hours(9), "Narrator A"));
+        lib.addItem(make_shared<EMagazine>(103, "Tech Monthly", vector<string>{"Editorial Team"}, 15, lib.clock().now()));
+    }
+    if (userRepo.size() == 0) lib.addUser(make_shared<User>(201, "Somen Mishra", 5));
+    for (auto& path : imports) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) { cerr << "Error: cannot open " << path << "\n"; continue; }
+        auto stats = BulkImporter(lib).import(in, BulkImporter::formatFor(path));
+        info << "Imported " << path << ": " << stats.items << " items, " << stats.users << " users, "
+             << stats.failed << " rejected of " << stats.rows << " rows in " << std::fixed << std::setprecision(2)
+             << stats.seconds << " s (" << static_cast<long long>(stats.rowsPerSecond()) << " rows/s)\n";
+        info.unsetf(std::ios::fixed);
+        for (auto& e : stats.errors) cerr << "  line " << e.line << ": " << e.message << "\n";
+        if (stats.failed > stats.errors.size()) cerr << "  ... " << (stats.failed - stats.errors.size()) << " more\n";
+    }
+    if (!exportFile.empty()) {
+        try {
+            CatalogImage::write(exportFile, itemRepo.all());
+            info << "Exported " << itemRepo.size() << " items to " << exportFile << "\n";
+        } catch (const std::exception& e) {
+            cerr << "Error: " << e.what() << "\n";
+        }
+    }
 
-    auto user1 = make_shared<User>(201, "Somen Mishra", 5);
-    userRepo.save(user1, user1->id());
+#ifdef __linux__
+    if (servePort >= 0) {
+        try {
+            BatchRunner runner(lib);
+            runner.setSimulatedClock(simClock);
+            NetServer server(runner, static_cast<uint16_t>(servePort));
+            g_server = &server;
+            lib.startHoldExpiry();   // watchers hear about handed-on holds without waiting for traffic
+            std::signal(SIGINT, [](int) { if (g_server) g_server->stop(); });
+            std::signal(SIGTERM, [](int) { if (g_server) g_server->stop(); });
+            cout << "Serving on 127.0.0.1:" << server.port() << "\n" << std::flush;
+            server.run();
+            lib.stopHoldExpiry();
+            g_server = nullptr;
+        } catch (const std::exception& e) {
+            cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+        dumpMetrics();
+        if (journal) {
+            try { lib.checkpoint(); } catch (const std::exception& e) { cerr << "Error: " << e.what() << "\n"; return 1; }
+        }
+        return 0;
+    }
+#endif
 
-    LibraryService lib(itemRepo, userRepo, recordRepo, fineRepo, Money::fromINR(10.0));
+    if (!batchFile.empty()) {
+        std::ifstream file;
+        if (batchFile != "-") {
+            file.open(batchFile, std::ios::binary);
+            if (!file) { cerr << "Error: cannot open " << batchFile << "\n"; return 1; }
+        }
+        BatchRunner runner(lib);
+        runner.setSimulatedClock(simClock);
+        auto stats = runner.run(batchFile == "-" ? std::cin : file, cout);
+        cerr << "Ran " << stats.commands << " commands (" << stats.failed << " failed) in " << std::fixed
+             << std::setprecision(2) << stats.seconds << " s (" << static_cast<long long>(stats.commandsPerSecond())
+             << " commands/s)\n";
+        dumpMetrics();
+        if (journal) {
+            try { lib.checkpoint(); } catch (const std::exception& e) { cerr << "Error: " << e.what() << "\n"; return 1; }
+        }
+        return 0;
+    }
 
     while (true) {
+        // let the previous command's events reach the screen before the menu
+        if (events) events->flush();
         cout << "\n--- LibraNet Menu ---\n";
         cout << "1. Borrow Item\n";
         cout << "2. Return Item\n";
@@ -592,6 +8331,10 @@ int main() {
         cout << "10. List Overdue\n";
         cout << "11. View User Borrows\n";
         cout << "12. View User Fines\n";
+        cout << "13. Keyword Search\n";
+        cout << "14. Complete Keyword\n";
+        cout << "15. Pay Fine\n";
+        cout << "16. Top Debtors\n";
         cout << "0. Exit\n";
         cout << "Choice: ";
 
@@ -643,19 +8386,19 @@ int main() {
                     cout << "Enter page count: ";
                     std::cin >> pages;
                     auto book = make_shared<Book>(id, title, vector<string>{"Unknown"}, pages);
-                    itemRepo.save(book, book->id());
+                    lib.addItem(book);
                     cout << "Book added: " << title << "\n";
                 } else if (t == 2) {
                     cout << "Enter duration (hours): ";
                     std::cin >> hoursDur;
                     auto audio = make_shared<Audiobook>(id, title, vector<string>{"Unknown"}, hours(hoursDur), "Narrator");
-                    itemRepo.save(audio, audio->id());
+                    lib.addItem(audio);
                     cout << "Audiobook added: " << title << "\n";
                 } else if (t == 3) {
                     cout << "Enter issue number: ";
                     std::cin >> issueNum;
-                    auto mag = make_shared<EMagazine>(id, title, vector<string>{"Editorial"}, issueNum, system_clock::now());
-                    itemRepo.save(mag, mag->id());
+                    auto mag = make_shared<EMagazine>(id, title, vector<string>{"Editorial"}, issueNum, lib.clock().now());
+                    lib.addItem(mag);
                     cout << "Magazine added: " << title << "\n";
                 } else {
                     cout << "Invalid type!\n";
@@ -670,7 +8413,7 @@ int main() {
                 std::getline(std::cin, name);
                 cout << "Enter borrow limit: "; std::cin >> limit;
                 auto user = make_shared<User>(userId, name, limit);
-                userRepo.save(user, user->id());
+                lib.addUser(user);
                 cout << "User added: " << name << " (id=" << userId << ")\n";
 
             } else if (choice == 7) {
@@ -684,7 +8427,7 @@ int main() {
             } else if (choice == 8) {
                 int userId, itemId;
                 cout << "Enter userId itemId to reserve: "; std::cin >> userId >> itemId;
-                lib.reserveItem(userId, itemId);
+                if (size_t place = lib.reserveItem(userId, itemId)) cout << "Queued, position " << place << "\n";
 
             } else if (choice == 9) {
                 int userId, itemId;
@@ -694,7 +8437,7 @@ int main() {
             } else if (choice == 10) {
                 auto overdue = lib.listOverdueRecords();
                 if (overdue.empty()) cout << "No overdue records\n";
-                for (auto &r: overdue) cout << "Overdue: rec=" << r->id() << " item=" << r->itemId() << " user=" << r->userId() << " due=" << formatTime(r->dueAt()) << "\n";
+                for (auto &r: overdue) cout << "Overdue: rec=" << r.id() << " item=" << r.itemId() << " user=" << r.userId() << " due=" << formatTime(r.dueAt()) << "\n";
 
             } else if (choice == 11) {
                 int userId; cout << "Enter userId: "; std::cin >> userId;
@@ -707,6 +8450,43 @@ int main() {
                 auto fines = lib.getFinesForUser(userId);
                 if (fines.empty()) cout << "No fines for user " << userId << "\n";
                 for (auto &f: fines) cout << "Fine id=" << f->id() << " amount=" << f->amount().str() << " reason=" << f->reason() << "\n";
+                cout << "Outstanding: " << lib.getOutstandingBalance(userId).str() << "\n";
+
+            } else if (choice == 13) {
+                string query, type, avail;
+                cout << "Enter keywords (word* for prefix): ";
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                std::getline(std::cin, query);
+                cout << "Type filter (Book/Audiobook/EMagazine/any): "; std::cin >> type;
+                cout << "Available only (y/n): "; std::cin >> avail;
+                optional<ItemKind> kind;
+                if (type == "Book") kind = ItemKind::Book;
+                else if (type == "Audiobook") kind = ItemKind::Audiobook;
+                else if (type == "EMagazine") kind = ItemKind::EMagazine;
+                auto res = lib.searchItems(query, kind, avail == "y" || avail == "Y");
+                if (res.empty()) cout << "No items match '" << query << "'\n";
+                for (auto &it : res) cout << "Found: " << it->id() << " - " << it->title() << " [" << it->typeName() << "]\n";
+
+            } else if (choice == 14) {
+                string prefix;
+                cout << "Enter prefix: "; std::cin >> prefix;
+                auto words = lib.completeKeyword(prefix);
+                if (words.empty()) cout << "No completions for " << prefix << "\n";
+                for (auto &w : words) cout << "  " << w << "\n";
+
+            } else if (choice == 15) {
+                int userId; double amount; string waive;
+                cout << "Enter userId: "; std::cin >> userId;
+                cout << "Amount (INR): "; std::cin >> amount;
+                cout << "Waive instead of pay (y/n): "; std::cin >> waive;
+                Money left = lib.settleFines(userId, Money::fromINR(amount), waive == "y" || waive == "Y");
+                cout << "Outstanding: " << left.str() << "\n";
+
+            } else if (choice == 16) {
+                size_t n; cout << "How many: "; std::cin >> n;
+                auto debtors = lib.topDebtors(n);
+                if (debtors.empty()) cout << "No outstanding fines\n";
+                for (auto &[userId, owed] : debtors) cout << "User " << userId << " owes " << owed.str() << "\n";
             }
 
         } catch (const std::exception& e) {
@@ -714,6 +8494,10 @@ int main() {
         }
     }
 
+    dumpMetrics();
+    if (journal) {
+        try { lib.checkpoint(); } catch (const std::exception& e) { cerr << "Error: " << e.what() << "\n"; }
+    }
     cout << "Exiting LibraNet...\n";
     return 0;
 }